@@ -38,9 +38,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <sys/uio.h>
 
 #include "echttp.h"
 #include "echttp_cors.h"
+#include "echttp_json.h"
 #include "echttp_static.h"
 #include "echttp_libc.h"
 
@@ -53,39 +55,69 @@
 #include "housedepositor.h"
 #include "housedepositorstate.h"
 
+#include "housedcc_json.h"
+#include "housedcc_metrics.h"
+#include "housedcc_timer.h"
+#include "housedcc_event.h"
+#include "housedcc_pipe.h"
 #include "housedcc_pidcc.h"
+#include "housedcc_live.h"
 #include "housedcc_fleet.h"
 #include "housedcc_consist.h"
+#include "housedcc_accessory.h"
+#include "housedcc_throttle.h"
 
 #define DEBUG if (echttp_isdebug()) printf
 
-static char JsonBuffer[65537];
+static DccJson JsonBuffer;
+
+// The exported configuration is kept until the configuration changes.
+static DccJson ConfigBuffer;
+static unsigned long ConfigExported = 0;
 
 static int LiveState = -1;
 static int ConfigState = -1;
 
-static int dcc_header (char *buffer, int size, int stateid) {
+static DccJson MetricsBuffer;
+static int RenderMetric = -1;
+
+static void dcc_header (DccJson *json, int stateid) {
+
+    housedcc_json_start (json);
+    housedcc_json_raw (json, "{\"host\":");
+    housedcc_json_string (json, houselog_host());
+    housedcc_json_raw (json, ",\"timestamp\":");
+    housedcc_json_integer (json, (long long)time(0));
+    housedcc_json_raw (json, ",\"latest\":");
+    housedcc_json_integer (json, housestate_current (stateid));
+    housedcc_json_raw (json, ",\"trains\":{\"layout\":");
+    housedcc_json_string (json, housedepositor_group());
+}
 
-    int cursor;
-    cursor = snprintf (buffer, size,
-                       "{\"host\":\"%s\",\"timestamp\":%lld,\"latest\":%lu"
-                           ",\"trains\":{\"layout\":\"%s\"",
-                       houselog_host(),
-                       (long long)time(0),
-                       housestate_current (stateid),
-                       housedepositor_group());
-    return cursor;
+static const char *dcc_result (DccJson *json) {
+
+    if (housedcc_json_failed (json)) {
+        houselog_trace (HOUSE_FAILURE, "BUFFER", "no memory");
+        echttp_error (500, "No memory");
+        return "";
+    }
+    echttp_content_type_json ();
+    return housedcc_json_text (json);
 }
 
-static int dcc_export (void) {
+static void dcc_export (void) {
+
+    unsigned long latest = housestate_current (ConfigState);
+    if ((latest == ConfigExported) &&
+        (housedcc_json_length (&ConfigBuffer) > 0)) return; // Up to date.
 
-    int c = dcc_header (JsonBuffer, sizeof(JsonBuffer), ConfigState);
+    dcc_header (&ConfigBuffer, ConfigState);
+    housedcc_pidcc_export (&ConfigBuffer, ",");
+    housedcc_fleet_export (&ConfigBuffer, ",");
+    housedcc_accessory_export (&ConfigBuffer, ",");
+    housedcc_json_raw (&ConfigBuffer, "}}");
 
-    c += housedcc_pidcc_export (JsonBuffer+c, sizeof(JsonBuffer)-c, ",");
-    c += housedcc_fleet_export (JsonBuffer+c, sizeof(JsonBuffer)-c, ",");
-    c += housedcc_consist_export (JsonBuffer+c, sizeof(JsonBuffer)-c, ",");
-    c += snprintf (JsonBuffer+c, sizeof(JsonBuffer)-c, "}}");
-    return c;
+    ConfigExported = housedcc_json_failed (&ConfigBuffer) ? 0 : latest;
 }
 
 static const char *dcc_save (const char *reason) {
@@ -93,10 +125,44 @@ static const char *dcc_save (const char *reason) {
     housestate_changed (ConfigState);
 
     dcc_export ();
-    houseconfig_save (JsonBuffer, reason);
+    if (! housedcc_json_failed (&ConfigBuffer))
+        houseconfig_save (housedcc_json_text (&ConfigBuffer), reason);
 
-    echttp_content_type_json ();
-    return JsonBuffer;
+    return dcc_result (&ConfigBuffer);
+}
+
+static const char *dcc_render (long long since) {
+
+    long long start = housedcc_metrics_clock ();
+
+    // Revert to a complete status if any module cannot provide a
+    // meaningful partial status.
+    if (since > 0) {
+        if ((! housedcc_fleet_delta (since)) ||
+            (! housedcc_consist_delta (since)) ||
+            (! housedcc_accessory_delta (since))) since = 0;
+    }
+
+    dcc_header (&JsonBuffer, LiveState);
+
+    housedcc_json_raw (&JsonBuffer, ",\"sequence\":");
+    housedcc_json_integer (&JsonBuffer, housedcc_live_sequence());
+    if (housedcc_live_port() > 0) {
+        housedcc_json_raw (&JsonBuffer, ",\"stream\":");
+        housedcc_json_integer (&JsonBuffer, housedcc_live_port());
+    }
+    if (since > 0) {
+        housedcc_json_raw (&JsonBuffer, ",\"since\":");
+        housedcc_json_integer (&JsonBuffer, since);
+    }
+    housedcc_fleet_status (&JsonBuffer, since);
+    housedcc_consist_status (&JsonBuffer, since);
+    housedcc_accessory_status (&JsonBuffer, since);
+    housedcc_json_raw (&JsonBuffer, "}}");
+
+    const char *result = dcc_result (&JsonBuffer);
+    housedcc_metrics_since (RenderMetric, start);
+    return result;
 }
 
 static const char *dcc_status (const char *method, const char *uri,
@@ -110,14 +176,99 @@ static const char *dcc_status (const char *method, const char *uri,
         return "";
     }
 
-    int cursor = dcc_header (JsonBuffer, sizeof(JsonBuffer), LiveState);
+    const char *since = echttp_parameter_get("since");
+    return dcc_render (since ? atoll(since) : 0);
+}
 
-    cursor += housedcc_fleet_status (JsonBuffer+cursor, sizeof(JsonBuffer)-cursor);
-    cursor += housedcc_consist_status (JsonBuffer+cursor, sizeof(JsonBuffer)-cursor);
-    cursor += snprintf (JsonBuffer+cursor, sizeof(JsonBuffer)-cursor, "}}");
+// The response to a command is either the status (complete or partial,
+// see dcc_status), or only what changed as a result of this command.
+//
+static const char *dcc_reply (long long before,
+                              const char *method, const char *uri,
+                              const char *data, int length) {
 
-    echttp_content_type_json ();
-    return JsonBuffer;
+    housestate_changed (LiveState);
+
+    const char *reply = echttp_parameter_get("reply");
+    if (reply && (!strcmp (reply, "delta"))) return dcc_render (before);
+    return dcc_status (method, uri, data, length);
+}
+
+// The fleet commands below are shared by the individual endpoints and
+// by the batch endpoint. They return 0 on success, or an error text and
+// the matching HTTP status.
+//
+static const char *dcc_execute_move (const char *id, int speed, int *status) {
+
+    if (! housedcc_consist_move (id, speed)) {
+        if (! housedcc_fleet_move (id, speed)) {
+            *status = 404;
+            return "invalid ID";
+        }
+    }
+    return 0;
+}
+
+static const char *dcc_execute_stop (const char *id,
+                                     int emergency, int *status) {
+    if (!id) {
+        // Since this is a command to all locomotives, we do not have
+        // a context to tell us what is the current direction of travel.
+        // Forward is the most reasonable assumption here.
+        if (! housedcc_pidcc_stop (0, emergency, 1)) {
+            *status = 500;
+            return "DCC failure";
+        }
+        housedcc_fleet_stopped (emergency);
+        housedcc_consist_stopped ();
+
+    } else if (! housedcc_consist_stop (id, emergency)) {
+
+        if (! housedcc_fleet_stop (id, emergency)) {
+            *status = 404;
+            return "invalid ID";
+        }
+    }
+    return 0;
+}
+
+static const char *dcc_execute_set (const char *id, const char *device,
+                                    const char *state, int *status) {
+
+    if (isdigit(id[0])) {
+       if (! housedcc_pidcc_function (atoi(id), atoi(state))) {
+            *status = 500;
+            return "DCC failure";
+       }
+       return 0;
+    }
+
+    int statevalue;
+    if (!strcmp(state, "on")) {
+        statevalue = 1;
+    } else if (!strcmp(state, "off")) {
+        statevalue = 0;
+    } else {
+        *status = 400;
+        return "invalid state";
+    }
+
+    // Multiple devices can be set at once, using the same syntax as
+    // the model's list of devices.
+    char localcopy[512];
+    strtcpy (localcopy, device, sizeof(localcopy));
+
+    char *name = localcopy;
+    while (name) {
+       char *next = strchr (name, '+');
+       if (next) *(next++) = 0;
+       if (! housedcc_fleet_set (id, name, statevalue)) {
+          *status = 404;
+          return "invalid ID or device";
+       }
+       name = next;
+    }
+    return 0;
 }
 
 static const char *dcc_move (const char *method, const char *uri,
@@ -134,16 +285,15 @@ static const char *dcc_move (const char *method, const char *uri,
         echttp_error (400, "missing speed value");
         return "";
     }
-    int speedvalue = atoi (speed);
+    long long before = housedcc_live_sequence ();
 
-    if (! housedcc_consist_move (id, speedvalue)) {
-        if (! housedcc_fleet_move (id, speedvalue)) {
-            echttp_error (404, "invalid ID");
-            return "";
-        }
+    int status;
+    const char *error = dcc_execute_move (id, atoi (speed), &status);
+    if (error) {
+        echttp_error (status, error);
+        return "";
     }
-    housestate_changed (LiveState);
-    return dcc_status (method, uri, data, length);
+    return dcc_reply (before, method, uri, data, length);
 }
 
 static const char *dcc_stop (const char *method, const char *uri,
@@ -152,28 +302,16 @@ static const char *dcc_stop (const char *method, const char *uri,
     const char *id = echttp_parameter_get("id");
     const char *urgent = echttp_parameter_get("urgent");
 
-    int emergency = urgent?atoi(urgent):0;
+    long long before = housedcc_live_sequence ();
 
-    if (!id) {
-        // Since this is a command to all locomotives, we do not have
-        // a context to tell us what is the current direction of travel.
-        // Forward is the most reasonable assumption here.
-        if (! housedcc_pidcc_stop (0, emergency, 1)) {
-            echttp_error (500, "DCC failure");
-            return "";
-        }
-        housedcc_fleet_stopped (emergency);
-        housedcc_consist_stopped ();
-
-    } else if (! housedcc_consist_stop (id, emergency)) {
-
-        if (! housedcc_fleet_stop (id, emergency)) {
-            echttp_error (404, "invalid ID");
-            return "";
-        }
+    int status;
+    const char *error =
+        dcc_execute_stop (id, urgent?atoi(urgent):0, &status);
+    if (error) {
+        echttp_error (status, error);
+        return "";
     }
-    housestate_changed (LiveState);
-    return dcc_status (method, uri, data, length);
+    return dcc_reply (before, method, uri, data, length);
 }
 
 static const char *dcc_set (const char *method, const char *uri,
@@ -195,30 +333,166 @@ static const char *dcc_set (const char *method, const char *uri,
         echttp_error (400, "missing state value");
         return "";
     }
+    long long before = housedcc_live_sequence ();
 
-    if (isdigit(id[0])) {
-       if (! housedcc_pidcc_function (atoi(id), atoi(state))) {
-            echttp_error (500, "DCC failure");
-            return "";
-       }
-    } else {
-       int statevalue;
-       if (!strcmp(state, "on")) {
-           statevalue = 1;
-       } else if (!strcmp(state, "off")) {
-           statevalue = 0;
-       } else {
-           echttp_error (400, "invalid state");
-           return "";
-       }
+    int status;
+    const char *error = dcc_execute_set (id, device, state, &status);
+    if (error) {
+        echttp_error (status, error);
+        return "";
+    }
+    return dcc_reply (before, method, uri, data, length);
+}
 
-       if (! housedcc_fleet_set (id, device, statevalue)) {
-          echttp_error (404, "invalid ID");
-          return "";
-       }
+// Check (apply is 0) or execute (apply is 1) one command of a batch.
+//
+static const char *dcc_batch_command (const ParserToken *command,
+                                      int apply, int *status) {
+
+    *status = 400;
+    if (command->type != PARSER_OBJECT) return "invalid command";
+
+    int i = echttp_json_search (command, ".op");
+    if ((i <= 0) || (command[i].type != PARSER_STRING))
+        return "missing operation";
+    const char *op = command[i].value.string;
+
+    const char *id = 0;
+    i = echttp_json_search (command, ".id");
+    if (i > 0) {
+        if (command[i].type != PARSER_STRING) return "invalid ID";
+        id = command[i].value.string;
     }
-    housestate_changed (LiveState);
-    return dcc_status (method, uri, data, length);
+
+    if (!strcmp (op, "move")) {
+        if (!id) return "missing device ID";
+        i = echttp_json_search (command, ".speed");
+        if ((i <= 0) || (command[i].type != PARSER_INTEGER))
+            return "missing speed value";
+        if (!apply) return 0;
+        return dcc_execute_move (id, (int)(command[i].value.integer), status);
+    }
+
+    if (!strcmp (op, "stop")) {
+        int emergency = 0;
+        i = echttp_json_search (command, ".urgent");
+        if (i > 0) {
+            if (command[i].type == PARSER_BOOL)
+                emergency = command[i].value.bool;
+            else if (command[i].type == PARSER_INTEGER)
+                emergency = (int)(command[i].value.integer);
+            else
+                return "invalid urgent value";
+        }
+        if (!apply) return 0;
+        return dcc_execute_stop (id, emergency, status);
+    }
+
+    if (!strcmp (op, "set")) {
+        if (!id) return "missing vehicle ID";
+        i = echttp_json_search (command, ".device");
+        if ((i <= 0) || (command[i].type != PARSER_STRING))
+            return "missing device";
+        const char *device = command[i].value.string;
+        i = echttp_json_search (command, ".state");
+        if ((i <= 0) || (command[i].type != PARSER_STRING))
+            return "missing state value";
+        if (!apply) return 0;
+        return dcc_execute_set (id, device, command[i].value.string, status);
+    }
+    return "invalid operation";
+}
+
+static const char *dcc_batch (const char *method, const char *uri,
+                              const char *data, int length) {
+
+    if (strcmp (method, "POST")) {
+        echttp_error (405, "POST only");
+        return "";
+    }
+    if ((!data) || (length <= 0)) {
+        echttp_error (400, "missing data");
+        return "";
+    }
+
+    char *text = malloc (length + 1);
+    memcpy (text, data, length);
+    text[length] = 0;
+
+    int count = echttp_json_estimate (text);
+    ParserToken *tokens = calloc (count, sizeof(ParserToken));
+    int *list = 0;
+    int executed = 0;
+    long long before = 0;
+
+    int status = 400;
+    const char *error = echttp_json_parse (text, tokens, &count);
+    if (error) goto done;
+
+    int i = echttp_json_search (tokens, ".commands");
+    if ((i <= 0) || (tokens[i].type != PARSER_ARRAY)) {
+        error = "missing commands";
+        goto done;
+    }
+    const ParserToken *commands = tokens + i;
+    if (commands->length <= 0) goto done;
+
+    list = calloc (commands->length, sizeof(int));
+    error = echttp_json_enumerate (commands, list, commands->length);
+    if (error) goto done;
+
+    // The whole batch is checked first, so that a malformed command does
+    // not leave the batch half executed. A command that fails when
+    // executed (e.g. an unknown ID) does not prevent the next commands
+    // from being executed: the first failure is reported.
+    for (i = 0; i < commands->length; ++i) {
+        error = dcc_batch_command (commands + list[i], 0, &status);
+        if (error) goto done;
+    }
+
+    executed = 1;
+    before = housedcc_live_sequence ();
+
+    // All the DCC packets are queued by the time the loop below is over:
+    // they are submitted to PiDCC together when this request returns.
+    for (i = 0; i < commands->length; ++i) {
+        int itemstatus;
+        const char *itemerror =
+            dcc_batch_command (commands + list[i], 1, &itemstatus);
+        if (itemerror && (!error)) {
+            error = itemerror;
+            status = itemstatus;
+        }
+    }
+
+done:
+    if (list) free (list);
+    free (tokens);
+    free (text);
+    if (error) {
+        if (executed) housestate_changed (LiveState); // Some may have worked.
+        echttp_error (status, error);
+        return "";
+    }
+    if (!executed) return ""; // Empty batch: nothing changed.
+    return dcc_reply (before, method, uri, data, length);
+}
+
+static const char *dcc_renew (const char *method, const char *uri,
+                              const char *data, int length) {
+
+    const char *id = echttp_parameter_get("id");
+
+    if (!id) {
+        housedcc_consist_renew (0);
+        housedcc_fleet_renew (0);
+    } else if (! housedcc_consist_renew (id)) {
+        if (! housedcc_fleet_renew (id)) {
+            echttp_error (404, "invalid ID or not moving");
+            return "";
+        }
+    }
+    return ""; // Nothing changed, so no status.
 }
 
 static const char *dcc_gpio (const char *method, const char *uri,
@@ -235,6 +509,22 @@ static const char *dcc_gpio (const char *method, const char *uri,
     return dcc_save ("GPIO CHANGED");
 }
 
+static const char *dcc_refresh (const char *method, const char *uri,
+                                const char *data, int length) {
+
+    const char *period = echttp_parameter_get("period");
+    const char *lease = echttp_parameter_get("lease");
+
+    if (!period) {
+        echttp_error (400, "missing refresh period");
+        return "";
+    }
+    int currentperiod, currentlease;
+    housedcc_fleet_timing (&currentperiod, &currentlease);
+    housedcc_fleet_refresh (atoi(period), lease?atoi(lease):currentlease);
+    return dcc_save ("REFRESH CHANGED");
+}
+
 static const char *dcc_addModel (const char *method, const char *uri,
                                  const char *data, int length) {
 
@@ -242,6 +532,9 @@ static const char *dcc_addModel (const char *method, const char *uri,
     const char *scale = echttp_parameter_get("scale");
     const char *dev = echttp_parameter_get("devices");
     const char *speeds = echttp_parameter_get("speeds");
+    const char *steps = echttp_parameter_get("steps");
+    const char *accel = echttp_parameter_get("accel");
+    const char *decel = echttp_parameter_get("decel");
 
     if (!model) {
         echttp_error (404, "missing model name");
@@ -249,8 +542,8 @@ static const char *dcc_addModel (const char *method, const char *uri,
     }
 
     int acount = 0;
-    const char *accessories[16];
-    char localcopy[512];
+    const char *accessories[32];
+    char localcopy[1024];
 
     if (dev && (*dev > 0)) {
 
@@ -263,16 +556,16 @@ static const char *dcc_addModel (const char *method, const char *uri,
              *cursor  = 0;
              accessories[acount++] = cursor + 1;
           }
-          if (acount >= 16) break; // Avoid overflow.
+          if (acount >= 32) break; // Avoid overflow.
        }
     }
 
     int scount = 0;
-    short speedtable[32];
+    short speedtable[128];
 
     if (speeds && (*speeds > 0)) {
-       char localcopy2[512];
-       strtcpy (localcopy2, speeds, sizeof(localcopy));
+       char localcopy2[1024];
+       strtcpy (localcopy2, speeds, sizeof(localcopy2));
 
        char *cursor;
        speedtable[scount++] = (short)strtol(localcopy2, &cursor, 10);
@@ -280,11 +573,12 @@ static const char *dcc_addModel (const char *method, const char *uri,
           if (*cursor != '+') break;
           cursor += 1;
           speedtable[scount++] = (short)strtol(cursor, &cursor, 10);
-          if (scount >= 32) break; // Avoid overflow.
+          if (scount >= 128) break; // Avoid overflow.
        }
     }
-    housedcc_fleet_declare (model, scale,
+    housedcc_fleet_declare (model, scale, steps?atoi(steps):0,
                             acount, accessories, scount, speedtable);
+    housedcc_fleet_momentum (model, accel?atoi(accel):0, decel?atoi(decel):0);
     return dcc_save ("MODEL ADDED");
 }
 
@@ -299,7 +593,13 @@ static const char *dcc_addVehicle (const char *method, const char *uri,
         echttp_error (404, "missing vehicle ID or address");
         return "";
     }
+    const char *district = echttp_parameter_get("district");
+    if (housedcc_pidcc_district (district) < 0) {
+        echttp_error (404, "Unknown district");
+        return "";
+    }
     const char *error = housedcc_fleet_add (id, model, atoi(adr));
+    if (!error) error = housedcc_fleet_district (id, district);
     if (error) {
         echttp_error (404, error);
         return "";
@@ -317,8 +617,13 @@ static const char *dcc_addConsist (const char *method, const char *uri,
         echttp_error (404, "missing consist ID or address");
         return "";
     }
-    housedcc_consist_add (id, atoi(adr));
-    return dcc_save ("CONSIST ADDED");
+    long long before = housedcc_live_sequence ();
+    const char *error = housedcc_consist_add (id, atoi(adr));
+    if (error) {
+        echttp_error (400, error);
+        return "";
+    }
+    return dcc_reply (before, method, uri, data, length);
 }
 
 static const char *dcc_assign (const char *method, const char *uri,
@@ -332,8 +637,13 @@ static const char *dcc_assign (const char *method, const char *uri,
         echttp_error (404, "missing consist information");
         return "";
     }
-    housedcc_consist_assign (consist, loco, modestring[0]);
-    return dcc_save ("VEHICLE ASSIGNED");
+    long long before = housedcc_live_sequence ();
+    const char *error = housedcc_consist_assign (consist, loco, modestring[0]);
+    if (error) {
+        echttp_error (404, error);
+        return "";
+    }
+    return dcc_reply (before, method, uri, data, length);
 }
 
 static const char *dcc_remove (const char *method, const char *uri,
@@ -344,9 +654,28 @@ static const char *dcc_remove (const char *method, const char *uri,
         echttp_error (400, "missing id");
         return "";
     }
+    long long before = housedcc_live_sequence ();
     housedcc_consist_remove (id);
+    return dcc_reply (before, method, uri, data, length);
+}
 
-    return dcc_save ("VEHICLE REMOVED");
+static const char *dcc_import (const char *method, const char *uri,
+                               const char *data, int length) {
+
+    if (strcmp (method, "POST")) {
+        echttp_error (405, "POST only");
+        return "";
+    }
+    if ((!data) || (length <= 0)) {
+        echttp_error (400, "missing data");
+        return "";
+    }
+    const char *error = housedcc_fleet_import (data, length);
+    if (error) {
+        echttp_error (400, error);
+        return "";
+    }
+    return dcc_save ("FLEET IMPORTED");
 }
 
 static const char *dcc_deleteVehicle (const char *method, const char *uri,
@@ -369,22 +698,72 @@ static const char *dcc_deleteConsist (const char *method, const char *uri,
         echttp_error (400, "missing id");
         return "";
     }
+    long long before = housedcc_live_sequence ();
     housedcc_consist_delete (id);
-    return dcc_save ("CONSIST DELETED");
+    return dcc_reply (before, method, uri, data, length);
+}
+
+static const char *dcc_addAccessory (const char *method, const char *uri,
+                                     const char *data, int length) {
+
+    const char *id = echttp_parameter_get("id");
+    const char *kind = echttp_parameter_get("kind");
+    const char *adr = echttp_parameter_get("adr");
+    const char *device = echttp_parameter_get("device");
+
+    if ((!id) || (!kind) || (!adr)) {
+        echttp_error (404, "missing accessory ID, kind or address");
+        return "";
+    }
+    const char *error =
+        housedcc_accessory_declare (id, kind, atoi(adr), device?atoi(device):0);
+    if (error) {
+        echttp_error (400, error);
+        return "";
+    }
+    return dcc_save ("ACCESSORY ADDED");
+}
+
+static const char *dcc_deleteAccessory (const char *method, const char *uri,
+                                        const char *data, int length) {
+
+    const char *id = echttp_parameter_get("id");
+    if (!id) {
+        echttp_error (400, "missing id");
+        return "";
+    }
+    housedcc_accessory_delete (id);
+    return dcc_save ("ACCESSORY DELETED");
+}
+
+static const char *dcc_accessory (const char *kind,
+                                  const char *method, const char *uri,
+                                  const char *data, int length) {
+
+    const char *id = echttp_parameter_get("id");
+    const char *cmd = echttp_parameter_get("cmd");
+
+    if ((!id) || (!cmd)) {
+        echttp_error (404, "missing accessory ID or command");
+        return "";
+    }
+    long long before = housedcc_live_sequence ();
+    const char *error = housedcc_accessory_set (kind, id, cmd);
+    if (error) {
+        echttp_error (404, error);
+        return "";
+    }
+    return dcc_reply (before, method, uri, data, length);
 }
 
 static const char *dcc_switch (const char *method, const char *uri,
                                const char *data, int length) {
-
-    echttp_error (500, "not yet implemented");
-    return "";
+    return dcc_accessory ("switch", method, uri, data, length);
 }
 
 static const char *dcc_signal (const char *method, const char *uri,
                                const char *data, int length) {
-
-    echttp_error (500, "not yet implemented");
-    return "";
+    return dcc_accessory ("signal", method, uri, data, length);
 }
 
 static const char *dcc_config (const char *method, const char *uri,
@@ -393,8 +772,71 @@ static const char *dcc_config (const char *method, const char *uri,
     if (housestate_same (ConfigState)) return "";
 
     dcc_export ();
-    echttp_content_type_json ();
-    return JsonBuffer;
+    return dcc_result (&ConfigBuffer);
+}
+
+static const char *dcc_metrics (const char *method, const char *uri,
+                                const char *data, int length) {
+
+    housedcc_json_start (&MetricsBuffer);
+    housedcc_metrics_export (&MetricsBuffer);
+    if (housedcc_json_failed (&MetricsBuffer)) {
+        echttp_error (500, "No memory");
+        return "";
+    }
+    echttp_content_type_set ("text/plain; version=0.0.4");
+    return housedcc_json_text (&MetricsBuffer);
+}
+
+// The endpoints used to control the trains are timed. These are all
+// routed to dcc_timed(), which finds the actual handler from the URI.
+//
+typedef struct {
+    const char *uri;
+    const char *labels;
+    echttp_callback *handler;
+    int metric;
+} DccTimedRoute;
+
+static DccTimedRoute DccTimedRoutes[] = {
+    {"/dcc/status",      "endpoint=\"status\"", dcc_status, -1},
+    {"/dcc/fleet/move",  "endpoint=\"move\"",   dcc_move,   -1},
+    {"/dcc/fleet/set",   "endpoint=\"set\"",    dcc_set,    -1},
+    {"/dcc/fleet/stop",  "endpoint=\"stop\"",   dcc_stop,   -1},
+    {"/dcc/fleet/batch", "endpoint=\"batch\"",  dcc_batch,  -1},
+    {"/dcc/fleet/renew", "endpoint=\"renew\"",  dcc_renew,  -1},
+    {"/dcc/switch/set",  "endpoint=\"switch\"", dcc_switch, -1},
+    {"/dcc/signal/set",  "endpoint=\"signal\"", dcc_signal, -1},
+    {0, 0, 0, -1}
+};
+
+static const char *dcc_timed (const char *method, const char *uri,
+                              const char *data, int length) {
+
+    int i;
+    for (i = 0; DccTimedRoutes[i].uri; ++i) {
+        if (!strcmp (uri, DccTimedRoutes[i].uri)) break;
+    }
+    DccTimedRoute *route = DccTimedRoutes + i;
+    if (!route->handler) {
+        echttp_error (404, "unknown endpoint"); // Should never happen.
+        return "";
+    }
+    long long start = housedcc_metrics_clock ();
+    const char *result = route->handler (method, uri, data, length);
+    housedcc_metrics_since (route->metric, start);
+    return result;
+}
+
+static void dcc_timed_routes (void) {
+    int i;
+    for (i = 0; DccTimedRoutes[i].uri; ++i) {
+        DccTimedRoutes[i].metric =
+            housedcc_metrics_histogram ("housedcc_request_seconds",
+                                        DccTimedRoutes[i].labels,
+                                        "Time spent handling each request.");
+        echttp_route_uri (DccTimedRoutes[i].uri, dcc_timed);
+    }
 }
 
 static void dcc_background (int fd, int mode) {
@@ -402,8 +844,17 @@ static void dcc_background (int fd, int mode) {
     time_t now = time(0);
 
     houseportal_background (now);
+    housedcc_pidcc_periodic (now);
+    if (housedcc_pidcc_restarted ()) {
+        housedcc_fleet_replay ();
+        housedcc_consist_replay ();
+    }
     if (housedcc_fleet_background (now)) housestate_changed (LiveState);
+    if (housedcc_consist_periodic (now)) housestate_changed (LiveState);
+    if (housedcc_throttle_background (now)) housestate_changed (LiveState);
+    housedcc_live_background (now);
     housediscover (now);
+    housedcc_event_background (now);
     houselog_background (now);
     houseconfig_background (now);
     housedepositor_periodic (now);
@@ -417,7 +868,7 @@ static const char *dcc_update (void) {
     if (error) return error;
     error = housedcc_fleet_reload ();
     if (error) return error;
-    return housedcc_consist_reload ();
+    return housedcc_accessory_reload ();
 }
 
 static void dcc_protect (const char *method, const char *uri) {
@@ -449,14 +900,30 @@ int main (int argc, const char **argv) {
     houselog_initialize ("dcc", argc, argv);
     housedepositor_initialize (argc, argv);
 
+    error = housedcc_timer_initialize (argc, argv);
+    if (error) goto fatal;
+    error = housedcc_event_initialize (argc, argv);
+    if (error) goto fatal;
     error = houseconfig_initialize ("dcc", dcc_update, argc, argv);
     if (error) goto fatal;
+    error = housedcc_live_initialize (argc, argv);
+    if (error) goto fatal;
+    error = housedcc_pipe_initialize (argc, argv);
+    if (error) goto fatal;
     error = housedcc_pidcc_initialize (argc, argv);
     if (error) goto fatal;
     error = housedcc_fleet_initialize (argc, argv);
     if (error) goto fatal;
     error = housedcc_consist_initialize (argc, argv);
     if (error) goto fatal;
+    error = housedcc_accessory_initialize (argc, argv);
+    if (error) goto fatal;
+    error = housedcc_throttle_initialize (argc, argv);
+    if (error) goto fatal;
+
+    RenderMetric =
+        housedcc_metrics_histogram ("housedcc_status_render_seconds", 0,
+                                    "Time spent building the status.");
 
     LiveState = housestate_declare ("live");
     ConfigState = housestate_declare ("config");
@@ -467,20 +934,20 @@ int main (int argc, const char **argv) {
 
     echttp_route_uri ("/dcc/gpio", dcc_gpio);
 
-    echttp_route_uri ("/dcc//status",      dcc_status);
-    echttp_route_uri ("/dcc/fleet/move",   dcc_move);
-    echttp_route_uri ("/dcc/fleet/set",    dcc_set);
-    echttp_route_uri ("/dcc/fleet/stop",   dcc_stop);
+    dcc_timed_routes ();
+    echttp_route_uri ("/dcc/fleet/refresh", dcc_refresh);
     echttp_route_uri ("/dcc/fleet/vehicle/model",    dcc_addModel);
     echttp_route_uri ("/dcc/fleet/vehicle/add",    dcc_addVehicle);
     echttp_route_uri ("/dcc/fleet/vehicle/delete", dcc_deleteVehicle);
+    echttp_route_uri ("/dcc/fleet/import", dcc_import);
     echttp_route_uri ("/dcc/fleet/consist/add", dcc_addConsist);
     echttp_route_uri ("/dcc/fleet/consist/assign", dcc_assign);
     echttp_route_uri ("/dcc/fleet/consist/remove", dcc_remove);
     echttp_route_uri ("/dcc/fleet/consist/delete", dcc_deleteConsist);
-    echttp_route_uri ("/dcc/switch/set",   dcc_switch);
-    echttp_route_uri ("/dcc/signal/set",   dcc_signal);
+    echttp_route_uri ("/dcc/accessory/add",    dcc_addAccessory);
+    echttp_route_uri ("/dcc/accessory/delete", dcc_deleteAccessory);
     echttp_route_uri ("/dcc/fleet/config", dcc_config);
+    echttp_route_uri ("/dcc/metrics",      dcc_metrics);
 
     echttp_static_route ("/", "/usr/local/share/house/public");
     echttp_background (&dcc_background);
@@ -0,0 +1,549 @@
+/* HouseDCC - A model train control service
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedcc_accessory.c - Control the layout accessories (switches, signals).
+ *
+ * SYNOPSYS:
+ *
+ * This module handles the control of fixed accessories: switches (turnouts)
+ * and signals. Each accessory is identified by a name and is controlled
+ * using one output pair of a DCC basic accessory decoder: the decoder
+ * address (1 to 511) and the output pair on that decoder (0 to 3). Each
+ * accessory has two positions, one per output of the pair:
+ *
+ *    switch: "normal" (output 0) or "reverse" (output 1).
+ *    signal: "stop" (output 0) or "go" (output 1).
+ *
+ * The position of each accessory is kept in a bitmap, together with a
+ * bitmap of the accessories whose position is known (i.e. a command was
+ * sent since this service started). A command that sets an accessory to
+ * the position it is already known to be in is not transmitted.
+ *
+ * Multiple accessories can be set with one call, for example to line a
+ * route through a yard. All the accessories are validated first, so that
+ * nothing is changed if one is invalid, or if PiDCC does not have room
+ * for all the commands. The resulting DCC packets are all queued before
+ * returning, and are thus transmitted to PiDCC as one batch (see
+ * housedcc_pidcc.c).
+ *
+ * const char *housedcc_accessory_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module.
+ *
+ * const char *housedcc_accessory_declare (const char *id, const char *kind,
+ *                                         int address, int device);
+ *
+ *    Declare a new accessory, or change an existing one. The kind is
+ *    either "switch" or "signal". Return 0 on success, an error text
+ *    otherwise.
+ *
+ * void housedcc_accessory_delete (const char *id);
+ *
+ *    Forget an accessory.
+ *
+ * const char *housedcc_accessory_set (const char *kind,
+ *                                     const char *ids, const char *cmds);
+ *
+ *    Set the position of one or more accessories of the specified kind.
+ *    The ids parameter is a list of accessory names separated by '+'. The
+ *    cmds parameter is a list of positions separated by '+', one for
+ *    each accessory. If there are fewer positions than accessories, the
+ *    last position applies to the remaining accessories (a single position
+ *    applies to all). Return 0 on success, an error text otherwise.
+ *
+ * int housedcc_accessory_delta (long long since);
+ *
+ *    Return 1 if a partial status since the specified sequence number is
+ *    meaningful, 0 if a complete status is required.
+ *
+ * void housedcc_accessory_status (DccJson *json, long long since);
+ *
+ *    A function that populates a status in JSON. If since is 0, the status
+ *    is complete, otherwise it lists only the accessories that changed
+ *    after that sequence number.
+ *
+ * const char *housedcc_accessory_reload (void);
+ *
+ *    Reload the list of accessories from a saved configuration.
+ *
+ * void housedcc_accessory_export (DccJson *json, const char *prefix);
+ *
+ *    Export the list of accessories in JSON format.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <echttp.h>
+#include "echttp_libc.h"
+
+#include "houselog.h"
+#include "houseconfig.h"
+
+#include "housedcc_json.h"
+#include "housedcc_hash.h"
+#include "housedcc_event.h"
+#include "housedcc_pidcc.h"
+#include "housedcc_live.h"
+#include "housedcc_accessory.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define ACCESSORY_ADDRESS_MAX 512 // Basic accessory decoders: 9 bits.
+#define ACCESSORY_DEVICE_MAX  4   // Output pairs per decoder.
+#define ACCESSORY_ROUTE_MAX   32  // Same as the PiDCC queue depth.
+
+#define ACCESSORY_SWITCH 's'
+#define ACCESSORY_SIGNAL 'g'
+
+// The hash table stores the slot index plus one, 0 meaning "no entry"
+// (see housedcc_fleet.c).
+//
+#define ACCESSORY_HASH_SIZE 256 // Must be a power of 2.
+
+typedef struct {
+    char id[15];
+    char kind;
+    short address;
+    char device;
+    long long changed; // Sequence number of the latest live state change.
+    int next; // Hash chain.
+} DccAccessory;
+
+static DccAccessory *Accessories = 0;
+static int           AccessoriesCount = 0;
+static int           AccessoriesAllocated = 0;
+static int           AccessoriesHash[ACCESSORY_HASH_SIZE];
+
+// One bit per accessory slot.
+static uint32_t *AccessoryKnown = 0;
+static uint32_t *AccessoryPosition = 0;
+
+// The sequence number of the latest addition or deletion of accessories.
+static long long AccessoryListChanged = 0;
+
+static const char *AccessoryPositions[2][2] = {
+    {"normal", "reverse"}, // Switch.
+    {"stop", "go"}         // Signal.
+};
+
+static unsigned int housedcc_accessory_hash (const char *name) {
+    return housedcc_hash_string (name) & (ACCESSORY_HASH_SIZE - 1);
+}
+
+static int housedcc_accessory_find (const char *id) {
+
+    if ((!id) || (!id[0])) return -1;
+
+    int i = AccessoriesHash[housedcc_accessory_hash (id)];
+    while (i > 0) {
+        if (!strcmp (id, Accessories[i-1].id)) return i - 1;
+        i = Accessories[i-1].next;
+    }
+    DEBUG ("Cannot find accessory %s\n", id);
+    return -1;
+}
+
+static void housedcc_accessory_index (int cursor) {
+    unsigned int hash = housedcc_accessory_hash (Accessories[cursor].id);
+    Accessories[cursor].next = AccessoriesHash[hash];
+    AccessoriesHash[hash] = cursor + 1;
+}
+
+static void housedcc_accessory_reindex (void) {
+    int i;
+    memset (AccessoriesHash, 0, sizeof(AccessoriesHash));
+    for (i = 0; i < AccessoriesCount; ++i) housedcc_accessory_index (i);
+}
+
+static int housedcc_accessory_bit (const uint32_t *bitmap, int cursor) {
+    return (bitmap[cursor / 32] >> (cursor % 32)) & 1;
+}
+
+static void housedcc_accessory_setbit (uint32_t *bitmap,
+                                       int cursor, int value) {
+    uint32_t mask = 1u << (cursor % 32);
+    if (value)
+        bitmap[cursor / 32] |= mask;
+    else
+        bitmap[cursor / 32] &= ~mask;
+}
+
+static void housedcc_accessory_allocate (int needed) {
+
+    if (needed <= AccessoriesAllocated) return;
+
+    int allocated = AccessoriesAllocated;
+    int words = (allocated + 31) / 32;
+
+    AccessoriesAllocated = ((needed + 16 + 31) / 32) * 32;
+    int newwords = AccessoriesAllocated / 32;
+
+    Accessories = realloc (Accessories,
+                           AccessoriesAllocated * sizeof(DccAccessory));
+    AccessoryKnown = realloc (AccessoryKnown, newwords * sizeof(uint32_t));
+    AccessoryPosition =
+        realloc (AccessoryPosition, newwords * sizeof(uint32_t));
+    memset (AccessoryKnown + words, 0, (newwords - words) * sizeof(uint32_t));
+    memset (AccessoryPosition + words,
+            0, (newwords - words) * sizeof(uint32_t));
+}
+
+static int housedcc_accessory_kind (const char *kind) {
+    if (!kind) return 0;
+    if (!strcmp (kind, "switch")) return ACCESSORY_SWITCH;
+    if (!strcmp (kind, "signal")) return ACCESSORY_SIGNAL;
+    return 0;
+}
+
+static const char *housedcc_accessory_kindname (char kind) {
+    return (kind == ACCESSORY_SIGNAL) ? "signal" : "switch";
+}
+
+static int housedcc_accessory_position (char kind, const char *name) {
+    const char **positions = AccessoryPositions[kind == ACCESSORY_SIGNAL];
+    if (!strcmp (name, positions[0])) return 0;
+    if (!strcmp (name, positions[1])) return 1;
+    return -1;
+}
+
+static void housedcc_accessory_status_accessory (DccJson *json, int cursor) {
+
+    const DccAccessory *accessory = Accessories + cursor;
+
+    housedcc_json_raw (json, "{\"id\":");
+    housedcc_json_string (json, accessory->id);
+    housedcc_json_raw (json, ",\"kind\":");
+    housedcc_json_string (json, housedcc_accessory_kindname (accessory->kind));
+    if (housedcc_accessory_bit (AccessoryKnown, cursor)) {
+        int position = housedcc_accessory_bit (AccessoryPosition, cursor);
+        housedcc_json_raw (json, ",\"state\":");
+        housedcc_json_string (json,
+            AccessoryPositions[accessory->kind == ACCESSORY_SIGNAL][position]);
+    }
+    housedcc_json_raw (json, "}");
+}
+
+static void housedcc_accessory_changed (int cursor) {
+
+    static DccJson event;
+
+    Accessories[cursor].changed = housedcc_live_changed ();
+
+    if (housedcc_live_subscribed ()) {
+        housedcc_json_start (&event);
+        housedcc_json_raw (&event, "{\"sequence\":");
+        housedcc_json_integer (&event, Accessories[cursor].changed);
+        housedcc_json_raw (&event, ",\"accessory\":");
+        housedcc_accessory_status_accessory (&event, cursor);
+        housedcc_json_raw (&event, "}");
+        if (! housedcc_json_failed (&event))
+            housedcc_live_publish ("accessory", housedcc_json_text (&event));
+    }
+}
+
+// Validate an accessory definition against the accessories already
+// known. Return 0 if valid, an error text otherwise.
+//
+static const char *housedcc_accessory_check (const char *id, int kindcode,
+                                             int address, int device) {
+
+    if ((!id) || (!id[0])) return "Missing accessory ID";
+    if (!kindcode) return "Invalid accessory kind";
+    if ((address <= 0) || (address >= ACCESSORY_ADDRESS_MAX))
+        return "Invalid accessory address";
+    if ((device < 0) || (device >= ACCESSORY_DEVICE_MAX))
+        return "Invalid accessory device";
+
+    int i;
+    for (i = 0; i < AccessoriesCount; ++i) {
+        if ((Accessories[i].address == address) &&
+            (Accessories[i].device == device) &&
+            strcmp (Accessories[i].id, id))
+            return "Duplicate accessory address";
+    }
+    return 0;
+}
+
+const char *housedcc_accessory_declare (const char *id, const char *kind,
+                                        int address, int device) {
+
+    int kindcode = housedcc_accessory_kind (kind);
+    const char *error =
+        housedcc_accessory_check (id, kindcode, address, device);
+    if (error) return error;
+
+    int cursor = housedcc_accessory_find (id);
+    if (cursor < 0) {
+        housedcc_accessory_allocate (AccessoriesCount + 1);
+        cursor = AccessoriesCount++;
+        memset (Accessories + cursor, 0, sizeof(DccAccessory));
+        strtcpy (Accessories[cursor].id, id, sizeof(Accessories[0].id));
+        housedcc_accessory_index (cursor);
+        houselog_event ("ACCESSORY", id, "CREATED",
+                        "%s AT ADDRESS %d, DEVICE %d", kind, address, device);
+    } else {
+        houselog_event ("ACCESSORY", id, "MODIFIED",
+                        "%s AT ADDRESS %d, DEVICE %d", kind, address, device);
+    }
+    DccAccessory *accessory = Accessories + cursor;
+    accessory->kind = (char)kindcode;
+    accessory->address = (short)address;
+    accessory->device = (char)device;
+
+    // The position, if any, applied to the former decoder output.
+    housedcc_accessory_setbit (AccessoryKnown, cursor, 0);
+    housedcc_accessory_setbit (AccessoryPosition, cursor, 0);
+    housedcc_accessory_changed (cursor);
+
+    AccessoryListChanged = housedcc_live_changed ();
+    return 0;
+}
+
+void housedcc_accessory_delete (const char *id) {
+
+    int cursor = housedcc_accessory_find (id);
+    if (cursor < 0) return;
+
+    houselog_event ("ACCESSORY", id, "DELETED", "");
+
+    // Keep the list compact. Deletion is rare, so the hash table is simply
+    // rebuilt.
+    AccessoriesCount -= 1;
+    if (cursor < AccessoriesCount) {
+        Accessories[cursor] = Accessories[AccessoriesCount];
+        housedcc_accessory_setbit (AccessoryKnown, cursor,
+            housedcc_accessory_bit (AccessoryKnown, AccessoriesCount));
+        housedcc_accessory_setbit (AccessoryPosition, cursor,
+            housedcc_accessory_bit (AccessoryPosition, AccessoriesCount));
+    }
+    housedcc_accessory_setbit (AccessoryKnown, AccessoriesCount, 0);
+    housedcc_accessory_setbit (AccessoryPosition, AccessoriesCount, 0);
+    housedcc_accessory_reindex ();
+
+    AccessoryListChanged = housedcc_live_changed ();
+}
+
+const char *housedcc_accessory_set (const char *kind,
+                                    const char *ids, const char *cmds) {
+
+    int kindcode = housedcc_accessory_kind (kind);
+    if (!kindcode) return "Invalid accessory kind";
+    if ((!ids) || (!cmds)) return "Missing accessory ID or command";
+
+    char idcopy[512];
+    char cmdcopy[512];
+    strtcpy (idcopy, ids, sizeof(idcopy));
+    strtcpy (cmdcopy, cmds, sizeof(cmdcopy));
+
+    int route[ACCESSORY_ROUTE_MAX];
+    char position[ACCESSORY_ROUTE_MAX];
+    int count = 0;
+
+    // First pass: validate everything, so that a route is either set
+    // as a whole, or not at all.
+    char *id = idcopy;
+    char *cmd = cmdcopy;
+    while (id) {
+        if (count >= ACCESSORY_ROUTE_MAX) return "Too many accessories";
+
+        char *next = strchr (id, '+');
+        if (next) *(next++) = 0;
+
+        int cursor = housedcc_accessory_find (id);
+        if (cursor < 0) return "Unknown accessory";
+        if (Accessories[cursor].kind != kindcode) return "Not the right kind";
+
+        // The last command applies to all the remaining accessories.
+        char *nextcmd = cmd ? strchr (cmd, '+') : 0;
+        if (nextcmd) *(nextcmd++) = 0;
+        int value = housedcc_accessory_position (kindcode, cmd);
+        if (value < 0) return "Invalid accessory command";
+        if (nextcmd) cmd = nextcmd;
+
+        route[count] = cursor;
+        position[count++] = (char)value;
+        id = next;
+    }
+
+    // Check that all the DCC commands can be queued, so that a failure
+    // cannot happen after some of the accessories were already set.
+    int i;
+    int pending = 0;
+    for (i = 0; i < count; ++i) {
+        int cursor = route[i];
+        if (housedcc_accessory_bit (AccessoryKnown, cursor) &&
+            (housedcc_accessory_bit (AccessoryPosition, cursor) == position[i]))
+            route[i] = -1; // Nothing to send.
+        else
+            pending += 1;
+    }
+    if (pending <= 0) return 0;
+    if (housedcc_pidcc_accessory_room () < pending) return "DCC failure";
+
+    // Second pass: queue the DCC commands for the accessories that are
+    // not already in the requested position.
+    for (i = 0; i < count; ++i) {
+        int cursor = route[i];
+        if (cursor < 0) continue; // Nothing to send.
+
+        DccAccessory *accessory = Accessories + cursor;
+        if (housedcc_pidcc_accessory (accessory->address,
+                                      (accessory->device << 1) + position[i],
+                                      1) <= 0) {
+            return "DCC failure";
+        }
+        housedcc_accessory_setbit (AccessoryKnown, cursor, 1);
+        housedcc_accessory_setbit (AccessoryPosition, cursor, position[i]);
+        housedcc_event_record ("ACCESSORY", accessory->id, "SET", "TO %s",
+             AccessoryPositions[kindcode == ACCESSORY_SIGNAL][(int)position[i]]);
+        housedcc_accessory_changed (cursor);
+    }
+    return 0;
+}
+
+int housedcc_accessory_delta (long long since) {
+    return (since >= AccessoryListChanged) &&
+           (since <= housedcc_live_sequence());
+}
+
+void housedcc_accessory_status (DccJson *json, long long since) {
+
+    int i;
+    int listed = 0;
+    const char *prefix = ",\"accessories\":[";
+
+    for (i = 0; i < AccessoriesCount; ++i) {
+
+        if (Accessories[i].changed <= since) continue; // No change.
+
+        housedcc_json_raw (json, prefix);
+        housedcc_accessory_status_accessory (json, i);
+        listed += 1;
+        prefix = ",";
+    }
+    if (listed > 0) housedcc_json_raw (json, "]");
+}
+
+const char *housedcc_accessory_reload (void) {
+
+    if (! houseconfig_active()) return 0;
+
+    int accessories = houseconfig_array (0, ".trains.accessories");
+    int count = 0;
+
+    if (accessories >= 0) count = houseconfig_array_length (accessories);
+    if (count < 0) count = 0;
+
+    // The decoders keep their outputs when the list is reloaded: keep the
+    // former list to carry over the known position of the accessories
+    // that still use the same decoder output.
+    DccAccessory *former = Accessories;
+    uint32_t *formerknown = AccessoryKnown;
+    uint32_t *formerposition = AccessoryPosition;
+    int formerhash[ACCESSORY_HASH_SIZE];
+    memcpy (formerhash, AccessoriesHash, sizeof(formerhash));
+
+    Accessories = 0;
+    AccessoryKnown = 0;
+    AccessoryPosition = 0;
+    AccessoriesCount = 0;
+    AccessoriesAllocated = 0;
+    housedcc_accessory_allocate (count + 1);
+    memset (AccessoriesHash, 0, sizeof(AccessoriesHash));
+    AccessoryListChanged = housedcc_live_changed ();
+
+    int i;
+    int *list = calloc (count + 1, sizeof(int));
+    if (count > 0) count = houseconfig_enumerate (accessories, list, count);
+    for (i = 0; i < count; ++i) {
+        int item = list[i];
+        if (item <= 0) continue;
+        const char *id = houseconfig_string (item, ".id");
+        if (!id) continue;
+        int kind = housedcc_accessory_kind (houseconfig_string (item, ".kind"));
+        int address = houseconfig_integer (item, ".address");
+        int device = houseconfig_integer (item, ".device");
+
+        const char *error =
+            housedcc_accessory_check (id, kind, address, device);
+        if ((!error) && (housedcc_accessory_find (id) >= 0))
+            error = "Duplicate accessory ID";
+        if (error) {
+            houselog_event ("ACCESSORY", id, "IGNORED", "%s", error);
+            continue;
+        }
+
+        DccAccessory *accessory = Accessories + AccessoriesCount;
+        memset (accessory, 0, sizeof(DccAccessory));
+        strtcpy (accessory->id, id, sizeof(accessory->id));
+        accessory->kind = (char)kind;
+        accessory->address = (short)address;
+        accessory->device = (char)device;
+        accessory->changed = housedcc_live_changed ();
+
+        int j = formerhash[housedcc_accessory_hash (id)];
+        while ((j > 0) && strcmp (id, former[j-1].id)) j = former[j-1].next;
+        if ((j > 0) &&
+            (former[j-1].address == address) &&
+            (former[j-1].device == device) &&
+            housedcc_accessory_bit (formerknown, j-1)) {
+            housedcc_accessory_setbit (AccessoryKnown, AccessoriesCount, 1);
+            housedcc_accessory_setbit (AccessoryPosition, AccessoriesCount,
+                housedcc_accessory_bit (formerposition, j-1));
+        }
+        housedcc_accessory_index (AccessoriesCount++);
+    }
+    free (list);
+    free (former);
+    free (formerknown);
+    free (formerposition);
+    return 0;
+}
+
+void housedcc_accessory_export (DccJson *json, const char *prefix) {
+
+    housedcc_json_raw (json, prefix);
+    housedcc_json_raw (json, "\"accessories\":[");
+
+    int i;
+    for (i = 0; i < AccessoriesCount; ++i) {
+        const DccAccessory *accessory = Accessories + i;
+        if (i > 0) housedcc_json_raw (json, ",");
+        housedcc_json_raw (json, "{\"id\":");
+        housedcc_json_string (json, accessory->id);
+        housedcc_json_raw (json, ",\"kind\":");
+        housedcc_json_string (json,
+                              housedcc_accessory_kindname (accessory->kind));
+        housedcc_json_raw (json, ",\"address\":");
+        housedcc_json_integer (json, accessory->address);
+        housedcc_json_raw (json, ",\"device\":");
+        housedcc_json_integer (json, accessory->device);
+        housedcc_json_raw (json, "}");
+    }
+    housedcc_json_raw (json, "]");
+}
+
+const char *housedcc_accessory_initialize (int argc, const char **argv) {
+    housedcc_accessory_allocate (1);
+    return 0;
+}
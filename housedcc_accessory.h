@@ -0,0 +1,36 @@
+/* HouseDCC - A model train control service
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedcc_accessory.h - Control the layout accessories (switches, signals).
+ */
+const char *housedcc_accessory_initialize (int argc, const char **argv);
+
+const char *housedcc_accessory_declare (const char *id, const char *kind,
+                                        int address, int device);
+void housedcc_accessory_delete (const char *id);
+
+const char *housedcc_accessory_set (const char *kind,
+                                    const char *ids, const char *cmds);
+
+int  housedcc_accessory_delta (long long since);
+void housedcc_accessory_status (DccJson *json, long long since);
+
+const char *housedcc_accessory_reload (void);
+void housedcc_accessory_export (DccJson *json, const char *prefix);
@@ -0,0 +1,353 @@
+/* HouseDCC - A model train control service
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedcc_benchmark.c - Measure the cost of the command pipeline.
+ *
+ * SYNOPSYS:
+ *
+ * This is a separate program (make benchmark), not part of the service.
+ * It has two modes:
+ *
+ * housedcc_benchmark [-roster=N[,N..]] [-iterations=N]
+ *
+ *    Run the fleet module in process, with a synthetic roster of each
+ *    size listed (default: 10, 100 and 1000 vehicles), and report the
+ *    cost of a vehicle lookup, a speed encoding, a move request (up to
+ *    the PiDCC queue), a full status render and a configuration export.
+ *    PiDCC is not started: with no GPIO pins configured, the PiDCC module
+ *    builds each command and drops it, which is what is measured.
+ *
+ * housedcc_benchmark -load=HOST:PORT [-duration=SECONDS]
+ *
+ *    Send a mix of requests similar to a traffic control system to a
+ *    running HouseDCC service: mostly moves, plus lease renewals and
+ *    partial status polls, using the vehicles from its configuration.
+ *    Report the request rate and the latency distribution. This should
+ *    be combined with /dcc/metrics, which tells where the time goes.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include <echttp.h>
+#include <echttp_json.h>
+
+#include "housedcc_json.h"
+#include "housedcc_metrics.h"
+#include "housedcc_fleet.h"
+
+#define BENCHMARK_ROSTER_MAX 10000
+
+static int BenchmarkIterations = 100000;
+
+// In-process benchmark. -------------------------------------------------
+
+static void housedcc_benchmark_roster (int count) {
+
+    static int Roster = 0; // Size of the previous roster.
+    static short Speeds[28];
+    static const char *Functions[] = {"light:0", "bell:1", "horn:2", "mute:8"};
+
+    char id[16];
+    int i;
+
+    // Start from an empty fleet, but keep the model.
+    for (i = 0; i < Roster; ++i) {
+        snprintf (id, sizeof(id), "B%d", i);
+        housedcc_fleet_delete (id);
+    }
+    if (!Roster) {
+        for (i = 0; i < 28; ++i) Speeds[i] = (short)((i + 1) * 4);
+        housedcc_fleet_declare ("BENCH", "HO", 28, 4, Functions, 28, Speeds);
+    }
+    for (i = 0; i < count; ++i) {
+        snprintf (id, sizeof(id), "B%d", i);
+        housedcc_fleet_add (id, "BENCH", i + 1);
+    }
+    Roster = count;
+}
+
+static double housedcc_benchmark_elapsed (long long start, int count) {
+    return (double)(housedcc_metrics_clock () - start) / count;
+}
+
+static void housedcc_benchmark_fleet (int count) {
+
+    char ids[64][16];
+    int i;
+
+    housedcc_benchmark_roster (count);
+    for (i = 0; i < 64; ++i) {
+        snprintf (ids[i], sizeof(ids[i]), "B%d", (i * 7919) % count);
+    }
+
+    long long start = housedcc_metrics_clock ();
+    for (i = 0; i < BenchmarkIterations; ++i) {
+        housedcc_fleet_address (ids[i & 63]);
+    }
+    double lookup = housedcc_benchmark_elapsed (start, BenchmarkIterations);
+
+    int actual;
+    start = housedcc_metrics_clock ();
+    for (i = 0; i < BenchmarkIterations; ++i) {
+        housedcc_fleet_encode (ids[i & 63], (i % 200) - 100, &actual);
+    }
+    double encode = housedcc_benchmark_elapsed (start, BenchmarkIterations);
+
+    start = housedcc_metrics_clock ();
+    for (i = 0; i < BenchmarkIterations; ++i) {
+        housedcc_fleet_move (ids[i & 63], (i % 100) + 1);
+    }
+    double move = housedcc_benchmark_elapsed (start, BenchmarkIterations);
+
+    DccJson json = {0};
+    housedcc_json_start (&json);
+    int rounds = BenchmarkIterations / count;
+    if (rounds < 10) rounds = 10;
+    start = housedcc_metrics_clock ();
+    for (i = 0; i < rounds; ++i) {
+        housedcc_json_start (&json);
+        housedcc_fleet_status (&json, 0);
+    }
+    double status = housedcc_benchmark_elapsed (start, rounds);
+    int size = housedcc_json_length (&json);
+
+    start = housedcc_metrics_clock ();
+    for (i = 0; i < rounds; ++i) {
+        housedcc_json_start (&json);
+        housedcc_fleet_export (&json, "");
+    }
+    double export = housedcc_benchmark_elapsed (start, rounds);
+    free (json.data);
+
+    printf ("%8d %10.3f %10.3f %10.3f %12.1f %12.1f %10d\n",
+            count, lookup, encode, move, status, export, size);
+
+    // Stop everything, so that the next roster starts clean.
+    housedcc_fleet_stopped (1);
+}
+
+static void housedcc_benchmark_local (const char *list) {
+
+    printf ("%8s %10s %10s %10s %12s %12s %10s\n",
+            "VEHICLES", "LOOKUP", "ENCODE", "MOVE", "STATUS", "EXPORT", "BYTES");
+    printf ("%8s %10s %10s %10s %12s %12s %10s\n",
+            "", "(us)", "(us)", "(us)", "(us)", "(us)", "");
+
+    while (list && *list) {
+        int count = atoi (list);
+        if ((count > 0) && (count <= BENCHMARK_ROSTER_MAX))
+            housedcc_benchmark_fleet (count);
+        list = strchr (list, ',');
+        if (list) list += 1;
+    }
+}
+
+// HTTP load generator. --------------------------------------------------
+
+static struct addrinfo *LoadServer = 0;
+static const char *LoadHost = 0;
+
+// Send one HTTP request and read the whole response. Return the HTTP
+// status, or -1 on error. The response is truncated to the buffer size.
+//
+static int housedcc_benchmark_get (const char *uri, char *buffer, int size) {
+
+    int s = socket (LoadServer->ai_family, SOCK_STREAM, 0);
+    if (s < 0) return -1;
+    if (connect (s, LoadServer->ai_addr, LoadServer->ai_addrlen) < 0) {
+        close (s);
+        return -1;
+    }
+    char request[512];
+    int length = snprintf (request, sizeof(request),
+                           "GET %s HTTP/1.1\r\nHost: %s\r\n"
+                           "Connection: close\r\n\r\n", uri, LoadHost);
+    if (write (s, request, length) != length) {
+        close (s);
+        return -1;
+    }
+    int received = 0;
+    for (;;) {
+        int r = read (s, buffer + received, size - received - 1);
+        if (r <= 0) break;
+        if (received + r < size - 1) received += r;
+    }
+    close (s);
+    buffer[received] = 0;
+
+    const char *status = strchr (buffer, ' ');
+    return status ? atoi (status + 1) : -1;
+}
+
+static int housedcc_benchmark_compare (const void *a, const void *b) {
+    long long d = *((const long long *)a) - *((const long long *)b);
+    return (d < 0) ? -1 : (d > 0);
+}
+
+static void housedcc_benchmark_load (const char *server, int duration) {
+
+    static char Buffer[1024*1024];
+
+    char host[256];
+    snprintf (host, sizeof(host), "%s", server);
+    char *port = strchr (host, ':');
+    if (!port) {
+        fprintf (stderr, "missing port in %s\n", server);
+        return;
+    }
+    *(port++) = 0;
+    LoadHost = server;
+
+    struct addrinfo hints;
+    memset (&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo (host, port, &hints, &LoadServer)) {
+        fprintf (stderr, "cannot resolve %s\n", host);
+        return;
+    }
+
+    // Retrieve the list of vehicles to move.
+    if (housedcc_benchmark_get ("/dcc/fleet/config",
+                                Buffer, sizeof(Buffer)) != 200) {
+        fprintf (stderr, "cannot get the configuration from %s\n", server);
+        return;
+    }
+    char *json = strstr (Buffer, "\r\n\r\n");
+    if (!json) return;
+    json += 4;
+
+    int count = echttp_json_estimate (json);
+    ParserToken *tokens = calloc (count, sizeof(ParserToken));
+    const char *error = echttp_json_parse (json, tokens, &count);
+    if (error) {
+        fprintf (stderr, "invalid configuration: %s\n", error);
+        return;
+    }
+    int vehicles = echttp_json_search (tokens, ".trains.vehicles");
+    int total = (vehicles > 0) ? tokens[vehicles].length : 0;
+    if (total <= 0) {
+        fprintf (stderr, "no vehicle to move\n");
+        return;
+    }
+    int *list = calloc (total, sizeof(int));
+    echttp_json_enumerate (tokens + vehicles, list, total);
+    const char **ids = calloc (total, sizeof(char *));
+    int i;
+    int idcount = 0;
+    for (i = 0; i < total; ++i) {
+        int id = echttp_json_search (tokens + vehicles + list[i], ".id");
+        if (id <= 0) continue;
+        // The configuration was decoded in place, in a buffer that is
+        // reused for the responses below: keep a copy of each ID.
+        ids[idcount++] = strdup (tokens[vehicles + list[i] + id].value.string);
+    }
+    if (idcount <= 0) return;
+
+    // The traffic mix: out of 20 requests, 14 moves, 3 renews, 3 polls.
+    int capacity = 1024;
+    long long *latencies = malloc (capacity * sizeof(long long));
+    int requests = 0;
+    int failures = 0;
+    long long known = 0;
+
+    long long begin = housedcc_metrics_clock ();
+    long long end = begin + (long long)duration * 1000000;
+    while (housedcc_metrics_clock () < end) {
+        char uri[256];
+        int kind = requests % 20;
+        const char *id = ids[(int)(((long long)requests * 7919) % idcount)];
+        if (kind < 14) {
+            snprintf (uri, sizeof(uri), "/dcc/fleet/move?id=%s&speed=%d",
+                      id, ((requests / 20) % 2) ? 20 : 40);
+        } else if (kind < 17) {
+            snprintf (uri, sizeof(uri), "/dcc/fleet/renew");
+        } else if (known > 0) {
+            snprintf (uri, sizeof(uri), "/dcc/status?since=%lld", known);
+        } else {
+            snprintf (uri, sizeof(uri), "/dcc/status");
+        }
+        long long start = housedcc_metrics_clock ();
+        int status = housedcc_benchmark_get (uri, Buffer, sizeof(Buffer));
+        long long latency = housedcc_metrics_clock () - start;
+
+        if ((status != 200) && (status != 304)) failures += 1;
+        if ((kind >= 17) && (status == 200)) {
+            const char *sequence = strstr (Buffer, "\"sequence\":");
+            if (sequence) known = atoll (sequence + 11);
+        }
+        if (requests >= capacity) {
+            capacity *= 2;
+            latencies = realloc (latencies, capacity * sizeof(long long));
+        }
+        latencies[requests++] = latency;
+    }
+    long long elapsed = housedcc_metrics_clock () - begin;
+
+    // Stop all the vehicles that this test moved.
+    housedcc_benchmark_get ("/dcc/fleet/stop", Buffer, sizeof(Buffer));
+
+    if (requests <= 0) return;
+    qsort (latencies, requests, sizeof(long long), housedcc_benchmark_compare);
+    printf ("%d requests (%d failed) to %d vehicles in %.1f seconds: %.1f/s\n",
+            requests, failures, idcount,
+            elapsed / 1000000.0, (requests * 1000000.0) / elapsed);
+    printf ("latency (ms): median %.2f, 90%% %.2f, 99%% %.2f, max %.2f\n",
+            latencies[requests / 2] / 1000.0,
+            latencies[(requests * 9) / 10] / 1000.0,
+            latencies[(requests * 99) / 100] / 1000.0,
+            latencies[requests - 1] / 1000.0);
+}
+
+int main (int argc, const char **argv) {
+
+    const char *roster = "10,100,1000";
+    const char *load = 0;
+    const char *value;
+    int duration = 10;
+
+    int i;
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-roster=", argv[i], &roster)) continue;
+        if (echttp_option_match ("-load=", argv[i], &load)) continue;
+        if (echttp_option_match ("-iterations=", argv[i], &value)) {
+            BenchmarkIterations = atoi (value);
+            if (BenchmarkIterations <= 0) BenchmarkIterations = 1;
+            continue;
+        }
+        if (echttp_option_match ("-duration=", argv[i], &value)) {
+            duration = atoi (value);
+            continue;
+        }
+    }
+
+    if (load) {
+        housedcc_benchmark_load (load, duration);
+    } else {
+        housedcc_fleet_initialize (argc, argv);
+        housedcc_benchmark_local (roster);
+    }
+    return 0;
+}
@@ -30,17 +30,33 @@
  * - Maintain the list of vehicles that are assigned to this consist.
  * - Move whole consist forward, backward and stop.
  *
- * void housedcc_consist_add (const char *ID, int address);
+ * This module uses DCC advanced consisting: each locomotive assigned to
+ * a consist is told to listen to the consist address (i.e. its CV19 is set
+ * using the Consist Control instruction), with the direction bit set for
+ * locomotives that run in reverse. The whole consist is then controlled
+ * by a single speed instruction sent to the consist address. The speed
+ * table used is the one of the first locomotive in the consist.
+ *
+ * Consists are assembled and broken up as trains are made up: this is
+ * state, not configuration. The consists are saved using the depositor
+ * state channel (see housedcc_live.c for how saves are debounced) and
+ * restored when that state is loaded on startup. The restored consists
+ * are validated as if they were added again: the invalid consists and
+ * members are ignored (and logged).
+ *
+ * const char *housedcc_consist_add (const char *ID, int address);
  *
  *    Declare a new empty consist. The address is the DCC consist address
- *    that will be set for each locomotive assigned to this consist.
+ *    that will be set for each locomotive assigned to this consist (1 to
+ *    127). Return 0 on success, an error text otherwise.
  *
  * void housedcc_consist_delete (const char *ID);
  *
- *    Delete a declared consist. This remove all
+ *    Delete a declared consist. This remove all vehicles from the consist
+ *    first.
  *
- * void housedcc_consist_assign (const char *consist,
- *                               const char *vehicle, char mode);
+ * const char *housedcc_consist_assign (const char *consist,
+ *                                      const char *vehicle, char mode);
  *
  *    Assign the specified vehicle to the named consist. Multiple
  *    locomotives can be assigned to the same consist, but each locomotive
@@ -51,21 +67,13 @@
  *       'd': this vehicle does not even have a DCC decoder.
  *
  *    A consist ID must not conflict with a locomotive ID.
+ *    Return 0 on success, an error text otherwise.
  *
  * void housedcc_consist_remove (const char *vehicle);
  *
  *    Remove the specified vehicle from its current consist, if any.
  *    A consist is deleted when its last vehicle has been removed.
  *
- * int housedcc_consist_export (char *buffer, int size, const char *prefix);
- *
- *    Export the list of declared consists in JSON format. This is used
- *    to save the HouseDcc configuration.
- *
- * const char *housedcc_consist_reload (void);
- *
- *    Reload the list of consists from a saved configuration.
- *
  * int housedcc_consist_move (const char *id, int speed);
  *
  *    Control a consist's or locomotive's movements.
@@ -89,13 +97,33 @@
  *
  *    Tell this module that all vehicles were stopped (DCC STOP ALL)
  *
- * void housedcc_consist_periodic (time_t now);
+ * int housedcc_consist_renew (const char *id);
+ *
+ *    Renew the lease of one moving consist, or of all moving consists if
+ *    id is null. Return the number of consists impacted.
+ *
+ * void housedcc_consist_replay (void);
+ *
+ *    Send again the current speed of every moving consist, for example
+ *    after PiDCC was restarted. The consist address of each locomotive
+ *    is kept by the decoder itself (CV19) and is not sent. The commands
+ *    are sent a few at a time, by housedcc_consist_periodic().
+ *
+ * int housedcc_consist_periodic (time_t now);
  *
- *    The periodic function that maintain information about locomotives.
+ *    The periodic function that maintain information about consists.
+ *    This returns 1 if the live state changed, 0 otherwise.
  *
- * int housedcc_consist_status (char *buffer, int size);
+ * int housedcc_consist_delta (long long since);
  *
- *    A function that populates a complete status in JSON.
+ *    Return 1 if a partial status since the specified sequence number is
+ *    meaningful, 0 if a complete status is required.
+ *
+ * void housedcc_consist_status (DccJson *json, long long since);
+ *
+ *    A function that populates a status in JSON. If since is 0, the status
+ *    is complete, otherwise it lists only the consists that changed after
+ *    that sequence number.
  *
  * const char *housedcc_consist_initialize (int argc, const char **argv);
  *
@@ -110,66 +138,628 @@
 #include <echttp.h>
 #include <echttp_json.h>
 #include <echttp_encoding.h>
+#include "echttp_libc.h"
 
 #include "houselog.h"
 #include "housediscover.h"
+#include "housedepositorstate.h"
+#include "houseconfig.h"
 
+#include "housedcc_json.h"
+#include "housedcc_metrics.h"
+#include "housedcc_event.h"
+#include "housedcc_pidcc.h"
+#include "housedcc_live.h"
+#include "housedcc_fleet.h"
 #include "housedcc_consist.h"
 
 #define DEBUG if (echttp_isdebug()) printf
 
-void housedcc_consist_add (const char *ID, int address) {
-    // TBD
+#define CONSIST_ADDRESS_MAX 128 // Consist addresses are 7 bits only.
+#define CONSIST_MEMBERS_MAX 8
+#define CONSIST_REFRESH_BURST 8 // Max refresh commands per periodic tick.
+
+typedef struct {
+    char id[15];
+    char mode;
+} DccMember;
+
+typedef struct {
+    char id[15];
+    short address;
+    short speed;   // 'prototype' speed, from the lead locomotive's table.
+    short count;
+    unsigned short instruction; // The last DCC speed instruction sent.
+    DccPacket packet; // The same, encoded for PiDCC.
+    time_t deadline; // End of the lease, 0 if not moving.
+    time_t refresh;  // When to repeat the speed instruction.
+    long long changed; // Sequence number of the latest live state change.
+    char replay; // The speed must be sent again.
+    DccMember members[CONSIST_MEMBERS_MAX];
+} DccConsist;
+
+// There are typically only a few consists, each with a few vehicles:
+// a linear search is good enough.
+//
+static DccConsist *Consists = 0;
+static int         ConsistsCount = 0;
+static int         ConsistsAllocated = 0;
+
+// The sequence number of the latest addition or deletion of consists or
+// consist members (see housedcc_fleet.c).
+static long long ConsistListChanged = 0;
+
+static int ConsistMetricExpired = -1;
+static int ConsistReplayPending = 0;
+
+static int housedcc_consist_find (const char *id) {
+    int i;
+    for (i = 0; i < ConsistsCount; ++i) {
+        if (!strcmp (id, Consists[i].id)) return i;
+    }
+    return -1;
 }
 
-void housedcc_consist_delete (const char *ID) {
-    // TBD
+static int housedcc_consist_find_member (const char *id, int *member) {
+    int i;
+    for (i = 0; i < ConsistsCount; ++i) {
+        int j;
+        for (j = 0; j < Consists[i].count; ++j) {
+            if (!strcmp (id, Consists[i].members[j].id)) {
+                if (member) *member = j;
+                return i;
+            }
+        }
+    }
+    return -1;
 }
 
-void housedcc_consist_assign (const char *consist,
-                              const char *loco, char mode) {
-    // TBD
+static int housedcc_consist_powered (char mode) {
+    return (mode == 'f') || (mode == 'r');
 }
 
-void housedcc_consist_remove (const char *loco) {
-    // TBD
+static int housedcc_consist_valid_mode (char mode) {
+    switch (mode) {
+    case 'f': case 'r': case 'i': case 'd': return 1;
+    }
+    return 0;
+}
+
+static void housedcc_consist_status_consist (DccJson *json,
+                                             const DccConsist *consist) {
+
+    housedcc_json_raw (json, "{\"id\":");
+    housedcc_json_string (json, consist->id);
+    housedcc_json_raw (json, ",\"address\":");
+    housedcc_json_integer (json, consist->address);
+    housedcc_json_raw (json, ",\"speed\":");
+    housedcc_json_integer (json, consist->speed);
+
+    const char *prefix = ",\"vehicles\":[";
+    int i;
+    for (i = 0; i < consist->count; ++i) {
+        char mode[2] = {consist->members[i].mode, 0};
+        housedcc_json_raw (json, prefix);
+        housedcc_json_raw (json, "{\"id\":");
+        housedcc_json_string (json, consist->members[i].id);
+        housedcc_json_raw (json, ",\"mode\":");
+        housedcc_json_string (json, mode);
+        housedcc_json_raw (json, "}");
+        prefix = ",";
+    }
+    if (consist->count > 0) housedcc_json_raw (json, "]");
+    housedcc_json_raw (json, "}");
+}
+
+static void housedcc_consist_changed (DccConsist *consist) {
+
+    static DccJson event;
+
+    consist->changed = housedcc_live_changed ();
+
+    if (housedcc_live_subscribed ()) {
+        housedcc_json_start (&event);
+        housedcc_json_raw (&event, "{\"sequence\":");
+        housedcc_json_integer (&event, consist->changed);
+        housedcc_json_raw (&event, ",\"consist\":");
+        housedcc_consist_status_consist (&event, consist);
+        housedcc_json_raw (&event, "}");
+        if (! housedcc_json_failed (&event))
+            housedcc_live_publish ("consist", housedcc_json_text (&event));
+    }
+}
+
+// The list of consists, or of their members, changed: this must be saved.
+//
+static void housedcc_consist_persist (void) {
+    ConsistListChanged = housedcc_live_changed ();
+    housedcc_live_persist ();
 }
 
-int housedcc_consist_export (char *buffer, int size, const char *prefix) {
-    // TBD
+static void housedcc_consist_stationary (DccConsist *consist) {
+    consist->speed = 0;
+    consist->deadline = 0;
+    housedcc_consist_changed (consist);
+}
+
+// Tell one locomotive to listen to the consist address, or to stop
+// listening to it if consist is 0.
+//
+static void housedcc_consist_link (const DccMember *member, int consist) {
+
+    if (! housedcc_consist_powered (member->mode)) return;
+
+    int address = housedcc_fleet_address (member->id);
+    if (address <= 0) return; // This vehicle was deleted.
+    housedcc_pidcc_consist (address, consist,
+                            consist && (member->mode == 'r'));
+}
+
+// Validate a consist definition against the consists already known.
+// Return 0 if valid, an error text otherwise.
+//
+static const char *housedcc_consist_check (const char *id, int address) {
+
+    if ((!id) || (!id[0])) return "Missing consist ID";
+    if ((address <= 0) || (address >= CONSIST_ADDRESS_MAX))
+        return "Invalid consist address";
+    if (housedcc_fleet_exists (id)) return "Conflicts with a vehicle ID";
+
+    int i;
+    for (i = 0; i < ConsistsCount; ++i) {
+        if (strcmp (id, Consists[i].id) && (Consists[i].address == address))
+            return "Duplicate consist address";
+    }
     return 0;
 }
 
-const char *housedcc_consist_reload (void) {
-    // TBD
+const char *housedcc_consist_add (const char *id, int address) {
+
+    const char *error = housedcc_consist_check (id, address);
+    if (error) return error;
+
+    int i;
+    int cursor = housedcc_consist_find (id);
+    if (cursor < 0) {
+        if (ConsistsCount >= ConsistsAllocated) {
+            ConsistsAllocated += 16;
+            Consists = realloc (Consists,
+                                ConsistsAllocated * sizeof(DccConsist));
+        }
+        cursor = ConsistsCount++;
+        memset (Consists + cursor, 0, sizeof(DccConsist));
+        strtcpy (Consists[cursor].id, id, sizeof(Consists[0].id));
+        Consists[cursor].address = (short)address;
+        housedcc_consist_stationary (Consists + cursor);
+        houselog_event ("CONSIST", id, "CREATED", "AT ADDRESS %d", address);
+
+    } else if (Consists[cursor].address != address) {
+
+        // Move all the locomotives to the new consist address.
+        DccConsist *consist = Consists + cursor;
+        for (i = 0; i < consist->count; ++i) {
+            housedcc_consist_link (consist->members + i, address);
+        }
+        consist->address = (short)address;
+        housedcc_pidcc_encode_speed
+            (&consist->packet, address, consist->instruction);
+        housedcc_consist_changed (consist);
+        houselog_event ("CONSIST", id, "MODIFIED", "AT ADDRESS %d", address);
+    }
+    housedcc_consist_persist ();
     return 0;
 }
 
-int housedcc_consist_move (const char *id, int speed) {
-    // TBD
+void housedcc_consist_delete (const char *id) {
+
+    int cursor = housedcc_consist_find (id);
+    if (cursor < 0) return;
+
+    DccConsist *consist = Consists + cursor;
+    if (consist->deadline > 0) housedcc_pidcc_stop (consist->address, 0, 1);
+
+    int i;
+    for (i = 0; i < consist->count; ++i) {
+        housedcc_consist_link (consist->members + i, 0);
+    }
+    houselog_event ("CONSIST", id, "DELETED", "");
+
+    // Keep the list compact, since the consists are searched linearly.
+    ConsistsCount -= 1;
+    if (cursor < ConsistsCount) Consists[cursor] = Consists[ConsistsCount];
+    housedcc_consist_persist ();
+}
+
+const char *housedcc_consist_assign (const char *consist,
+                                     const char *loco, char mode) {
+
+    if (! housedcc_consist_valid_mode (mode)) return "Invalid mode";
+    if (! housedcc_fleet_exists (loco)) return "Unknown vehicle";
+
+    int cursor = housedcc_consist_find (consist);
+    if (cursor < 0) return "Unknown consist";
+
+    int member;
+    int current = housedcc_consist_find_member (loco, &member);
+    if (current != cursor) {
+        if (Consists[cursor].count >= CONSIST_MEMBERS_MAX)
+            return "Too many vehicles in consist";
+        if (current >= 0) {
+            housedcc_consist_remove (loco);
+            cursor = housedcc_consist_find (consist); // It may have moved.
+        }
+        member = Consists[cursor].count++;
+        strtcpy (Consists[cursor].members[member].id,
+                 loco, sizeof(Consists[0].members[0].id));
+    }
+
+    DccConsist *thisconsist = Consists + cursor;
+    DccMember *thismember = thisconsist->members + member;
+    if (housedcc_consist_powered (thismember->mode) &&
+        (! housedcc_consist_powered (mode))) {
+        housedcc_consist_link (thismember, 0); // Was linked.
+    }
+    thismember->mode = mode;
+    housedcc_consist_link (thismember, thisconsist->address);
+
+    houselog_event ("VEHICLE", loco, "ASSIGNED",
+                    "TO CONSIST %s, MODE %c", consist, mode);
+    housedcc_consist_changed (thisconsist);
+    housedcc_consist_persist ();
     return 0;
 }
 
-int housedcc_consist_stop (const char *id, int emergency) {
-    // TBD
+void housedcc_consist_remove (const char *loco) {
+
+    int member;
+    int cursor = housedcc_consist_find_member (loco, &member);
+    if (cursor < 0) return;
+
+    DccConsist *consist = Consists + cursor;
+    housedcc_consist_link (consist->members + member, 0);
+    houselog_event ("VEHICLE", loco, "REMOVED", "FROM CONSIST %s", consist->id);
+
+    consist->count -= 1;
+    int i;
+    for (i = member; i < consist->count; ++i) {
+        consist->members[i] = consist->members[i+1];
+    }
+    if (consist->count <= 0) {
+        char id[sizeof(consist->id)];
+        strtcpy (id, consist->id, sizeof(id));
+        housedcc_consist_delete (id);
+        return;
+    }
+    housedcc_consist_changed (consist);
+    housedcc_consist_persist ();
+}
+
+// Save the consists to the depositor state. The source must not truncate
+// the JSON text: nothing is saved if it does not fit.
+//
+static int housedcc_consist_state (char *buffer, int size) {
+
+    static DccJson state;
+
+    housedcc_json_start (&state);
+    housedcc_json_raw (&state, ",\"consists\":[");
+
+    int i;
+    for (i = 0; i < ConsistsCount; ++i) {
+        const DccConsist *consist = Consists + i;
+        if (i > 0) housedcc_json_raw (&state, ",");
+        housedcc_json_raw (&state, "{\"id\":");
+        housedcc_json_string (&state, consist->id);
+        housedcc_json_raw (&state, ",\"address\":");
+        housedcc_json_integer (&state, consist->address);
+        housedcc_json_raw (&state, ",\"vehicles\":[");
+        int j;
+        for (j = 0; j < consist->count; ++j) {
+            char mode[2] = {consist->members[j].mode, 0};
+            if (j > 0) housedcc_json_raw (&state, ",");
+            housedcc_json_raw (&state, "{\"id\":");
+            housedcc_json_string (&state, consist->members[j].id);
+            housedcc_json_raw (&state, ",\"mode\":");
+            housedcc_json_string (&state, mode);
+            housedcc_json_raw (&state, "}");
+        }
+        housedcc_json_raw (&state, "]}");
+    }
+    housedcc_json_raw (&state, "]");
+
+    int length = housedcc_json_length (&state);
+    if (housedcc_json_failed (&state) || (length >= size)) {
+        houselog_trace (HOUSE_FAILURE, "STATE", "consists do not fit");
+        return 0;
+    }
+    memcpy (buffer, housedcc_json_text (&state), length + 1);
+    return length;
+}
+
+static void housedcc_consist_restore_members (DccConsist *consist, int item) {
+
+    int j;
+    for (j = 0; j < CONSIST_MEMBERS_MAX; ++j) {
+        char path[128];
+        snprintf (path, sizeof(path), ".consists[%d].vehicles[%d].id", item, j);
+        const char *id = housedepositor_state_get_string (path);
+        if (!id) break;
+        snprintf (path, sizeof(path), ".consists[%d].vehicles[%d].mode", item, j);
+        const char *mode = housedepositor_state_get_string (path);
+        if (!mode) continue;
+
+        const char *error = 0;
+        if (! housedcc_consist_valid_mode (mode[0]))
+            error = "INVALID MODE";
+        else if (houseconfig_active () && (! housedcc_fleet_exists (id)))
+            error = "UNKNOWN VEHICLE"; // Only known once the fleet is loaded.
+        else if (housedcc_consist_find_member (id, 0) >= 0)
+            error = "ALREADY IN A CONSIST";
+        if (error) {
+            houselog_event ("VEHICLE", id, "IGNORED",
+                            "IN CONSIST %s: %s", consist->id, error);
+            continue;
+        }
+
+        DccMember *member = consist->members + (consist->count)++;
+        strtcpy (member->id, id, sizeof(member->id));
+        member->mode = mode[0];
+    }
+}
+
+// Reload the consists when the depositor state has been loaded. This
+// replaces the current list of consists.
+//
+static void housedcc_consist_restore (void) {
+
+    // The consists that are replaced must not keep moving.
+    int i;
+    for (i = 0; i < ConsistsCount; ++i) {
+        DccConsist *consist = Consists + i;
+        if (consist->deadline > 0)
+            housedcc_pidcc_stop (consist->address, 0, consist->speed >= 0);
+    }
+    ConsistsCount = 0;
+    ConsistListChanged = housedcc_live_changed ();
+
+    // The decoders keep their consist address (CV19) when powered off:
+    // there is no need to send it again.
+    for (i = 0; ; ++i) {
+        char path[128];
+        snprintf (path, sizeof(path), ".consists[%d].id", i);
+        const char *id = housedepositor_state_get_string (path);
+        if (!id) break;
+        snprintf (path, sizeof(path), ".consists[%d].address", i);
+        int address = housedepositor_state_get_integer (path);
+
+        const char *error = housedcc_consist_check (id, address);
+        if ((!error) && (housedcc_consist_find (id) >= 0))
+            error = "Duplicate consist ID";
+        if (error) {
+            houselog_event ("CONSIST", id, "IGNORED", "%s", error);
+            continue;
+        }
+
+        if (ConsistsCount >= ConsistsAllocated) {
+            ConsistsAllocated += 16;
+            Consists = realloc (Consists,
+                                ConsistsAllocated * sizeof(DccConsist));
+        }
+        DccConsist *consist = Consists + ConsistsCount++;
+        memset (consist, 0, sizeof(DccConsist));
+        strtcpy (consist->id, id, sizeof(consist->id));
+        consist->address = (short)address;
+        consist->changed = housedcc_live_changed ();
+        housedcc_consist_restore_members (consist, i);
+    }
+}
+
+// Find the speed instruction for this consist, using the speed table
+// of the first powered vehicle that has one.
+//
+static int housedcc_consist_encode (const DccConsist *consist,
+                                    int speed, int *actual) {
+    int i;
+    for (i = 0; i < consist->count; ++i) {
+        const DccMember *member = consist->members + i;
+        if (! housedcc_consist_powered (member->mode)) continue;
+        int instruction = housedcc_fleet_encode (member->id, speed, actual);
+        if (instruction) return instruction;
+    }
     return 0;
 }
 
+static int housedcc_consist_resolve (const char *id) {
+    int cursor = housedcc_consist_find (id);
+    if (cursor < 0) cursor = housedcc_consist_find_member (id, 0);
+    return cursor;
+}
+
+int housedcc_consist_move (const char *id, int speed) {
+
+    int cursor = housedcc_consist_resolve (id);
+    if (cursor < 0) return 0;
+
+    DccConsist *consist = Consists + cursor;
+
+    int actual = 0;
+    int instruction = housedcc_consist_encode (consist, speed, &actual);
+    if (!instruction) {
+        houselog_event ("CONSIST", consist->id, "FAILED", "NO SPEED TABLE");
+        return 1; // The ID exists.
+    }
+
+    if (actual != consist->speed) {
+        if (actual && consist->speed &&
+            ((actual < 0) != (consist->speed < 0))) {
+            // The consist is reversing direction. DCC expect a stop
+            // command first.
+            housedcc_pidcc_stop (consist->address, 0, consist->speed > 0);
+        }
+        consist->speed = actual;
+        housedcc_consist_changed (consist);
+
+        if (!actual) {
+            // A stop is never coalesced with other events.
+            houselog_event ("CONSIST", consist->id, "STOP", "AT 0 KM/H");
+        } else {
+            const char *direction = (speed < 0)?"REVERSE":"FORWARD";
+            housedcc_event_record ("CONSIST", consist->id, direction,
+                                   "AT %d KM/H", abs(actual));
+        }
+    }
+
+    int refresh, lease;
+    housedcc_fleet_timing (&refresh, &lease);
+    time_t now = time(0);
+    consist->deadline = now + lease;
+    consist->refresh = now + refresh;
+    if ((consist->instruction != instruction) || (!consist->packet.length)) {
+        consist->instruction = (unsigned short)instruction;
+        housedcc_pidcc_encode_speed
+            (&consist->packet, consist->address, instruction);
+    }
+    housedcc_pidcc_send (&consist->packet);
+    return 1;
+}
+
+int housedcc_consist_stop (const char *id, int emergency) {
+
+    int cursor = housedcc_consist_resolve (id);
+    if (cursor < 0) return 0;
+
+    DccConsist *consist = Consists + cursor;
+    houselog_event ("CONSIST", consist->id, "STOP",
+                    emergency?"EMERGENCY BREAK":"STANDARD BREAK");
+
+    int dir = (consist->speed >= 0)? 1 : 0;
+    housedcc_consist_stationary (consist);
+    housedcc_pidcc_stop (consist->address, emergency, dir);
+    return 1;
+}
+
 void housedcc_consist_stopped (void) {
-    // TBD
+    int i;
+    for (i = 0; i < ConsistsCount; ++i) {
+        if (Consists[i].speed || Consists[i].deadline)
+            housedcc_consist_stationary (Consists + i);
+    }
 }
 
-void housedcc_consist_periodic (time_t now) {
-    // TBD
+int housedcc_consist_renew (const char *id) {
+
+    int refresh, lease;
+    housedcc_fleet_timing (&refresh, &lease);
+    time_t deadline = time(0) + lease;
+
+    if (id) {
+        int cursor = housedcc_consist_resolve (id);
+        if (cursor < 0) return 0;
+        if (Consists[cursor].deadline <= 0) return 0; // Not moving.
+        Consists[cursor].deadline = deadline;
+        return 1;
+    }
+    int i;
+    int count = 0;
+    for (i = 0; i < ConsistsCount; ++i) {
+        if (Consists[i].deadline > 0) {
+            Consists[i].deadline = deadline;
+            count += 1;
+        }
+    }
+    return count;
 }
 
-int housedcc_consist_status (char *buffer, int size) {
-    // TBD
-    return 0;
+void housedcc_consist_replay (void) {
+    int i;
+    ConsistReplayPending = 0;
+    for (i = 0; i < ConsistsCount; ++i) {
+        DccConsist *consist = Consists + i;
+        consist->replay = (consist->deadline > 0);
+        ConsistReplayPending += consist->replay;
+    }
+}
+
+// Send the speed of the consists marked for replay, as much as PiDCC
+// can take right now.
+//
+static void housedcc_consist_replaying (void) {
+    int i;
+    for (i = 0; (i < ConsistsCount) && (ConsistReplayPending > 0); ++i) {
+        DccConsist *consist = Consists + i;
+        if (!consist->replay) continue;
+        if (housedcc_pidcc_room () <= 0) return;
+        if (consist->deadline > 0)
+            housedcc_pidcc_send (&consist->packet);
+        consist->replay = 0;
+        ConsistReplayPending -= 1;
+    }
+    ConsistReplayPending = 0; // Consists may have been deleted since.
+}
+
+int housedcc_consist_periodic (time_t now) {
+
+    // Same lease and refresh rules as for individual vehicles: see
+    // housedcc_fleet_background().
+    int refresh, lease;
+    housedcc_fleet_timing (&refresh, &lease);
+
+    int i;
+    int changed = 0;
+    int burst = 0;
+    for (i = 0; i < ConsistsCount; ++i) {
+        DccConsist *consist = Consists + i;
+        if (consist->deadline <= 0) continue;
+
+        if (consist->deadline < now) {
+            if (refresh > 0) {
+                housedcc_pidcc_stop (consist->address, 0, consist->speed >= 0);
+            }
+            housedcc_consist_stationary (consist);
+            housedcc_metrics_count (ConsistMetricExpired, 1);
+            changed = 1;
+            continue;
+        }
+        if ((refresh > 0) && (consist->refresh <= now) &&
+            (burst < CONSIST_REFRESH_BURST)) {
+            housedcc_pidcc_repeat (&consist->packet);
+            consist->refresh = now + refresh;
+            burst += 1;
+        }
+    }
+    if (ConsistReplayPending > 0) housedcc_consist_replaying ();
+    return changed;
+}
+
+int housedcc_consist_delta (long long since) {
+    return (since >= ConsistListChanged) &&
+           (since <= housedcc_live_sequence());
+}
+
+void housedcc_consist_status (DccJson *json, long long since) {
+
+    int i;
+    int listed = 0;
+    const char *prefix = ",\"consists\":[";
+
+    for (i = 0; i < ConsistsCount; ++i) {
+
+        if (Consists[i].changed <= since) continue; // No change.
+
+        housedcc_json_raw (json, prefix);
+        housedcc_consist_status_consist (json, Consists + i);
+        listed += 1;
+        prefix = ",";
+    }
+    if (listed > 0) housedcc_json_raw (json, "]");
 }
 
 const char *housedcc_consist_initialize (int argc, const char **argv) {
-    // TBD
+    ConsistMetricExpired =
+        housedcc_metrics_counter ("housedcc_lease_expired_total",
+                                  "target=\"consist\"",
+                                  "Moving vehicles or consists stopped on lease expiry.");
+    housedepositor_state_register (housedcc_consist_state);
+    housedepositor_state_listen (housedcc_consist_restore);
     return 0;
 }
-
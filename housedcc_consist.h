@@ -20,19 +20,19 @@
  *
  * housedcc_consist.h - Control consists.
  */
-void housedcc_consist_add (const char *ID, int address);
+const char *housedcc_consist_add (const char *ID, int address);
 void housedcc_consist_delete (const char *ID);
-void housedcc_consist_assign (const char *consist,
-                              const char *loco, char mode);
+const char *housedcc_consist_assign (const char *consist,
+                                     const char *loco, char mode);
 void housedcc_consist_remove (const char *loco);
 
-const char *housedcc_consist_reload (void);
-int  housedcc_consist_export (char *buffer, int size, const char *prefix);
-
 int  housedcc_consist_move (const char *id, int speed);
 int  housedcc_consist_stop (const char *id, int emergency);
 void housedcc_consist_stopped (void);
+int  housedcc_consist_renew (const char *id);
 
-void housedcc_consist_periodic (time_t now);
-int housedcc_consist_status (char *buffer, int size);
+void housedcc_consist_replay (void);
+int  housedcc_consist_periodic (time_t now);
+int housedcc_consist_delta (long long since);
+void housedcc_consist_status (DccJson *json, long long since);
 const char *housedcc_consist_initialize (int argc, const char **argv);
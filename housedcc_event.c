@@ -0,0 +1,207 @@
+/* HouseDCC - A model train control service
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedcc_event.c - Coalesce the frequent events.
+ *
+ * SYNOPSYS:
+ *
+ * This module sits between the modules that control vehicles, consists
+ * and accessories, and the event log. These generate an event for each
+ * speed or device change, which floods the event log (and the depot that
+ * stores it) when a traffic control system adjusts speeds continuously,
+ * or when a speed ramp is in progress.
+ *
+ * Each object is allowed one event per second. The events that come
+ * faster are not logged: only the latest one is kept, and it is logged
+ * later with a count of all the events it replaces. An event that
+ * repeats the previous one (same action and text) is simply dropped for
+ * a few seconds. The cost of an event that is not logged is a text
+ * formatting in a fixed size table: the cost of logging does not grow
+ * with the rate of commands anymore.
+ *
+ * All events, logged or not, are also recorded by housecapture ("EVENT"
+ * category), which does nothing unless a capture was started from the
+ * web UI. This provides a complete trace when needed, without loading
+ * the event log.
+ *
+ * Events that matter for safety or for the configuration (stop, create,
+ * delete, errors) should be logged directly, not through this module.
+ *
+ * const char *housedcc_event_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module. Return 0 on success, an error text otherwise.
+ *
+ * void housedcc_event_record (const char *category, const char *object,
+ *                             const char *action, const char *format, ...);
+ *
+ *    Log one event, subject to coalescing. The category must be a static
+ *    string, as used with houselog_event().
+ *
+ * void housedcc_event_background (time_t now);
+ *
+ *    The periodic function that logs the pending coalesced events.
+ */
+
+#include <string.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <echttp.h>
+#include "echttp_libc.h"
+
+#include "houselog.h"
+#include "housecapture.h"
+
+#include "housedcc_json.h"
+#include "housedcc_hash.h"
+#include "housedcc_metrics.h"
+#include "housedcc_timer.h"
+#include "housedcc_event.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define EVENT_SLOTS    128  // Must be a power of 2.
+#define EVENT_INTERVAL 1000 // Milliseconds between two events of an object.
+#define EVENT_REPEAT   10000 // Milliseconds before repeating the same event.
+
+// One entry per object. When two objects share the same slot, the older
+// one is evicted, after logging its pending event if any.
+//
+typedef struct {
+    const char *category;
+    char object[16];
+    long long logged;  // When the latest event was logged (ms).
+    unsigned int digest; // Of the latest event logged.
+    int suppressed;    // Events since then, not logged yet.
+    char action[16];   // The latest event not logged.
+    char text[96];
+} DccEventSlot;
+
+static DccEventSlot EventSlots[EVENT_SLOTS];
+static int EventPending = 0; // Slots with suppressed events.
+
+static int EventCapture = -1;
+
+static int EventMetricLogged = -1;
+static int EventMetricSuppressed = -1;
+
+static void housedcc_event_log (DccEventSlot *slot, const char *action,
+                                const char *text, long long now) {
+
+    if (slot->suppressed > 1)
+        houselog_event (slot->category, slot->object, action,
+                        "%s (%d EVENTS COALESCED)", text, slot->suppressed);
+    else
+        houselog_event (slot->category, slot->object, action, "%s", text);
+
+    housedcc_metrics_count (EventMetricLogged, 1);
+    slot->logged = now;
+    slot->digest = housedcc_hash_append
+                       (housedcc_hash_string (action), text);
+}
+
+static void housedcc_event_flush (DccEventSlot *slot, long long now) {
+    if (slot->suppressed <= 0) return;
+    housedcc_event_log (slot, slot->action, slot->text, now);
+    slot->suppressed = 0;
+    EventPending -= 1;
+}
+
+void housedcc_event_record (const char *category, const char *object,
+                            const char *action, const char *format, ...) {
+
+    char text[96];
+    va_list args;
+    va_start (args, format);
+    vsnprintf (text, sizeof(text), format, args);
+    va_end (args);
+
+    housecapture_record (EventCapture, object, action, "%s", text);
+
+    unsigned int hash = housedcc_hash_string (object);
+    DccEventSlot *slot = EventSlots + (hash & (EVENT_SLOTS - 1));
+    long long now = housedcc_timer_now ();
+
+    if ((slot->category != category) || strcmp (slot->object, object)) {
+        housedcc_event_flush (slot, now);
+        slot->category = category;
+        strtcpy (slot->object, object, sizeof(slot->object));
+        slot->logged = 0;
+        slot->digest = 0;
+    }
+
+    if (slot->logged > 0) {
+        long long elapsed = now - slot->logged;
+        unsigned int digest =
+            housedcc_hash_append (housedcc_hash_string (action), text);
+        int repeat = (digest == slot->digest) && (elapsed < EVENT_REPEAT);
+        if (repeat && (slot->suppressed <= 0)) {
+            housedcc_metrics_count (EventMetricSuppressed, 1);
+            return; // Nothing new to tell.
+        }
+        if (elapsed < EVENT_INTERVAL) {
+            if (slot->suppressed <= 0) EventPending += 1;
+            slot->suppressed += 1;
+            strtcpy (slot->action, action, sizeof(slot->action));
+            strtcpy (slot->text, text, sizeof(slot->text));
+            housedcc_metrics_count (EventMetricSuppressed, 1);
+            return;
+        }
+    }
+
+    // Log this event, which supersedes any pending one.
+    if (slot->suppressed > 0) {
+        slot->suppressed += 1;
+        EventPending -= 1;
+    }
+    housedcc_event_log (slot, action, text, now);
+    slot->suppressed = 0;
+}
+
+void housedcc_event_background (time_t now) {
+
+    if (EventPending <= 0) return;
+
+    long long timestamp = housedcc_timer_now ();
+    int i;
+    for (i = 0; i < EVENT_SLOTS; ++i) {
+        DccEventSlot *slot = EventSlots + i;
+        if (slot->suppressed <= 0) continue;
+        if (timestamp - slot->logged < EVENT_INTERVAL) continue;
+        housedcc_event_flush (slot, timestamp);
+    }
+}
+
+const char *housedcc_event_initialize (int argc, const char **argv) {
+
+    EventCapture = housecapture_register ("EVENT");
+
+    EventMetricLogged =
+        housedcc_metrics_counter ("housedcc_events_total",
+                                  "result=\"logged\"",
+                                  "Vehicle, consist and accessory events.");
+    EventMetricSuppressed =
+        housedcc_metrics_counter ("housedcc_events_total",
+                                  "result=\"coalesced\"",
+                                  "Vehicle, consist and accessory events.");
+    return 0;
+}
@@ -40,28 +40,42 @@
  * vehicle model indicates if the unit is a locomotive, a DCC equipped car,
  * or a car with no DCC onboard.
  *
+ * The state of the vehicles functions is not part of the configuration:
+ * it is saved using the depositor state channel, and restored (and sent
+ * again to the decoders) when that state is loaded on startup.
+ *
  * const char *housedcc_fleet_initialize (int argc, const char **argv);
  *
  *    Initialize this module.
  *
  * void housedcc_fleet_declare (const char *model, const char *scale,
+ *                              int steps,
  *                              int fcount, const char *functions[],
  *                              int scount, short speeds[]);
  *
- *    Declare a new vehicle model. The default scale is "N".
+ *    Declare a new vehicle model. The default scale is "N". The steps
+ *    value selects the DCC speed steps mode: 128, or 28 (the default).
  *
  *    A function string uses the format <name>:<index>, where index 0
- *    means FL and index 1..12 means F1..F12.
+ *    means FL (F0) and index 1..28 means F1..F28.
  *
  *    The speed array contains prototype speed values in Km/h or Mph. Value
  *    at index 0 represents DCC speed step 2, the value at index 1 represents
- *    DCC speed step 3, etc.
+ *    DCC speed step 3, etc. There can be up to 28 speeds in 28 steps mode,
+ *    up to 126 in 128 steps mode.
  *
  * const char *housedcc_fleet_add (const char *id, const char *model, int address);
  *
  *    Declare a new vehicle. This replaces an existing vehicle if the
  *    ID is already in use. It returns 0 on success, an error text otherwise.
  *
+ * const char *housedcc_fleet_district (const char *id, const char *district);
+ *
+ *    Assign a vehicle to a power district (see housedcc_pidcc.c), so that
+ *    its commands are sent to that district only. A null or empty district
+ *    name means all districts (the default). It returns 0 on success, an
+ *    error text otherwise.
+ *
  * void housedcc_fleet_delete (const char *id);
  *
  *    Remove a declared vehicle or model. If the same name is used for
@@ -80,7 +94,8 @@
  *    of the locomotive.
  *
  *    A positive speed means forward movement, a negative speed means reverse
- *    movement, while a 0 speed means normal stop.
+ *    movement, while a 0 speed means normal stop. The speed is converted to
+ *    the DCC step with the nearest speed in the model's speed table.
  *
  *    The explicit stop command has an emergency option to cut power
  *    immediately. It is otherwise similar to speed 0.
@@ -91,26 +106,100 @@
  *
  *    Tell this module that all vehicle were stopped (DCC STOP ALL).
  *
+ * void housedcc_fleet_momentum (const char *model, int accel, int decel);
+ *
+ *    Set the acceleration and deceleration rates of a model, in 'prototype'
+ *    speed units per second. A rate of 0 (the default) disables the
+ *    corresponding ramp: the speed then changes immediately, as requested.
+ *    When the relevant rate is set, a move request only sets the target
+ *    speed and the actual speed moves toward it over time (see
+ *    housedcc_fleet_background()). A DCC speed command is sent only when
+ *    the DCC step actually changes. A normal stop then follows the
+ *    deceleration ramp, while an emergency stop is always immediate.
+ *
+ * int housedcc_fleet_renew (const char *id);
+ *
+ *    Renew the lease of one moving vehicle, or of all moving vehicles if
+ *    id is null. This does not send any DCC command. Return the number of
+ *    vehicles impacted.
+ *
+ * void housedcc_fleet_refresh (int period, int lease);
+ *
+ *    Set how often (in seconds, 0 to disable) this service repeats the
+ *    current speed of each moving vehicle, and how long (in seconds) a
+ *    vehicle keeps moving without a new move or renew request. When there
+ *    are too many moving vehicles for the track bandwidth reserved to the
+ *    refresh (see housedcc_pidcc_refresh_capacity()), the refresh period
+ *    is stretched so that the refresh never saturates the track. A lease
+ *    of 0 keeps the current lease duration.
+ *
+ * void housedcc_fleet_timing (int *refresh, int *lease);
+ *
+ *    Retrieve the current refresh period and lease duration, so that
+ *    consists follow the same rules as vehicles.
+ *
+ * int housedcc_fleet_address (const char *id);
+ *
+ *    Return the DCC address of the vehicle, 0 if the vehicle is not known.
+ *
+ * int housedcc_fleet_encode (const char *id, int speed, int *actual);
+ *
+ *    Return the DCC speed and direction instruction that matches the
+ *    specified speed, according to the speed table of that vehicle's model.
+ *    The speed from the table is returned in actual. This does not send
+ *    anything: this is used to control a consist using the speed table of
+ *    its lead locomotive. Return 0 if there is no suitable speed table.
+ *
  * void housedcc_fleet_reload (void);
  *
- *    Reload from a saved configuration.
+ *    Reload from a saved configuration. The models and vehicles are
+ *    matched by name and ID: those that did not change are kept as is,
+ *    including the live state of the vehicles (speed, functions, lease),
+ *    so that a configuration change does not disturb the running trains.
  *
- * int housedcc_fleet_export (char *buffer, int size, const char *prefix);
+ * void housedcc_fleet_export (DccJson *json, const char *prefix);
  *
  *    export this module's configuration to JSON format.
  *
+ * const char *housedcc_fleet_import (const char *data, int length);
+ *
+ *    Add (or replace) all the models and vehicles listed in the JSON data,
+ *    which uses the same format as the exported configuration. Existing
+ *    models and vehicles that are not listed are kept. Nothing is changed
+ *    if any item is invalid or conflicts with the fleet. Return 0 on
+ *    success, an error text otherwise.
+ *
+ * void housedcc_fleet_replay (void);
+ *
+ *    Send again the current speed and functions of every vehicle, for
+ *    example after PiDCC was restarted. The commands are sent a few at
+ *    a time, by housedcc_fleet_background(), as PiDCC accepts them.
+ *
  * int housedcc_fleet_background (time_t now);
  *
  *    The periodic function that maintain information about locomotives.
- *    This returns 1 if the live state changed, 0 otherwise.
+ *    This returns 1 if the live state changed, 0 otherwise. The lease
+ *    expirations, speed refreshes and speed ramps of each moving vehicle
+ *    are driven by a timer (see housedcc_timer.c), with a millisecond
+ *    resolution: this function only reports their changes.
  *
- * int housedcc_fleet_status (char *buffer, int size);
+ * int housedcc_fleet_delta (long long since);
  *
- *    A function that populates a complete status in JSON.
+ *    Return 1 if a partial status, listing only the vehicles that changed
+ *    after the specified sequence number, is meaningful, 0 if a complete
+ *    status is required (for example because vehicles were added or
+ *    deleted since).
+ *
+ * void housedcc_fleet_status (DccJson *json, long long since);
+ *
+ *    A function that populates a status in JSON. If since is 0, the status
+ *    is complete. Otherwise the status lists only the vehicles that changed
+ *    after that sequence number (see housedcc_live.c).
  *
  */
 
 #include <string.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -123,28 +212,79 @@
 #include "houselog.h"
 #include "houseconfig.h"
 #include "housediscover.h"
+#include "housedepositorstate.h"
 
+#include "housedcc_json.h"
+#include "housedcc_hash.h"
+#include "housedcc_metrics.h"
+#include "housedcc_timer.h"
+#include "housedcc_event.h"
 #include "housedcc_pidcc.h"
+#include "housedcc_live.h"
 #include "housedcc_fleet.h"
+#include "housedcc_consist.h"
 
 #define DEBUG if (echttp_isdebug()) printf
 
-#define FUNCTION_MAX   16
-#define SPEED_STEP_MAX 28
+#define FUNCTION_MAX   29 // One device per function, F0 to F28.
+#define FUNCTION_INDEX_MAX 28
+
+#define FLEET_CONFIG_VERSION 2 // Index 13 means F13, not FL.
+#define SPEED_STEP_MAX 126 // With 128 speed steps mode.
+
+// The speed lookup is a dense array, so put a limit on its size.
+#define SPEED_LOOKUP_MAX 1024
 
 #define MODEL_SCALE_DEFAULT "N"
 
+#define FLEET_LEASE_DEFAULT 7
+#define FLEET_REFRESH_BURST  8  // Max refresh commands per millisecond.
+#define FLEET_REFRESH_SPREAD 10 // Delay for the refreshes past the burst (ms).
+#define FLEET_RAMP_PERIOD    50 // How often a speed ramp is updated (ms).
+
 typedef struct {
     char name[15]; // Keep names as standard as possible.
     char index;
 } DccFunction;
 
+#define DCC_ADDRESS_MAX 10240 // Long addresses go from 128 to 10239.
+#define DCC_DISTRICTS_MAX 8
+
+// The hash tables, address table and free lists below store the slot
+// index plus one, so that 0 (the static initial value) means "no entry".
+// A deleted slot is not part of any hash chain, so the same "next" field
+// is used to chain it in the free list.
+//
+#define FLEET_HASH_SIZE 256 // Must be a power of 2.
+
 typedef struct {
     char name[15];
     short count;
     DccFunction functions[FUNCTION_MAX];
     short speeds[SPEED_STEP_MAX];
+    short steps; // DCC speed steps mode: 28 or 128.
     char scale[4];
+    int next; // Hash chain or free list.
+
+    // Compiled from the speed table when the model is declared or loaded:
+    // a prototype speed to DCC step lookup, and the DCC instruction for
+    // each step in both directions (one or two bytes, see housedcc_pidcc.c).
+    short speedmax;
+    unsigned char *lookup;
+
+    // The momentum profile, in 'prototype' speed units per second (0: none).
+    short accel;
+    short decel;
+    unsigned short forward[SPEED_STEP_MAX+1];
+    unsigned short reverse[SPEED_STEP_MAX+1];
+
+    // Cached JSON fragments, built when the model is declared or loaded:
+    // the complete model object for the configuration, and the speeds
+    // item listed in the status of each vehicle of this model.
+    char *exported;
+    char *speedlist;
+    int exportedlength;
+    int speedlistlength;
 } DccModel;
 
 typedef struct {
@@ -152,26 +292,123 @@ typedef struct {
     short address;
     short speed;   // 'prototype' speed in Km/h or Mph.
     short step;    // The translation of the 'prototype' speed to DCC step.
-    short functions;
-    time_t deadline;
-    DccModel *model;
+    unsigned int functions; // One bit per function, F0 (FL) to F28.
+    short model;   // Index in Models, -1 if none. Survives Models realloc.
+    unsigned short instruction; // The last DCC speed instruction sent.
+    long long deadline; // End of the lease (ms, timer clock), 0 if stopped.
+    long long refresh;  // When to repeat the speed instruction (ms).
+    int timer;          // See housedcc_timer.c, 0 if none yet.
+    long long changed; // Sequence number of the latest live state change.
+    int next; // Hash chain or free list.
+    char replay; // The speed and functions must be sent again.
+    char district; // 0 means all districts.
+
+    // The speed instruction and the function groups, encoded for PiDCC.
+    // These are rebuilt only when the step, direction, functions or
+    // address change, so that a refresh or replay sends them as is.
+    DccPacket speedpacket;
+    DccPacket functionpackets[5];
+
+    // Speed ramp, when the model has a momentum profile: the current
+    // speed is kept with a finer resolution, in 1/1000 of a unit.
+    char ramping;
+    short target;   // The requested 'prototype' speed.
+    int ramp;       // The current speed, 1/1000 units.
+    long long ramped; // Time of the latest ramp update (ms, timer clock).
 } DccVehicle;
 
 static DccModel *Models = 0;
 static int       ModelsCount = 0;
 static int       ModelsAllocated = 0;
+static int       ModelsHash[FLEET_HASH_SIZE];
+static int       ModelsFree = 0;
 
 static DccVehicle *Vehicles = 0;
 static int         VehiclesCount = 0;
 static int         VehiclesAllocated = 0;
+static int         VehiclesHash[FLEET_HASH_SIZE];
+static int         VehiclesFree = 0;
+
+// The sequence number of the latest addition or deletion of models or
+// vehicles. A partial status cannot report these, since this is a change
+// to the list itself.
+static long long FleetListChanged = 0;
+
+static int FleetMetricExpired = -1;
+static int FleetReplayPending = 0; // Vehicles marked for replay.
+static int FleetRamping = 0; // Vehicles currently changing speed.
+static int FleetMoving[DCC_DISTRICTS_MAX+1]; // Leases, per district.
+static int FleetLiveChanged = 0; // Set by the timers, see background.
+
+static int FleetRefresh = 0; // Disabled by default.
+static int FleetLease = FLEET_LEASE_DEFAULT;
+
+// Set while loading a configuration older than FLEET_CONFIG_VERSION.
+static int FleetLegacy = 0;
+static int         VehiclesByAddress[DCC_ADDRESS_MAX];
+
+static unsigned int housedcc_fleet_hash (const char *name) {
+    return housedcc_hash_string (name) & (FLEET_HASH_SIZE - 1);
+}
+
+static void housedcc_fleet_index_model (int cursor) {
+    unsigned int hash = housedcc_fleet_hash (Models[cursor].name);
+    Models[cursor].next = ModelsHash[hash];
+    ModelsHash[hash] = cursor + 1;
+}
+
+static void housedcc_fleet_unindex_model (int cursor) {
+    int *link = ModelsHash + housedcc_fleet_hash (Models[cursor].name);
+    while (*link) {
+        if (*link == cursor + 1) {
+            *link = Models[cursor].next;
+            break;
+        }
+        link = &(Models[*link - 1].next);
+    }
+    Models[cursor].next = 0;
+}
+
+static void housedcc_fleet_index_vehicle (int cursor) {
+
+    unsigned int hash = housedcc_fleet_hash (Vehicles[cursor].id);
+    Vehicles[cursor].next = VehiclesHash[hash];
+    VehiclesHash[hash] = cursor + 1;
+
+    int address = Vehicles[cursor].address;
+    if ((address > 0) && (address < DCC_ADDRESS_MAX)) {
+        if (!VehiclesByAddress[address])
+            VehiclesByAddress[address] = cursor + 1;
+    }
+}
+
+static void housedcc_fleet_unindex_vehicle (int cursor) {
+
+    int *link = VehiclesHash + housedcc_fleet_hash (Vehicles[cursor].id);
+    while (*link) {
+        if (*link == cursor + 1) {
+            *link = Vehicles[cursor].next;
+            break;
+        }
+        link = &(Vehicles[*link - 1].next);
+    }
+    Vehicles[cursor].next = 0;
+
+    int address = Vehicles[cursor].address;
+    if ((address > 0) && (address < DCC_ADDRESS_MAX)) {
+        if (VehiclesByAddress[address] == cursor + 1)
+            VehiclesByAddress[address] = 0;
+    }
+}
 
 static int housedcc_fleet_find_model (const char *model) {
 
     if ((!model) || (!model[0])) return -1;
 
-    int i;
-    for (i = 0; i < ModelsCount; ++i) {
-        if (!strcmp (model, Models[i].name)) return i;
+    int i = ModelsHash[housedcc_fleet_hash (model)];
+    while (i > 0) {
+        if (!strcmp (model, Models[i-1].name)) return i - 1;
+        i = Models[i-1].next;
     }
     DEBUG ("Cannot find model %s\n", model);
     return -1;
@@ -179,47 +416,253 @@ static int housedcc_fleet_find_model (const char *model) {
 
 static int housedcc_fleet_find (const char *id) {
 
-    int i;
-    for (i = 0; i < VehiclesCount; ++i) {
-        if (!strcmp (id, Vehicles[i].id)) return i;
+    if ((!id) || (!id[0])) return -1;
+
+    int i = VehiclesHash[housedcc_fleet_hash (id)];
+    while (i > 0) {
+        if (!strcmp (id, Vehicles[i-1].id)) return i - 1;
+        i = Vehicles[i-1].next;
     }
     DEBUG ("Cannot find vehicle %s\n", id);
     return -1;
 }
 
 static int housedcc_fleet_find_address (int address) {
-    int i;
 
-    for (i = 0; i < VehiclesCount; ++i) {
-        if (address == Vehicles[i].address) return i;
+    if ((address > 0) && (address < DCC_ADDRESS_MAX)) {
+        int i = VehiclesByAddress[address];
+        if (i > 0) return i - 1;
     }
     DEBUG ("Cannot find address %d\n", address);
     return -1;
 }
 
-void housedcc_fleet_declare (const char *model, const char *scale,
+static DccModel *housedcc_fleet_model (const DccVehicle *vehicle) {
+    if ((vehicle->model < 0) || (vehicle->model >= ModelsCount)) return 0;
+    return Models + vehicle->model;
+}
+
+static int housedcc_fleet_new_model (void) {
+
+    if (ModelsFree > 0) {
+        int cursor = ModelsFree - 1;
+        ModelsFree = Models[cursor].next;
+        Models[cursor].next = 0;
+        return cursor;
+    }
+    if (ModelsCount >= ModelsAllocated) {
+        ModelsAllocated += 16;
+        Models = realloc (Models, ModelsAllocated * sizeof(DccModel));
+    }
+    memset (Models + ModelsCount, 0, sizeof(DccModel));
+    return ModelsCount++;
+}
+
+static void housedcc_fleet_uncache (DccModel *model) {
+    if (model->exported) free (model->exported);
+    if (model->speedlist) free (model->speedlist);
+    model->exported = model->speedlist = 0;
+    model->exportedlength = model->speedlistlength = 0;
+}
+
+static char *housedcc_fleet_keep (DccJson *json, int *length) {
+
+    const char *text = housedcc_json_text (json);
+    *length = housedcc_json_length (json);
+
+    char *copy = malloc (*length + 1);
+    if (copy)
+        memcpy (copy, text, *length + 1);
+    else
+        *length = 0;
+    return copy;
+}
+
+static void housedcc_fleet_cache (DccModel *model) {
+
+    static DccJson scratch;
+
+    housedcc_fleet_uncache (model);
+
+    housedcc_json_start (&scratch);
+    int step = SPEED_STEP_MAX;
+    while (--step >= 0) if (model->speeds[step]) break;
+    if (step >= 0) {
+       const char *prefix = ",\"speeds\":[";
+       int j;
+       for (j = 0 ; j <= step; ++j) {
+          housedcc_json_raw (&scratch, prefix);
+          housedcc_json_integer (&scratch, model->speeds[j]);
+          prefix = ",";
+       }
+       housedcc_json_raw (&scratch, "]");
+    }
+    model->speedlist = housedcc_fleet_keep (&scratch, &model->speedlistlength);
+
+    housedcc_json_start (&scratch);
+    housedcc_json_raw (&scratch, "{\"name\":");
+    housedcc_json_string (&scratch, model->name);
+    housedcc_json_raw (&scratch, ",\"scale\":");
+    housedcc_json_string (&scratch, model->scale);
+    if (model->steps == 128)
+        housedcc_json_raw (&scratch, ",\"steps\":128");
+    if (model->count > 0) {
+       const char *prefix = ",\"devices\":[";
+       int j;
+       for (j = 0; j < model->count; ++j) {
+           housedcc_json_raw (&scratch, prefix);
+           housedcc_json_raw (&scratch, "{\"name\":");
+           housedcc_json_string (&scratch, model->functions[j].name);
+           housedcc_json_raw (&scratch, ",\"index\":");
+           housedcc_json_integer (&scratch, model->functions[j].index);
+           housedcc_json_raw (&scratch, "}");
+           prefix = ",";
+       }
+       housedcc_json_raw (&scratch, "]");
+    }
+    if (model->speedlist)
+        housedcc_json_append (&scratch, model->speedlist,
+                              model->speedlistlength);
+    if (model->accel > 0) {
+        housedcc_json_raw (&scratch, ",\"accel\":");
+        housedcc_json_integer (&scratch, model->accel);
+    }
+    if (model->decel > 0) {
+        housedcc_json_raw (&scratch, ",\"decel\":");
+        housedcc_json_integer (&scratch, model->decel);
+    }
+    housedcc_json_raw (&scratch, "}");
+    model->exported = housedcc_fleet_keep (&scratch, &model->exportedlength);
+}
+
+// The number of usable steps in the speed table depends on the DCC speed
+// steps mode of the model: 28 steps, or 126 steps (128 steps mode, where
+// the two other values are stop and emergency stop).
+//
+static int housedcc_fleet_steps_limit (int steps) {
+    return (steps == 128) ? 126 : 28;
+}
+
+static int housedcc_fleet_steps_mode (int steps) {
+    return (steps == 128) ? 128 : 28;
+}
+
+static void housedcc_fleet_compile (DccModel *model) {
+
+    int i;
+    int limit = housedcc_fleet_steps_limit (model->steps);
+    for (i = 0; i <= limit; ++i) {
+        if (model->steps == 128) {
+            model->forward[i] = housedcc_pidcc_encode_step128 (i, 1);
+            model->reverse[i] = housedcc_pidcc_encode_step128 (i, 0);
+        } else {
+            model->forward[i] = housedcc_pidcc_encode_step (i, 1);
+            model->reverse[i] = housedcc_pidcc_encode_step (i, 0);
+        }
+    }
+    for (i = limit; i < SPEED_STEP_MAX; ++i) model->speeds[i] = 0; // Unused.
+
+    int max = 0;
+    for (i = 0; i < limit; ++i) {
+        if (model->speeds[i] > max) max = model->speeds[i];
+    }
+    if (max >= SPEED_LOOKUP_MAX) max = SPEED_LOOKUP_MAX - 1;
+
+    if (model->lookup) free (model->lookup);
+    model->lookup = 0;
+    model->speedmax = max;
+    if (max <= 0) return; // No speed table, this vehicle cannot move.
+
+    model->lookup = calloc (max + 1, 1);
+
+    // Each speed is mapped to the step with the nearest speed value.
+    // Ties resolve to the lowest speed (or lowest step if they are the
+    // same), so an exact match always gets the step it was declared for.
+    // Any non-zero speed moves the vehicle, if only at the slowest step.
+    int speed;
+    for (speed = 1; speed <= max; ++speed) {
+        int best = 0;
+        int bestdistance = INT_MAX;
+        for (i = 0; i < limit; ++i) {
+            int value = model->speeds[i];
+            if (value <= 0) continue;
+            int distance = abs (value - speed);
+            if ((distance < bestdistance) ||
+                ((distance == bestdistance) && (best > 0) &&
+                 (value < model->speeds[best-1]))) {
+                best = i + 1;
+                bestdistance = distance;
+            }
+        }
+        model->lookup[speed] = best;
+    }
+}
+
+static int housedcc_fleet_step (const DccModel *model, int speed) {
+    if ((speed <= 0) || (!model->lookup)) return 0;
+    if (speed > model->speedmax) speed = model->speedmax;
+    return model->lookup[speed];
+}
+
+static int housedcc_fleet_new_vehicle (void) {
+
+    if (VehiclesFree > 0) {
+        int cursor = VehiclesFree - 1;
+        VehiclesFree = Vehicles[cursor].next;
+        Vehicles[cursor].next = 0;
+        return cursor;
+    }
+    if (VehiclesCount >= VehiclesAllocated) {
+        VehiclesAllocated += 16;
+        Vehicles = realloc (Vehicles, VehiclesAllocated * sizeof(DccVehicle));
+    }
+    memset (Vehicles + VehiclesCount, 0, sizeof(DccVehicle));
+    Vehicles[VehiclesCount].model = -1;
+    return VehiclesCount++;
+}
+
+// Older versions of HouseDCC only supported FL and F1 to F12, and used
+// index 13 as an alias for FL. In a configuration saved by such a version
+// (no version item), a model that uses index 13 but neither index 0 nor
+// any index above 13 follows that old convention: its index 13 is then
+// converted to FL, with a warning, so that its headlight still works.
+// The configuration is saved with the new index on the next change.
+//
+static void housedcc_fleet_legacy (DccModel *model, const char *name) {
+
+    if (!FleetLegacy) return;
+
+    int i;
+    int legacy = -1;
+    for (i = 0; i < model->count; ++i) {
+        int index = model->functions[i].index;
+        if ((index == 0) || (index > 13)) return; // Current convention.
+        if (index == 13) legacy = i;
+    }
+    if (legacy < 0) return;
+
+    model->functions[legacy].index = 0;
+    houselog_event ("MODEL", name, "CONVERTED",
+                    "DEVICE %s INDEX 13 IS NOW FL (INDEX 0)",
+                    model->functions[legacy].name);
+}
+
+void housedcc_fleet_declare (const char *model, const char *scale, int steps,
                              int fcount, const char *functions[],
                              int scount, short speeds[]) {
 
     int cursor = housedcc_fleet_find_model (model);
     if (cursor < 0) {
-        // This is a new model. Try to reuse a deleted spot first.
+        // This is a new model. A deleted spot is reused first.
         DEBUG ("New vehicle model %s\n", model);
-        for (cursor = 0; cursor < ModelsCount; ++cursor) {
-            if (Models[cursor].name[0] == 0) break;
-        }
-        if (cursor >= ModelsCount) {
-            if (ModelsCount >= ModelsAllocated) {
-                ModelsAllocated += 16;
-                Models = realloc (Models, ModelsAllocated * sizeof(DccModel));
-            }
-            cursor = ModelsCount++;
-        }
+        cursor = housedcc_fleet_new_model ();
         strtcpy (Models[cursor].name, model, sizeof(Models[0].name));
+        housedcc_fleet_index_model (cursor);
     }
 
     if (!scale) scale = MODEL_SCALE_DEFAULT;
     strtcpy (Models[cursor].scale, scale, sizeof(Models[0].scale));
+    Models[cursor].steps = housedcc_fleet_steps_mode (steps);
 
     if (fcount > FUNCTION_MAX) fcount = FUNCTION_MAX;
     Models[cursor].count = fcount;
@@ -233,42 +676,151 @@ void housedcc_fleet_declare (const char *model, const char *scale,
         if (sep) {
             *sep = 0;
             int index = (char)atoi(sep+1);
-            if (index == 13) index = 0; // Compatibility with FL = 13.
-            if ((index < 0) || (index > 12)) index = -1; // Invalid.
+            if ((index < 0) || (index > FUNCTION_INDEX_MAX)) index = -1;
             Models[cursor].functions[i].index = index;
         }
     }
+    housedcc_fleet_legacy (Models + cursor, model);
     if (scount > SPEED_STEP_MAX) scount = SPEED_STEP_MAX;
     for (i = 0; i < scount; ++i) Models[cursor].speeds[i] = speeds[i];
     for ( ; i < SPEED_STEP_MAX; ++i) Models[cursor].speeds[i] = 0;
+    housedcc_fleet_compile (Models + cursor);
+    housedcc_fleet_cache (Models + cursor);
 
+    FleetListChanged = housedcc_live_changed ();
     houselog_event ("MODEL", model, "CREATED", "");
 }
 
 static int housedcc_fleet_valid_address (int address) {
-    return (address > 0) && (address < 128);
+    return (address > 0) && (address < DCC_ADDRESS_MAX);
+}
+
+static void housedcc_fleet_status_vehicle (DccJson *json,
+                                           const DccVehicle *vehicle) {
+
+    housedcc_json_raw (json, "{\"id\":");
+    housedcc_json_string (json, vehicle->id);
+    housedcc_json_raw (json, ",\"address\":");
+    housedcc_json_integer (json, vehicle->address);
+    housedcc_json_raw (json, ",\"speed\":");
+    housedcc_json_integer (json, vehicle->speed);
+    if (vehicle->ramping) {
+        housedcc_json_raw (json, ",\"target\":");
+        housedcc_json_integer (json, vehicle->target);
+    }
+
+    DccModel *model = housedcc_fleet_model (vehicle);
+    if (model) {
+        housedcc_json_raw (json, ",\"model\":");
+        housedcc_json_string (json, model->name);
+
+        if (model->count > 0) {
+            const char *prefix = ",\"devices\":{";
+            unsigned int mask = vehicle->functions;
+            int j;
+            for (j = 0; j < model->count; ++j) {
+                int index = model->functions[j].index;
+                int on = (index >= 0) && (mask & (1u << index));
+                housedcc_json_raw (json, prefix);
+                housedcc_json_string (json, model->functions[j].name);
+                housedcc_json_raw (json, on?":1":":0");
+                prefix = ",";
+            }
+            housedcc_json_raw (json, "}");
+        }
+        if (model->speedlist)
+            housedcc_json_append (json, model->speedlist,
+                                  model->speedlistlength);
+    }
+    housedcc_json_raw (json, "}");
+}
+
+static void housedcc_fleet_changed (DccVehicle *vehicle) {
+
+    static DccJson event;
+
+    vehicle->changed = housedcc_live_changed ();
+
+    if (housedcc_live_subscribed ()) {
+        housedcc_json_start (&event);
+        housedcc_json_raw (&event, "{\"sequence\":");
+        housedcc_json_integer (&event, vehicle->changed);
+        housedcc_json_raw (&event, ",\"vehicle\":");
+        housedcc_fleet_status_vehicle (&event, vehicle);
+        housedcc_json_raw (&event, "}");
+        if (! housedcc_json_failed (&event))
+            housedcc_live_publish ("vehicle", housedcc_json_text (&event));
+    }
+}
+
+// Stop the lease of a vehicle.
+//
+static void housedcc_fleet_halt (DccVehicle *vehicle) {
+    if (vehicle->deadline <= 0) return;
+    vehicle->deadline = 0;
+    FleetMoving[(int)vehicle->district] -= 1;
+}
+
+// The speed refresh period (ms), adjusted to the number of moving vehicles
+// in the vehicle's district, or in the busiest district if the vehicle is
+// not assigned to one. The vehicles not assigned load every district.
+//
+static long long housedcc_fleet_period (const DccVehicle *vehicle) {
+
+    long long period = FleetRefresh * 1000;
+    int count = housedcc_pidcc_districts ();
+    if (count > DCC_DISTRICTS_MAX) count = DCC_DISTRICTS_MAX;
+
+    int district;
+    for (district = 1; district <= count; ++district) {
+        if (vehicle->district && (vehicle->district != district)) continue;
+        long long load = FleetMoving[0] + FleetMoving[district];
+        long long spread =
+            (load * 1000) / housedcc_pidcc_refresh_capacity (district);
+        if (spread > period) period = spread;
+    }
+    return period;
+}
+
+// Start, or extend, the lease of a moving vehicle.
+//
+static void housedcc_fleet_lease (DccVehicle *vehicle) {
+    long long now = housedcc_timer_now ();
+    if (vehicle->deadline <= 0) FleetMoving[(int)vehicle->district] += 1;
+    vehicle->deadline = now + (FleetLease * 1000);
+    vehicle->refresh = now + housedcc_fleet_period (vehicle);
+}
+
+static void housedcc_fleet_steady (DccVehicle *vehicle) {
+    if (!vehicle->ramping) return;
+    vehicle->ramping = 0;
+    FleetRamping -= 1;
 }
 
 void housedcc_fleet_stationary (DccVehicle *vehicle) {
+    housedcc_fleet_steady (vehicle);
+    housedcc_timer_cancel (vehicle->timer);
     vehicle->step = 0;
     vehicle->speed = 0;
-    vehicle->deadline = 0;
+    housedcc_fleet_halt (vehicle);
+    housedcc_fleet_changed (vehicle);
 }
 
+static void housedcc_fleet_pack (DccVehicle *vehicle);
+
 const char *housedcc_fleet_add (const char *id, const char *model, int address) {
 
     if (!housedcc_fleet_valid_address (address)) return "Invalid address";
 
     int cursor;
-    DccModel *thismodel = 0;
+    int thismodel = -1;
 
     if (model) {
-        cursor = housedcc_fleet_find_model (model);
-        if (cursor < 0) {
+        thismodel = housedcc_fleet_find_model (model);
+        if (thismodel < 0) {
             DEBUG ("Unknown model %s referenced by vehicle %s\n", model, id);
             return "Unknown model";
         }
-        thismodel = Models + cursor;
     }
 
     cursor = housedcc_fleet_find (id);
@@ -281,44 +833,112 @@ const char *housedcc_fleet_add (const char *id, const char *model, int address)
 
     const char *action = "MODIFIED";
     if (cursor < 0) {
-        // This is a new vehicle. Try to reuse a deleted spot first.
+        // This is a new vehicle. A deleted spot is reused first.
         DEBUG ("New vehicle %s\n", id);
         action = "CREATED";
-        for (cursor = 0; cursor < VehiclesCount; ++cursor) {
-            if (Vehicles[cursor].id[0] == 0) break;
-        }
-        if (cursor >= VehiclesCount) {
-            if (VehiclesCount >= VehiclesAllocated) {
-                VehiclesAllocated += 16;
-                Vehicles = realloc (Vehicles,
-                                    VehiclesAllocated * sizeof(DccVehicle));
-            }
-            cursor = VehiclesCount++;
-        }
+        cursor = housedcc_fleet_new_vehicle ();
         strtcpy (Vehicles[cursor].id, id, sizeof(Vehicles[0].id));
+        Vehicles[cursor].address = 0;
+        Vehicles[cursor].district = 0;
+    } else {
+        housedcc_fleet_unindex_vehicle (cursor);
+    }
+    if (Vehicles[cursor].address != address) {
+        housedcc_pidcc_assign (Vehicles[cursor].address, 0);
+        housedcc_pidcc_assign (address, Vehicles[cursor].district);
     }
     Vehicles[cursor].address = (short)address;
+    housedcc_fleet_index_vehicle (cursor);
     housedcc_fleet_stationary (Vehicles + cursor);
     Vehicles[cursor].functions = 0;
-    Vehicles[cursor].model = thismodel;
+    Vehicles[cursor].model = (short)thismodel;
+    housedcc_fleet_pack (Vehicles + cursor);
 
+    FleetListChanged = housedcc_live_changed ();
     houselog_event ("VEHICLE", id,
                     action, "MODEL %s AT ADDRESS %d", model, address);
     return 0;
 }
 
+const char *housedcc_fleet_district (const char *id, const char *district) {
+
+    int cursor = housedcc_fleet_find (id);
+    if (cursor < 0) return "Unknown vehicle";
+
+    int index = housedcc_pidcc_district (district);
+    if ((index < 0) || (index > DCC_DISTRICTS_MAX)) return "Unknown district";
+
+    DccVehicle *vehicle = Vehicles + cursor;
+    if (vehicle->district == index) return 0; // No change.
+
+    if (vehicle->deadline > 0) {
+        FleetMoving[(int)vehicle->district] -= 1;
+        FleetMoving[index] += 1;
+    }
+    vehicle->district = (char)index;
+    housedcc_pidcc_assign (vehicle->address, index);
+    houselog_event ("VEHICLE", id, "ASSIGNED",
+                    "TO DISTRICT %s", index ? district : "(ALL)");
+    return 0;
+}
+
+// Free a vehicle slot, which goes to the free list for reuse.
+//
+// Stop a moving vehicle whose decoder is no longer controlled by this
+// entry (deleted, or given another address):
+// its lease would otherwise never be enforced.
+//
+static void housedcc_fleet_abandon (DccVehicle *vehicle) {
+    if (vehicle->deadline <= 0) return;
+    housedcc_pidcc_stop (vehicle->address, 0, (vehicle->speed >= 0)? 1 : 0);
+}
+
+static void housedcc_fleet_remove (int cursor) {
+    housedcc_fleet_unindex_vehicle (cursor);
+    housedcc_fleet_steady (Vehicles + cursor);
+    housedcc_timer_cancel (Vehicles[cursor].timer);
+    housedcc_fleet_halt (Vehicles + cursor);
+    housedcc_pidcc_assign (Vehicles[cursor].address, 0);
+    Vehicles[cursor].id[0] = 0;
+    Vehicles[cursor].address = 0;
+    Vehicles[cursor].district = 0;
+    Vehicles[cursor].model = -1;
+    Vehicles[cursor].next = VehiclesFree;
+    VehiclesFree = cursor + 1;
+}
+
+static void housedcc_fleet_remove_model (int cursor) {
+
+    // Detach the vehicles of that model, since the slot may be reused.
+    int i;
+    for (i = 0; i < VehiclesCount; ++i) {
+        if (Vehicles[i].model == cursor) Vehicles[i].model = -1;
+    }
+    housedcc_fleet_unindex_model (cursor);
+    Models[cursor].name[0] = 0;
+    if (Models[cursor].lookup) free (Models[cursor].lookup);
+    Models[cursor].lookup = 0;
+    housedcc_fleet_uncache (Models + cursor);
+    Models[cursor].next = ModelsFree;
+    ModelsFree = cursor + 1;
+}
+
 void housedcc_fleet_delete (const char *id) {
 
     int cursor = housedcc_fleet_find (id);
     if (cursor >= 0) {
-        Vehicles[cursor].id[0] = 0;
-        Vehicles[cursor].address = 0;
+        // Clear the decoder's consist address while it is still known.
+        housedcc_consist_remove (id);
+        housedcc_fleet_abandon (Vehicles + cursor);
+        housedcc_fleet_remove (cursor);
+        FleetListChanged = housedcc_live_changed ();
         houselog_event ("VEHICLE", id, "DELETED", "");
         return;
     }
     cursor = housedcc_fleet_find_model (id);
     if (cursor >= 0) {
-        Models[cursor].name[0] = 0;
+        housedcc_fleet_remove_model (cursor);
+        FleetListChanged = housedcc_live_changed ();
         houselog_event ("MODEL", id, "DELETED", "");
         return;
     }
@@ -328,50 +948,284 @@ int housedcc_fleet_exists (const char *id) {
     return housedcc_fleet_find (id) >= 0;
 }
 
+// Apply a new 'prototype' speed. The DCC instruction is sent if the DCC
+// step changed, or if forced (a move request is always transmitted, since
+// the client may repeat it to keep the vehicle moving).
+//
+static int housedcc_fleet_apply (DccVehicle *vehicle, const DccModel *model,
+                                 int speed, int force) {
+
+    // Convert the 'prototype' speed to the nearest DCC step.
+    int sign = (speed < 0)?-1:1;
+    int step = housedcc_fleet_step (model, abs(speed));
+    if ((speed != 0) && (step == 0)) return 0; // No speed table.
+    step *= sign;
+
+    if (step != vehicle->step) {
+
+        if (vehicle->step && step) {
+            int existingsign = ((vehicle->step) < 0)?-1:1;
+            if (sign != existingsign) {
+               // The locomotive is reversing direction. DCC expect a stop
+               // command first.
+               int dir = (vehicle->speed >= 0)? 1 : 0;
+               housedcc_pidcc_stop (vehicle->address, 0, dir);
+            }
+        }
+        // Report the speed actually selected, not the one requested.
+        vehicle->speed = step ? sign * model->speeds[abs(step) - 1] : 0;
+        vehicle->step = step;
+        housedcc_fleet_changed (vehicle);
+        force = 1;
+    }
+    int instruction = (step < 0) ? model->reverse[-step] : model->forward[step];
+    if ((instruction != vehicle->instruction) || (!vehicle->speedpacket.length)) {
+        vehicle->instruction = (unsigned short)instruction;
+        housedcc_pidcc_encode_speed
+            (&vehicle->speedpacket, vehicle->address, instruction);
+    }
+    if (!force) return 1;
+    return housedcc_pidcc_send (&vehicle->speedpacket);
+}
+
+// Return the rate that applies when going from the current speed to the
+// target speed: slowing down includes reversing, which goes through 0.
+//
+static int housedcc_fleet_rate (const DccModel *model,
+                                int current, int target) {
+    int slowing = ((current > 0) && (target < current)) ||
+                  ((current < 0) && (target > current));
+    return slowing ? model->decel : model->accel;
+}
+
+// Set the target speed of a vehicle that has a momentum profile. The
+// current speed then ramps toward it. Return 0 if the move is immediate.
+//
+static int housedcc_fleet_target (DccVehicle *vehicle, const DccModel *model,
+                                  int speed) {
+
+    // Already at that step: the move is just repeated.
+    int step = housedcc_fleet_step (model, abs(speed));
+    if (((speed < 0) ? -step : step) == vehicle->step) {
+        housedcc_fleet_steady (vehicle);
+        return 0;
+    }
+    int current = vehicle->ramping ? vehicle->ramp / 1000 : vehicle->speed;
+    if (housedcc_fleet_rate (model, current, speed) <= 0) {
+        housedcc_fleet_steady (vehicle);
+        return 0;
+    }
+    if (abs(speed) > model->speedmax)
+        speed = (speed < 0) ? -model->speedmax : model->speedmax;
+
+    if (!vehicle->ramping) {
+        vehicle->ramping = 1;
+        vehicle->ramp = vehicle->speed * 1000;
+        vehicle->ramped = housedcc_timer_now ();
+        FleetRamping += 1;
+    }
+    if (vehicle->target != speed) {
+        vehicle->target = speed;
+        housedcc_fleet_changed (vehicle);
+        if (!speed) {
+            // A stop is never coalesced with other events.
+            houselog_event ("VEHICLE", vehicle->id, "STOP", "RAMP TO 0 KM/H");
+        } else {
+            const char *direction = (speed < 0)?"REVERSE":"FORWARD";
+            housedcc_event_record ("VEHICLE", vehicle->id, direction,
+                                   "RAMP TO %d KM/H", abs(speed));
+        }
+    }
+    return 1;
+}
+
+static void housedcc_fleet_due (int cursor);
+
+// Arm the vehicle's timer for its next time-driven activity.
+//
+static void housedcc_fleet_schedule (int cursor) {
+
+    DccVehicle *vehicle = Vehicles + cursor;
+    if (vehicle->deadline <= 0) {
+        housedcc_timer_cancel (vehicle->timer);
+        return;
+    }
+    if (!vehicle->timer)
+        vehicle->timer = housedcc_timer_declare (housedcc_fleet_due, cursor);
+
+    long long next = vehicle->deadline;
+    if ((FleetRefresh > 0) && (vehicle->refresh < next))
+        next = vehicle->refresh;
+    if (vehicle->ramping) {
+        long long ramp = vehicle->ramped + FLEET_RAMP_PERIOD;
+        if (ramp < next) next = ramp;
+    }
+    housedcc_timer_at (vehicle->timer, next);
+}
+
 int housedcc_fleet_move (const char *id, int speed) {
 
     int cursor = housedcc_fleet_find (id);
     if (cursor < 0) return 0;
 
     DccVehicle *vehicle = Vehicles + cursor;
-    DccModel *model = vehicle->model;
+    DccModel *model = housedcc_fleet_model (vehicle);
     if (!model) return 0;
 
-    if (speed != vehicle->speed) {
-        // Convert the 'prototype' speed to a DCC step.
-        int sign = (speed < 0)?-1:1;
-        int absspeed = abs(speed);
-        int step = 0;
-        int i;
-        for (i = 0; i < SPEED_STEP_MAX; ++i) {
-           if (model->speeds[i] == absspeed) {
-              step = sign * (i + 1);
-              break;
-           }
+    if ((speed != 0) && (housedcc_fleet_step (model, abs(speed)) == 0))
+        return 0; // No speed table.
+
+    if (housedcc_fleet_target (vehicle, model, speed)) {
+        // The lease covers the ramp, even a ramp down to a stop: the ramp
+        // releases it when the vehicle stops.
+        housedcc_fleet_lease (vehicle);
+        housedcc_fleet_schedule (cursor);
+        return 1;
+    }
+
+    int step = vehicle->step;
+    int result = housedcc_fleet_apply (vehicle, model, speed, 1);
+    if (!result) return 0; // Nothing was sent: the lease is unchanged.
+
+    // A stopped vehicle needs no lease: no refresh, no expiration.
+    if (vehicle->step) housedcc_fleet_lease (vehicle);
+    else housedcc_fleet_halt (vehicle);
+    housedcc_fleet_schedule (cursor);
+    if (vehicle->step != step) {
+        if (!vehicle->step) {
+            // A stop is never coalesced with other events.
+            houselog_event ("VEHICLE", vehicle->id, "STOP",
+                            "AT 0 KM/H (DCC STEP 0)");
+        } else {
+            const char *direction = (speed < 0)?"REVERSE":"FORWARD";
+            housedcc_event_record ("VEHICLE", vehicle->id, direction,
+                                   "AT %d KM/H (DCC STEP %d)",
+                                   abs(vehicle->speed), abs(vehicle->step));
         }
-        if (step == 0) return 0;
+    }
+    return result;
+}
 
-        if (step < -31) step = -31;
-        else if (step > 31) step = 31;
+// Move the current speed of one vehicle toward its target. Return 1 if
+// the live state changed.
+//
+static int housedcc_fleet_ramp (DccVehicle *vehicle, long long now) {
 
-        if (vehicle->speed) {
-            int existingsign = ((vehicle->speed) < 0)?-1:1;
-            if (sign != existingsign) {
-               // The locomotive is reversing direction. DCC expect a stop
-               // command first.
-               int dir = (Vehicles[cursor].speed >= 0)? 1 : 0;
-               housedcc_pidcc_stop (vehicle->address, 0, dir);
-            }
+    DccModel *model = housedcc_fleet_model (vehicle);
+    if (!model) {
+        housedcc_fleet_steady (vehicle);
+        return 0;
+    }
+    long long elapsed = now - vehicle->ramped; // Milliseconds.
+    vehicle->ramped = now;
+
+    int current = vehicle->ramp;
+    int target = vehicle->target * 1000;
+
+    // When reversing, slow down to a stop first.
+    int bound = target;
+    if (((current > 0) && (target < 0)) || ((current < 0) && (target > 0)))
+        bound = 0;
+
+    int rate = housedcc_fleet_rate (model, current / 1000, bound / 1000);
+    long long delta = (rate > 0) ? rate * elapsed : abs(bound - current);
+
+    if (current < bound) {
+        current = (current + delta >= bound) ? bound : current + (int)delta;
+    } else {
+        current = (current - delta <= bound) ? bound : current - (int)delta;
+    }
+    vehicle->ramp = current;
+
+    long long changed = vehicle->changed;
+    housedcc_fleet_apply (vehicle, model, current / 1000, 0);
+
+    if (current == target) {
+        housedcc_fleet_steady (vehicle);
+        if (!target) housedcc_fleet_halt (vehicle); // Stopped.
+        housedcc_fleet_changed (vehicle); // The target is not listed anymore.
+        if (target)
+            housedcc_event_record ("VEHICLE", vehicle->id, "AT SPEED",
+                                   "AT %d KM/H (DCC STEP %d)",
+                                   abs(vehicle->speed), abs(vehicle->step));
+        else
+            houselog_event ("VEHICLE", vehicle->id, "STOPPED",
+                            "AT 0 KM/H (DCC STEP 0)");
+        return 1;
+    }
+    return (vehicle->changed != changed);
+}
+
+int housedcc_fleet_renew (const char *id) {
+
+    // The timers are not changed: when a timer expires before the new
+    // deadline, it is just armed again.
+    long long deadline = housedcc_timer_now () + (FleetLease * 1000);
+
+    if (id) {
+        int cursor = housedcc_fleet_find (id);
+        if (cursor < 0) return 0;
+        if (Vehicles[cursor].deadline <= 0) return 0; // Not moving.
+        Vehicles[cursor].deadline = deadline;
+        return 1;
+    }
+    int i;
+    int count = 0;
+    for (i = 0; i < VehiclesCount; ++i) {
+        if (Vehicles[i].deadline > 0) {
+            Vehicles[i].deadline = deadline;
+            count += 1;
         }
-        const char *direction = (speed < 0)?"REVERSE":"FORWARD";
-        houselog_event ("VEHICLE", vehicle->id, direction,
-                        "AT %d KM/H (DCC STEP %d)", absspeed, abs(step));
+    }
+    return count;
+}
 
-        vehicle->speed = speed;
-        vehicle->step = step;
+void housedcc_fleet_refresh (int period, int lease) {
+    if (period < 0) period = 0;
+    FleetRefresh = period;
+    if (lease > 0) FleetLease = lease;
+}
+
+void housedcc_fleet_timing (int *refresh, int *lease) {
+    *refresh = FleetRefresh;
+    *lease = FleetLease;
+}
+
+void housedcc_fleet_momentum (const char *model, int accel, int decel) {
+
+    int cursor = housedcc_fleet_find_model (model);
+    if (cursor < 0) return;
+
+    if (accel < 0) accel = 0;
+    if (decel < 0) decel = 0;
+    Models[cursor].accel = (short)accel;
+    Models[cursor].decel = (short)decel;
+    housedcc_fleet_cache (Models + cursor);
+}
+
+int housedcc_fleet_address (const char *id) {
+    int cursor = housedcc_fleet_find (id);
+    if (cursor < 0) return 0;
+    return Vehicles[cursor].address;
+}
+
+int housedcc_fleet_encode (const char *id, int speed, int *actual) {
+
+    int cursor = housedcc_fleet_find (id);
+    if (cursor < 0) return 0;
+
+    DccModel *model = housedcc_fleet_model (Vehicles + cursor);
+    if (!model) return 0;
+
+    int step = housedcc_fleet_step (model, abs(speed));
+    if ((speed != 0) && (step == 0)) return 0; // No speed table.
+
+    if (speed < 0) {
+        *actual = step ? 0 - model->speeds[step - 1] : 0;
+        return model->reverse[step];
     }
-    Vehicles[cursor].deadline = time(0) + 7; // TBD: make it configurable
-    return housedcc_pidcc_move (vehicle->address, vehicle->step);
+    *actual = step ? model->speeds[step - 1] : 0;
+    return model->forward[step];
 }
 
 int housedcc_fleet_stop (const char *id, int emergency) {
@@ -382,6 +1236,15 @@ int housedcc_fleet_stop (const char *id, int emergency) {
     houselog_event ("VEHICLE", Vehicles[cursor].id, "STOP",
                     emergency?"EMERGENCY BREAK":"STANDARD BREAK");
 
+    DccVehicle *vehicle = Vehicles + cursor;
+    if ((!emergency) && vehicle->step) {
+        DccModel *model = housedcc_fleet_model (vehicle);
+        if (model && housedcc_fleet_target (vehicle, model, 0)) {
+            housedcc_fleet_schedule (cursor);
+            return 1;
+        }
+    }
+
     int dir = (Vehicles[cursor].speed >= 0)? 1 : 0;
     housedcc_fleet_stationary (Vehicles + cursor);
     return housedcc_pidcc_stop (Vehicles[cursor].address, emergency, dir);
@@ -396,16 +1259,63 @@ void housedcc_fleet_stopped (int emergency) {
     }
 }
 
+// The DCC function groups. Each group is controlled as a whole, using
+// one instruction. Groups 3 and 4 use the two bytes feature expansion
+// instructions (see housedcc_pidcc.c for the two bytes format).
+//
+static int housedcc_fleet_function_group (int index) {
+    if (index <= 4) return 0;  // FL, F1 to F4.
+    if (index <= 8) return 1;  // F5 to F8.
+    if (index <= 12) return 2; // F9 to F12.
+    if (index <= 20) return 3; // F13 to F20.
+    return 4;                  // F21 to F28.
+}
+
+static int housedcc_fleet_function_instruction (unsigned int functions,
+                                                int group) {
+    switch (group) {
+    case 0: // CCC=100
+       return 0x80 + ((functions >> 1) & 0xf) + ((functions & 1)? 0x10 : 0);
+    case 1: // CCC=101, S=1
+       return 0xb0 + ((functions >> 5) & 0xf);
+    case 2: // CCC=101, S=0
+       return 0xa0 + ((functions >> 9) & 0xf);
+    case 3: // CCC=110, GGGGG=11110
+       return 0xde00 + ((functions >> 13) & 0xff);
+    }
+    // CCC=110, GGGGG=11111
+    return 0xdf00 + ((functions >> 21) & 0xff);
+}
+
+static void housedcc_fleet_pack_group (DccVehicle *vehicle, int group) {
+    housedcc_pidcc_encode_function
+        (vehicle->functionpackets + group, vehicle->address,
+         housedcc_fleet_function_instruction (vehicle->functions, group));
+}
+
+// Build all the packets of a vehicle, after its address or several of
+// its functions changed.
+//
+static void housedcc_fleet_pack (DccVehicle *vehicle) {
+    int group;
+    for (group = 0; group < 5; ++group)
+        housedcc_fleet_pack_group (vehicle, group);
+    if (vehicle->instruction)
+        housedcc_pidcc_encode_speed
+            (&vehicle->speedpacket, vehicle->address, vehicle->instruction);
+    else
+        vehicle->speedpacket.length = 0; // Built when a speed is applied.
+}
+
 int housedcc_fleet_set (const char *id, const char *name, int state) {
 
     int cursor = housedcc_fleet_find (id);
     if (cursor < 0) return 0;
 
-    DccModel *model = Vehicles[cursor].model;
+    DccVehicle *vehicle = Vehicles + cursor;
+    DccModel *model = housedcc_fleet_model (vehicle);
     if (!model) return 0; // No known DCC functions
 
-    houselog_event ("VEHICLE", Vehicles[cursor].id,
-                    "SET", "%s TO %s", name, state?"ON":"OFF");
     int i;
     for (i = 0; i < model->count; ++i) {
         if (!strcmp (name, model->functions[i].name)) break;
@@ -415,166 +1325,342 @@ int housedcc_fleet_set (const char *id, const char *name, int state) {
     int index = model->functions[i].index;
     if (index < 0) return 0; // Invalid function.
 
-    short mask = 1 << index;
+    unsigned int mask = 1u << index;
+    unsigned int functions = vehicle->functions;
     if (state)
-       Vehicles[cursor].functions |= mask;
+       functions |= mask;
     else
-       Vehicles[cursor].functions &= (~mask);
-
-    int instruction;
-    if (index <= 4) { // F1 to F4, FL.
-       instruction = 0x80; // CCC=100
-       instruction += (Vehicles[cursor].functions >> 1) & 0xf; // F1 to F4
-       instruction += (Vehicles[cursor].functions & 1)? 0x10 : 0; // FL
-
-    } else if (index <= 8) { // F5 to F8.
-       instruction = 0xb0; // CCC=101, S=1
-       instruction += (Vehicles[cursor].functions >> 5) & 0xf; // F5 to F8
-
-    } else if (index <= 12) { // F9 to F12.
-       instruction = 0xa0; // CCC=101, S=0
-       instruction += (Vehicles[cursor].functions >> 9) & 0xf; // F9 to F12
-
-    } else {
-       return 0; // Invalid auxiliary function index.
-    }
-
-    return housedcc_pidcc_function (Vehicles[cursor].address, instruction);
+       functions &= (~mask);
+    if (functions == vehicle->functions) return 1; // Nothing to send.
+
+    housedcc_event_record ("VEHICLE", vehicle->id,
+                           "SET", "%s TO %s", name, state?"ON":"OFF");
+    vehicle->functions = functions;
+    housedcc_fleet_changed (vehicle);
+    housedcc_live_persist ();
+
+    // If several functions of the same group are changed before PiDCC
+    // gets the command, only the most recent instruction is transmitted,
+    // since each instruction carries the state of the whole group.
+    int group = housedcc_fleet_function_group (index);
+    housedcc_fleet_pack_group (vehicle, group);
+    return housedcc_pidcc_send (vehicle->functionpackets + group);
 }
 
-static int housedcc_fleet_speeds (char *buffer, int size, DccModel *model) {
-
-    int cursor = 0;
-    int step = SPEED_STEP_MAX;
-    while (--step >= 0) if (model->speeds[step]) break;
-    if (step >= 0) {
-       const char *prefix = ",\"speeds\":[";
-       int j;
-       for (j = 0 ; j <= step; ++j) {
-          cursor += snprintf (buffer+cursor, size-cursor,
-                              "%s%d", prefix, model->speeds[j]);
-          if (cursor >= size) goto overflow;
-          prefix = ",";
-       }
-       cursor += snprintf (buffer+cursor, size-cursor, "]");
-       if (cursor >= size) goto overflow;
-    }
-    return cursor;
-
-overflow:
-    return 0;
+int housedcc_fleet_delta (long long since) {
+    return (since >= FleetListChanged) && (since <= housedcc_live_sequence());
 }
 
-int housedcc_fleet_status (char *buffer, int size) {
+void housedcc_fleet_status (DccJson *json, long long since) {
 
-    if (VehiclesCount <= 0) return 0; // Nothing to list.
+    if (VehiclesCount <= 0) return; // Nothing to list.
 
     int i;
-    int cursor = 0;
     int listed = 0;
     const char *prefix = ",\"vehicles\":[";
 
     for (i = 0; i < VehiclesCount; ++i) {
 
         if (!Vehicles[i].id[0]) continue; // Ignore obsolete entries.
+        if (Vehicles[i].changed <= since) continue; // No change.
 
-        DccModel *model = Vehicles[i].model;
-        char modelinfo[72];
-        if (model) {
-            snprintf (modelinfo, sizeof(modelinfo),
-                      ",\"model\":\"%s\"", model->name);
-        } else {
-            modelinfo[0] = 0;
-        }
-
-        cursor += snprintf (buffer+cursor, size-cursor,
-                            "%s{\"id\":\"%s\",\"address\":%d,\"speed\":%d%s",
-                            prefix,
-                            Vehicles[i].id,
-                            Vehicles[i].address,
-                            Vehicles[i].speed,
-                            modelinfo);
-        if (cursor >= size) goto overflow;
+        housedcc_json_raw (json, prefix);
+        housedcc_fleet_status_vehicle (json, Vehicles + i);
         listed += 1;
         prefix = ",";
+    }
+    if (listed > 0) housedcc_json_raw (json, "]");
+}
 
-        if (model && (model->count > 0)) {
-           const char *prefix2 = ",\"devices\":{";
-           int mask = Vehicles[i].functions;
-           int j;
-           for (j = 0; j < model->count; ++j) {
-              int on = mask & (1 << model->functions[j].index);
-              cursor += snprintf (buffer+cursor, size-cursor,
-                                  "%s\"%s\":%d",
-                                  prefix2,
-                                  model->functions[j].name,
-                                  on?1:0);
-              if (cursor >= size) goto overflow;
-              prefix2 = ",";
-           }
-           cursor += snprintf (buffer+cursor, size-cursor, "}");
-           if (cursor >= size) goto overflow;
-        }
-
-        if (model) {
-            cursor += housedcc_fleet_speeds (buffer+cursor, size-cursor, model);
-        }
-        cursor += snprintf (buffer+cursor, size-cursor, "}");
-        if (cursor >= size) goto overflow;
+// Send the function groups that include at least one of the functions
+// listed in the mask. The first index of each group is FL, F5, F9, F13
+// and F21.
+//
+static void housedcc_fleet_send_functions (const DccVehicle *vehicle,
+                                           unsigned int mask) {
+    static const int first[] = {0, 5, 9, 13, 21, FUNCTION_MAX};
+    int group;
+    for (group = 0; group < 5; ++group) {
+        unsigned int range =
+            ((1u << first[group+1]) - 1) & ~((1u << first[group]) - 1);
+        if (!(mask & range)) continue;
+        housedcc_pidcc_send (vehicle->functionpackets + group);
     }
-    if (listed > 0) {
-        cursor += snprintf (buffer+cursor, size-cursor, "]");
-        if (cursor >= size) goto overflow;
+}
+
+void housedcc_fleet_replay (void) {
+    int i;
+    FleetReplayPending = 0;
+    for (i = 0; i < VehiclesCount; ++i) {
+        DccVehicle *vehicle = Vehicles + i;
+        vehicle->replay = 0;
+        if (!vehicle->id[0]) continue;
+        if ((vehicle->deadline <= 0) && (!vehicle->functions)) continue;
+        vehicle->replay = 1;
+        FleetReplayPending += 1;
     }
-    return cursor;
+}
 
-overflow:
-    houselog_trace (HOUSE_FAILURE, "BUFFER", "overflow");
-    buffer[0] = 0;
-    return 0;
+// Send the state of the vehicles marked for replay, but only as much as
+// PiDCC can take right now: the rest waits for the next tick.
+//
+static void housedcc_fleet_replaying (void) {
+
+    int i;
+    for (i = 0; (i < VehiclesCount) && (FleetReplayPending > 0); ++i) {
+        DccVehicle *vehicle = Vehicles + i;
+        if (!vehicle->replay) continue;
+        if (housedcc_pidcc_room () < 6) return; // Speed and 5 groups.
+        if (vehicle->deadline > 0)
+            housedcc_pidcc_send (&vehicle->speedpacket);
+        if (vehicle->functions)
+            housedcc_fleet_send_functions (vehicle, vehicle->functions);
+        vehicle->replay = 0;
+        FleetReplayPending -= 1;
+    }
+    FleetReplayPending = 0; // Vehicles may have been deleted since.
 }
 
-int housedcc_fleet_background (time_t now) {
+// The time-driven activities of one moving vehicle.
+//
+static void housedcc_fleet_due (int cursor) {
+
+    static long long RefreshTick = 0;
+    static int RefreshBurst = 0;
+
+    DccVehicle *vehicle = Vehicles + cursor;
+    if (vehicle->deadline <= 0) return;
+
+    long long now = housedcc_timer_now ();
 
     // DCC engines stop moving after 10 seconds if the speed command
     // is not repeated. This is a safety feature, to prevent runaway
     // vehicle events.
-    // This program does not automatically repeat the speed command:
-    // this is up to the top level application to do it, for the same
-    // reason that the timeout exists in the first place.
-    int i;
-    int changed = 0;
-    for (i = VehiclesCount-1; i >= 0; --i) {
-        if ((Vehicles[i].deadline > 0) && (Vehicles[i].deadline < now)) {
-            housedcc_fleet_stationary (Vehicles + i);
-            changed = 1;
+    // By default this program does not automatically repeat the speed
+    // command: this is up to the top level application to do it, for the
+    // same reason that the timeout exists in the first place.
+    // If refresh is enabled, this program repeats the speed command, but
+    // only for as long as the top level application maintains the
+    // vehicle's lease. The top level application is still in control, by
+    // repeating move commands or by simply renewing leases.
+    if (vehicle->deadline <= now) {
+        if (FleetRefresh > 0) {
+            // Do not wait for the DCC decoder's own timeout.
+            int dir = (vehicle->speed >= 0)? 1 : 0;
+            housedcc_pidcc_stop (vehicle->address, 0, dir);
         }
+        housedcc_fleet_stationary (vehicle);
+        housedcc_metrics_count (FleetMetricExpired, 1);
+        FleetLiveChanged = 1;
+        return;
+    }
+    if (vehicle->ramping) {
+        if (housedcc_fleet_ramp (vehicle, now)) FleetLiveChanged = 1;
+        if (vehicle->deadline <= 0) return; // Stopped.
     }
+    if ((FleetRefresh > 0) && (vehicle->refresh <= now)) {
+        // Spread the refresh: the vehicles that exceed the burst limit
+        // are slightly delayed.
+        if (now != RefreshTick) {
+            RefreshTick = now;
+            RefreshBurst = 0;
+        }
+        if (RefreshBurst < FLEET_REFRESH_BURST) {
+            housedcc_pidcc_repeat (&vehicle->speedpacket);
+            vehicle->refresh = now + housedcc_fleet_period (vehicle);
+            RefreshBurst += 1;
+        } else {
+            vehicle->refresh = now + FLEET_REFRESH_SPREAD;
+        }
+    }
+    housedcc_fleet_schedule (cursor);
+}
+
+int housedcc_fleet_background (time_t now) {
+
+    if (FleetReplayPending > 0) housedcc_fleet_replaying ();
+
+    int changed = FleetLiveChanged;
+    FleetLiveChanged = 0;
     return changed;
 }
 
+// Save the state of the vehicles functions to the depositor state. Only
+// the vehicles with some function active are listed.
+//
+static int housedcc_fleet_state (char *buffer, int size) {
+
+    static DccJson state;
+
+    housedcc_json_start (&state);
+    housedcc_json_raw (&state, ",\"vehicles\":[");
+
+    int i;
+    const char *prefix = "";
+    for (i = 0; i < VehiclesCount; ++i) {
+        const DccVehicle *vehicle = Vehicles + i;
+        if ((!vehicle->id[0]) || (!vehicle->functions)) continue;
+        housedcc_json_raw (&state, prefix);
+        housedcc_json_raw (&state, "{\"id\":");
+        housedcc_json_string (&state, vehicle->id);
+        housedcc_json_raw (&state, ",\"functions\":");
+        housedcc_json_integer (&state, vehicle->functions);
+        housedcc_json_raw (&state, "}");
+        prefix = ",";
+    }
+    housedcc_json_raw (&state, "]");
+
+    int length = housedcc_json_length (&state);
+    if (housedcc_json_failed (&state) || (length >= size)) {
+        houselog_trace (HOUSE_FAILURE, "STATE", "vehicles do not fit");
+        return 0;
+    }
+    memcpy (buffer, housedcc_json_text (&state), length + 1);
+    return length;
+}
+
+// Restore the state of the vehicles functions when the depositor state
+// has been loaded. The decoders may have lost their function state when
+// the track power was off, so the function groups that changed are sent
+// again.
+//
+static void housedcc_fleet_restore (void) {
+
+    int i;
+    for (i = 0; ; ++i) {
+        char path[128];
+        snprintf (path, sizeof(path), ".vehicles[%d].id", i);
+        const char *id = housedepositor_state_get_string (path);
+        if (!id) break;
+
+        int cursor = housedcc_fleet_find (id);
+        if (cursor < 0) continue; // This vehicle was deleted since.
+
+        snprintf (path, sizeof(path), ".vehicles[%d].functions", i);
+        unsigned int functions =
+            (unsigned int)housedepositor_state_get_integer (path);
+        DccVehicle *vehicle = Vehicles + cursor;
+        unsigned int changed = functions ^ vehicle->functions;
+        if (!changed) continue;
+
+        vehicle->functions = functions;
+        housedcc_fleet_pack (vehicle);
+        housedcc_fleet_changed (vehicle);
+
+        // Send each modified group only once.
+        housedcc_fleet_send_functions (vehicle, changed);
+    }
+}
+
 const char *housedcc_fleet_initialize (int argc, const char **argv) {
-    // TBD
+    FleetMetricExpired =
+        housedcc_metrics_counter ("housedcc_lease_expired_total",
+                                  "target=\"vehicle\"",
+                                  "Moving vehicles or consists stopped on lease expiry.");
+    housedepositor_state_register (housedcc_fleet_state);
+    housedepositor_state_listen (housedcc_fleet_restore);
     return 0;
 }
 
-static const char *housedcc_fleet_reload_models (void) {
+static void housedcc_fleet_reload_devices (DccModel *model, int item) {
+
+    int devices = houseconfig_array (item, ".devices");
+    if (devices <= 0) return;
+    int devcount = houseconfig_array_length (devices);
+    if (devcount <= 0) return;
+    if (devcount > FUNCTION_MAX) devcount = FUNCTION_MAX;
+
+    int j;
+    int devlist[FUNCTION_MAX];
+    devcount = houseconfig_enumerate (devices, devlist, FUNCTION_MAX);
+    for (j = 0; j < devcount; ++j) {
+       int dev = devlist[j];
+       if (dev <= 0) continue;
+       const char *devname = houseconfig_string (dev, ".name");
+       int index = houseconfig_integer (dev, ".index");
+       if ((!devname) || (index < 0) || (index > FUNCTION_INDEX_MAX)) continue;
+
+       DccFunction *thisdev = model->functions + (model->count)++;
+       strtcpy (thisdev->name, devname, sizeof(thisdev->name));
+       thisdev->index = index;
+    }
+}
+
+static void housedcc_fleet_reload_speeds (DccModel *model, int item) {
+
+    int j = 0;
+    int speeds = houseconfig_array (item, ".speeds");
+    if (speeds > 0) {
+        int speedcount = houseconfig_array_length (speeds);
+        if (speedcount > SPEED_STEP_MAX) speedcount = SPEED_STEP_MAX;
+
+        if (speedcount > 0) {
+            int speedlist[SPEED_STEP_MAX];
+            speedcount =
+                houseconfig_enumerate (speeds, speedlist, SPEED_STEP_MAX);
+            for (j = 0; j < speedcount; ++j) {
+               int item = speedlist[j];
+               model->speeds[j] =
+                   (item > 0) ? houseconfig_integer (item, 0) : 0;
+            }
+        }
+    } else {
+        // Set an arbitrary set of speed steps for compatibility
+       for (j = 0; j < 12; ++j) model->speeds[j] = (j+1) * 10;
+    }
+    for (; j < SPEED_STEP_MAX; ++j) model->speeds[j] = 0;
+}
+
+// Return 1 if the model's configuration is the same as the one loaded,
+// i.e. there is no need to compile it again.
+//
+static int housedcc_fleet_same_model (const DccModel *model,
+                                      const DccModel *loaded) {
+
+    if (strcmp (model->scale, loaded->scale)) return 0;
+    if (model->steps != loaded->steps) return 0;
+    if (model->accel != loaded->accel) return 0;
+    if (model->decel != loaded->decel) return 0;
+    if (model->count != loaded->count) return 0;
+
+    int i;
+    for (i = 0; i < model->count; ++i) {
+        if (model->functions[i].index != loaded->functions[i].index) return 0;
+        if (strcmp (model->functions[i].name, loaded->functions[i].name))
+            return 0;
+    }
+    return !memcmp (model->speeds, loaded->speeds, sizeof(model->speeds));
+}
+
+// Rebuild the speed packet of a vehicle after its model changed: the
+// current instruction may not match the speed table or the speed steps
+// mode anymore. A moving vehicle gets its speed applied again.
+//
+static void housedcc_fleet_recode (DccVehicle *vehicle) {
+    vehicle->instruction = 0;
+    vehicle->speedpacket.length = 0;
+    if (vehicle->deadline <= 0) return; // Built when a speed is applied.
+    const DccModel *model = housedcc_fleet_model (vehicle);
+    if (model) housedcc_fleet_apply (vehicle, model, vehicle->speed, 0);
+}
+
+static int housedcc_fleet_reload_models (void) {
+
+    static DccModel loaded; // Only the configuration items are used.
 
     int models = houseconfig_array (0, ".trains.models");
     int count = 0;
 
     if (models >= 0) count = houseconfig_array_length (models);
 
-    if (Models) free (Models);
-    ModelsCount = 0;
-    ModelsAllocated = count + 16;
-    Models = calloc (ModelsAllocated, sizeof(DccModel));
-
-    if (count <= 0) return 0; // Nothing to load.
-
+    // The models are updated in place: only the models that were added
+    // or modified are compiled, and the models that are no longer listed
+    // are removed at the end. There cannot be more new slots than models.
     int i;
-    int *list = calloc (count, sizeof(int));
-    count = houseconfig_enumerate (models, list, count);
+    int changed = 0;
+    char *listed = calloc (ModelsCount + count + 1, 1);
+    int *list = calloc (count + 1, sizeof(int));
+    if (count > 0) count = houseconfig_enumerate (models, list, count);
     for (i = 0; i < count; ++i) {
         int item = list[i];
         if (item <= 0) continue;
@@ -584,111 +1670,199 @@ static const char *housedcc_fleet_reload_models (void) {
         const char *scale = houseconfig_string (item, ".scale");
         if (!scale) scale = MODEL_SCALE_DEFAULT;
 
-        DccModel *thismodel = Models + ModelsCount++;
-        strtcpy (thismodel->name, name, sizeof(Models[0].name));
-        strtcpy (thismodel->scale, scale, sizeof(Models[0].scale));
-        thismodel->count = 0;
-
-        int devices = houseconfig_array (item, ".devices");
-        if (devices <= 0) continue;
-        int devcount = houseconfig_array_length (devices);
-        if (devcount <= 0) continue;
-        if (devcount > FUNCTION_MAX) devcount = FUNCTION_MAX;
-
+        memset (&loaded, 0, sizeof(loaded));
+        strtcpy (loaded.scale, scale, sizeof(loaded.scale));
+        loaded.steps =
+            housedcc_fleet_steps_mode (houseconfig_integer (item, ".steps"));
+        loaded.accel = (short)houseconfig_integer (item, ".accel");
+        loaded.decel = (short)houseconfig_integer (item, ".decel");
+        housedcc_fleet_reload_devices (&loaded, item);
+        housedcc_fleet_legacy (&loaded, name);
+        housedcc_fleet_reload_speeds (&loaded, item);
         int j;
-        int devlist[FUNCTION_MAX];
-        devcount = houseconfig_enumerate (devices, devlist, FUNCTION_MAX);
-        for (j = 0; j < devcount; ++j) {
-           int dev = devlist[j];
-           if (dev <= 0) continue;
-           const char *devname = houseconfig_string (dev, ".name");
-           int index = houseconfig_integer (dev, ".index");
-           if (index == 13) index = 0; // Compatibility with FL == 13.
-           if ((!devname) || (index < 0) || (index > 12)) continue;
-
-           DccFunction *thisdev =
-               thismodel->functions + (thismodel->count)++;
-           strtcpy (thisdev->name, devname, sizeof(thisdev->name));
-           thisdev->index = index;
-        }
+        for (j = housedcc_fleet_steps_limit (loaded.steps);
+             j < SPEED_STEP_MAX; ++j) loaded.speeds[j] = 0; // As compiled.
 
-        int speeds = houseconfig_array (item, ".speeds");
-        if (speeds > 0) {
-            int speedcount = houseconfig_array_length (speeds);
-            if (speedcount <= 0) continue;
-            if (speedcount > SPEED_STEP_MAX) speedcount = SPEED_STEP_MAX;
-
-            int speedlist[SPEED_STEP_MAX];
-            speedcount = houseconfig_enumerate (speeds, speedlist, SPEED_STEP_MAX);
-            for (j = 0; j < speedcount; ++j) {
-               int item = speedlist[j];
-               if (item <= 0) continue;
-               thismodel->speeds[j] = houseconfig_integer (item, 0);
-            }
-        } else {
-            // Set an arbitrary set of speed steps for compatibility
-           for (j = 0; j < 12; ++j) thismodel->speeds[j] = (j+1) * 10;
+        int cursor = housedcc_fleet_find_model (name);
+        if (cursor < 0) {
+            cursor = housedcc_fleet_new_model ();
+            strtcpy (Models[cursor].name, name, sizeof(Models[0].name));
+            housedcc_fleet_index_model (cursor);
+        } else if (listed[cursor] ||
+                   housedcc_fleet_same_model (Models + cursor, &loaded)) {
+            listed[cursor] = 1;
+            continue; // No change (or a duplicate name).
+        }
+        listed[cursor] = 1;
+        changed = 1;
+
+        DccModel *thismodel = Models + cursor;
+        strtcpy (thismodel->scale, loaded.scale, sizeof(thismodel->scale));
+        thismodel->steps = loaded.steps;
+        thismodel->accel = loaded.accel;
+        thismodel->decel = loaded.decel;
+        thismodel->count = loaded.count;
+        memcpy (thismodel->functions, loaded.functions,
+                sizeof(thismodel->functions));
+        memcpy (thismodel->speeds, loaded.speeds, sizeof(thismodel->speeds));
+        housedcc_fleet_compile (thismodel);
+        housedcc_fleet_cache (thismodel);
+
+        int v;
+        for (v = 0; v < VehiclesCount; ++v) {
+            if (Vehicles[v].id[0] && (Vehicles[v].model == cursor))
+                housedcc_fleet_recode (Vehicles + v);
         }
-        for (; j < SPEED_STEP_MAX; ++j) thismodel->speeds[j] = 0;
     }
     free (list);
-    return 0;
+
+    for (i = 0; i < ModelsCount; ++i) {
+        if ((!Models[i].name[0]) || listed[i]) continue;
+        housedcc_fleet_remove_model (i);
+        changed = 1;
+    }
+    free (listed);
+    return changed;
 }
 
-static const char *housedcc_fleet_reload_vehicles (void) {
+static int housedcc_fleet_reload_vehicles (void) {
 
     int vehicles = houseconfig_array (0, ".trains.vehicles");
     int count = 0;
 
     if (vehicles >= 0) count = houseconfig_array_length (vehicles);
 
-    if (Vehicles) free (Vehicles);
-    VehiclesCount = 0;
-    VehiclesAllocated = count + 16;
-    Vehicles = calloc (VehiclesAllocated, sizeof(DccVehicle));
+    int i;
+    int changed = 0;
+    int *list = calloc (count + 1, sizeof(int));
+    if (count > 0) count = houseconfig_enumerate (vehicles, list, count);
+
+    // The vehicles that are still listed keep their slot, and thus their
+    // live state (speed, functions, lease, speed ramp) and their timer.
+    // The vehicles no longer listed are removed first, so that their
+    // addresses are available for the vehicles that remain.
+    char *listed = calloc (VehiclesCount + 1, 1);
+    for (i = 0; i < count; ++i) {
+        if (list[i] <= 0) continue;
+        int cursor = housedcc_fleet_find (houseconfig_string (list[i], ".id"));
+        if (cursor >= 0) listed[cursor] = 1;
+    }
+    for (i = 0; i < VehiclesCount; ++i) {
+        if ((!Vehicles[i].id[0]) || listed[i]) continue;
+        housedcc_consist_remove (Vehicles[i].id);
+        housedcc_fleet_abandon (Vehicles + i);
+        housedcc_fleet_remove (i);
+        changed = 1;
+    }
+    free (listed);
 
-    if (count <= 0) return 0; // Nothing to load.
+    if (VehiclesAllocated < count) {
+        VehiclesAllocated = count + 16;
+        Vehicles = realloc (Vehicles, VehiclesAllocated * sizeof(DccVehicle));
+    }
 
-    int i;
-    int *list = calloc (count, sizeof(int));
-    count = houseconfig_enumerate (vehicles, list, count);
     for (i = 0; i < count; ++i) {
         int item = list[i];
         if (item <= 0) continue;
 
         const char *id = houseconfig_string (item, ".id");
-        const char *model = houseconfig_string (item, ".model");
         if (!id) continue;
+        int model = housedcc_fleet_find_model
+                        (houseconfig_string (item, ".model"));
+        int address = houseconfig_integer (item, ".address");
+
+        const char *district = houseconfig_string (item, ".district");
+        int index = housedcc_pidcc_district (district);
+        if ((index < 0) || (index > DCC_DISTRICTS_MAX)) {
+            houselog_event ("VEHICLE", id, "ERROR",
+                            "UNKNOWN DISTRICT %s", district);
+            index = 0;
+        }
 
-        DccVehicle *thisvehicle = Vehicles + VehiclesCount++;
-        strtcpy (thisvehicle->id, id, sizeof(thisvehicle->id));
-        thisvehicle->model = 0;
-        if (model) {
-            int m = housedcc_fleet_find_model (model);
-            if (m >= 0) thisvehicle->model = Models + m;
+        DccVehicle *thisvehicle;
+        int cursor = housedcc_fleet_find (id);
+        if (cursor < 0) {
+            cursor = housedcc_fleet_new_vehicle ();
+            thisvehicle = Vehicles + cursor;
+            strtcpy (thisvehicle->id, id, sizeof(thisvehicle->id));
+            thisvehicle->address = (short)address;
+            thisvehicle->district = (char)index;
+            thisvehicle->functions = 0;
+            thisvehicle->changed = housedcc_live_changed ();
+            housedcc_fleet_index_vehicle (cursor);
+            housedcc_fleet_pack (thisvehicle);
+            changed = 1;
+        } else {
+            thisvehicle = Vehicles + cursor;
+            if (thisvehicle->address != address) {
+                // This is not the same decoder: its state is unknown.
+                housedcc_fleet_abandon (thisvehicle);
+                housedcc_fleet_unindex_vehicle (cursor);
+                housedcc_fleet_stationary (thisvehicle);
+                thisvehicle->address = (short)address;
+                thisvehicle->functions = 0;
+                housedcc_fleet_index_vehicle (cursor);
+                housedcc_fleet_pack (thisvehicle);
+                changed = 1;
+            }
+            if (thisvehicle->district != index) {
+                if (thisvehicle->deadline > 0) {
+                    FleetMoving[(int)thisvehicle->district] -= 1;
+                    FleetMoving[index] += 1;
+                }
+                thisvehicle->district = (char)index;
+            }
+            if (thisvehicle->model != model) {
+                thisvehicle->model = (short)model;
+                thisvehicle->changed = housedcc_live_changed ();
+                housedcc_fleet_recode (thisvehicle);
+                changed = 1;
+            }
         }
-        thisvehicle->address = houseconfig_integer(item, ".address");
-        thisvehicle->functions = 0; // TBD: save the state?
+        thisvehicle->model = (short)model;
     }
     free (list);
-    return 0;
+
+    // The routes were cleared when PiDCC reloaded its own configuration.
+    for (i = 0; i < VehiclesCount; ++i) {
+        if (!Vehicles[i].id[0]) continue;
+        housedcc_pidcc_assign (Vehicles[i].address, Vehicles[i].district);
+    }
+    return changed;
 }
 
 const char *housedcc_fleet_reload (void) {
 
     if (! houseconfig_active()) return 0;
 
-    const char *error = housedcc_fleet_reload_models();
-    if (error) return error;
-    return housedcc_fleet_reload_vehicles();
+    int lease = houseconfig_integer (0, ".trains.lease");
+    if (lease <= 0) lease = FLEET_LEASE_DEFAULT;
+    housedcc_fleet_refresh (houseconfig_integer (0, ".trains.refresh"), lease);
+
+    FleetLegacy =
+        (houseconfig_integer (0, ".trains.version") < FLEET_CONFIG_VERSION);
+
+    // A partial status cannot be used if any model or vehicle was added,
+    // removed or modified.
+    int changed = housedcc_fleet_reload_models ();
+    FleetLegacy = 0;
+    if (housedcc_fleet_reload_vehicles ()) changed = 1;
+    if (changed) FleetListChanged = housedcc_live_changed ();
+    return 0;
 }
 
-int housedcc_fleet_export (char *buffer, int size, const char *prefix) {
+void housedcc_fleet_export (DccJson *json, const char *prefix) {
 
     int i;
-    int cursor = 0;
 
-    cursor = snprintf (buffer, size, "%s\"models\":[", prefix);
+    housedcc_json_raw (json, prefix);
+    housedcc_json_raw (json, "\"version\":");
+    housedcc_json_integer (json, FLEET_CONFIG_VERSION);
+    housedcc_json_raw (json, ",\"refresh\":");
+    housedcc_json_integer (json, FleetRefresh);
+    housedcc_json_raw (json, ",\"lease\":");
+    housedcc_json_integer (json, FleetLease);
+    housedcc_json_raw (json, ",\"models\":[");
 
     prefix = "";
     for (i = 0; i < ModelsCount; ++i) {
@@ -696,64 +1870,306 @@ int housedcc_fleet_export (char *buffer, int size, const char *prefix) {
         DccModel *model = Models + i;
 
         if (!model->name[0]) continue; // Ignore obsolete entries.
+        if (!model->exported) continue; // Should never happen.
 
-        cursor += snprintf (buffer+cursor, size-cursor,
-                            "%s{\"name\":\"%s\",\"scale\":\"%s\"",
-                            prefix, model->name, model->scale);
-
-        if (model->count > 0) {
-           const char *prefix2 = ",\"devices\":[";
-           int j;
-           for (j = 0; j < model->count; ++j) {
-               cursor += snprintf (buffer+cursor, size-cursor,
-                                   "%s{\"name\":\"%s\",\"index\":%d}",
-                                   prefix2,
-                                   model->functions[j].name,
-                                   model->functions[j].index);
-               if (cursor >= size) goto overflow;
-               prefix2 = ",";
-           }
-           cursor += snprintf (buffer+cursor, size-cursor, "]");
-           if (cursor >= size) goto overflow;
-        }
-
-        cursor += housedcc_fleet_speeds (buffer+cursor, size-cursor, model);
-
-        cursor += snprintf (buffer+cursor, size-cursor, "}");
-        if (cursor >= size) goto overflow;
+        housedcc_json_raw (json, prefix);
+        housedcc_json_append (json, model->exported, model->exportedlength);
         prefix = ",";
     }
-    cursor += snprintf (buffer+cursor, size-cursor, "]");
-    if (cursor >= size) goto overflow;
+    housedcc_json_raw (json, "],\"vehicles\":[");
 
-    cursor += snprintf (buffer+cursor, size-cursor, "%s", ",\"vehicles\":[");
     prefix = "";
-
     for (i = 0; i < VehiclesCount; ++i) {
 
         if (!Vehicles[i].id[0]) continue; // Ignore obsolete entries.
 
-        DccModel *model = Vehicles[i].model;
-        char modelitem[64];
-        if (model)
-           snprintf (modelitem, sizeof(modelitem),
-                     ",\"model\":\"%s\"", model->name);
-        else
-           modelitem[0] = 0;
-
-        cursor += snprintf (buffer+cursor, size-cursor,
-                            "%s{\"id\":\"%s\",\"address\":%d%s}",
-                            prefix,
-                            Vehicles[i].id,
-                            Vehicles[i].address,
-                            modelitem);
-        if (cursor >= size) goto overflow;
+        housedcc_json_raw (json, prefix);
+        housedcc_json_raw (json, "{\"id\":");
+        housedcc_json_string (json, Vehicles[i].id);
+        housedcc_json_raw (json, ",\"address\":");
+        housedcc_json_integer (json, Vehicles[i].address);
+
+        DccModel *model = housedcc_fleet_model (Vehicles + i);
+        if (model) {
+           housedcc_json_raw (json, ",\"model\":");
+           housedcc_json_string (json, model->name);
+        }
+        const char *district =
+            housedcc_pidcc_district_name (Vehicles[i].district);
+        if (district) {
+           housedcc_json_raw (json, ",\"district\":");
+           housedcc_json_string (json, district);
+        }
+        housedcc_json_raw (json, "}");
         prefix = ",";
     }
-    cursor += snprintf (buffer+cursor, size-cursor, "]");
-    return cursor;
+    housedcc_json_raw (json, "]");
+}
+
+static const char *housedcc_fleet_import_model (const ParserToken *model,
+                                                int apply) {
+
+    if (model->type != PARSER_OBJECT) return "invalid model";
+
+    int i = echttp_json_search (model, ".name");
+    if ((i <= 0) || (model[i].type != PARSER_STRING))
+        return "missing model name";
+    const char *name = model[i].value.string;
+
+    const char *scale = 0;
+    i = echttp_json_search (model, ".scale");
+    if ((i > 0) && (model[i].type == PARSER_STRING))
+        scale = model[i].value.string;
+
+    int steps = 28;
+    i = echttp_json_search (model, ".steps");
+    if ((i > 0) && (model[i].type == PARSER_INTEGER))
+        steps = (int)(model[i].value.integer);
+
+    int fcount = 0;
+    char names[FUNCTION_MAX][24];
+    const char *functions[FUNCTION_MAX];
+
+    i = echttp_json_search (model, ".devices");
+    if (i > 0) {
+        const ParserToken *devices = model + i;
+        if (devices->type != PARSER_ARRAY) return "invalid devices";
+        if (devices->length > FUNCTION_MAX) return "too many devices";
+
+        int list[FUNCTION_MAX];
+        if (echttp_json_enumerate (devices, list, devices->length))
+            return "invalid devices";
+        for (fcount = 0; fcount < devices->length; ++fcount) {
+            const ParserToken *device = devices + list[fcount];
+            int n = echttp_json_search (device, ".name");
+            int x = echttp_json_search (device, ".index");
+            if ((n <= 0) || (device[n].type != PARSER_STRING) ||
+                (x <= 0) || (device[x].type != PARSER_INTEGER))
+                return "invalid device";
+            snprintf (names[fcount], sizeof(names[0]), "%s:%d",
+                      device[n].value.string, (int)(device[x].value.integer));
+            functions[fcount] = names[fcount];
+        }
+    }
 
-overflow:
+    int scount = 0;
+    short speeds[SPEED_STEP_MAX];
+
+    i = echttp_json_search (model, ".speeds");
+    if (i > 0) {
+        const ParserToken *speedlist = model + i;
+        if (speedlist->type != PARSER_ARRAY) return "invalid speeds";
+        if (speedlist->length > SPEED_STEP_MAX) return "too many speeds";
+
+        int list[SPEED_STEP_MAX];
+        if (echttp_json_enumerate (speedlist, list, speedlist->length))
+            return "invalid speeds";
+        for (scount = 0; scount < speedlist->length; ++scount) {
+            const ParserToken *speed = speedlist + list[scount];
+            if (speed->type != PARSER_INTEGER) return "invalid speed";
+            speeds[scount] = (short)(speed->value.integer);
+        }
+    }
+
+    int accel = 0;
+    i = echttp_json_search (model, ".accel");
+    if ((i > 0) && (model[i].type == PARSER_INTEGER))
+        accel = (int)(model[i].value.integer);
+
+    int decel = 0;
+    i = echttp_json_search (model, ".decel");
+    if ((i > 0) && (model[i].type == PARSER_INTEGER))
+        decel = (int)(model[i].value.integer);
+
+    if (apply) {
+        housedcc_fleet_declare (name, scale, steps,
+                                fcount, functions, scount, speeds);
+        housedcc_fleet_momentum (name, accel, decel);
+    }
     return 0;
 }
 
+// The JSON data being imported, so that each vehicle can be checked
+// against the whole import before anything is changed.
+//
+static const ParserToken *FleetImportTokens = 0;
+
+// Return the items of one imported list, or 0 if there is none. The
+// list of item indexes must be freed by the caller.
+//
+static const ParserToken *housedcc_fleet_import_items (const char *path,
+                                                       int **list) {
+    *list = 0;
+    int i = echttp_json_search (FleetImportTokens, path);
+    if (i <= 0) return 0;
+
+    const ParserToken *array = FleetImportTokens + i;
+    if ((array->type != PARSER_ARRAY) || (array->length <= 0)) return 0;
+
+    *list = calloc (array->length, sizeof(int));
+    if (echttp_json_enumerate (array, *list, array->length)) {
+        free (*list);
+        *list = 0;
+        return 0;
+    }
+    return array;
+}
+
+static int housedcc_fleet_import_has_model (const char *name) {
+
+    int *list;
+    const ParserToken *array =
+        housedcc_fleet_import_items (".trains.models", &list);
+    if (!array) return 0;
+
+    int i;
+    int found = 0;
+    for (i = 0; (i < array->length) && (!found); ++i) {
+        const ParserToken *model = array + list[i];
+        int n = echttp_json_search (model, ".name");
+        if ((n > 0) && (model[n].type == PARSER_STRING) &&
+            (!strcmp (model[n].value.string, name))) found = 1;
+    }
+    free (list);
+    return found;
+}
+
+// Return 1 if another imported vehicle uses the same address.
+//
+static int housedcc_fleet_import_has_address (const char *id, int address) {
+
+    int *list;
+    const ParserToken *array =
+        housedcc_fleet_import_items (".trains.vehicles", &list);
+    if (!array) return 0;
+
+    int i;
+    int found = 0;
+    for (i = 0; (i < array->length) && (!found); ++i) {
+        const ParserToken *vehicle = array + list[i];
+        int n = echttp_json_search (vehicle, ".id");
+        int a = echttp_json_search (vehicle, ".address");
+        if ((n <= 0) || (vehicle[n].type != PARSER_STRING)) continue;
+        if ((a <= 0) || (vehicle[a].type != PARSER_INTEGER)) continue;
+        if ((vehicle[a].value.integer == address) &&
+            strcmp (vehicle[n].value.string, id)) found = 1;
+    }
+    free (list);
+    return found;
+}
+
+static const char *housedcc_fleet_import_vehicle (const ParserToken *vehicle,
+                                                  int apply) {
+
+    if (vehicle->type != PARSER_OBJECT) return "invalid vehicle";
+
+    int i = echttp_json_search (vehicle, ".id");
+    if ((i <= 0) || (vehicle[i].type != PARSER_STRING))
+        return "missing vehicle ID";
+    const char *id = vehicle[i].value.string;
+
+    i = echttp_json_search (vehicle, ".address");
+    if ((i <= 0) || (vehicle[i].type != PARSER_INTEGER))
+        return "missing vehicle address";
+    int address = (int)(vehicle[i].value.integer);
+    if (! housedcc_fleet_valid_address (address))
+        return "invalid vehicle address";
+
+    const char *model = 0;
+    i = echttp_json_search (vehicle, ".model");
+    if ((i > 0) && (vehicle[i].type == PARSER_STRING))
+        model = vehicle[i].value.string;
+
+    const char *district = 0;
+    i = echttp_json_search (vehicle, ".district");
+    if ((i > 0) && (vehicle[i].type == PARSER_STRING))
+        district = vehicle[i].value.string;
+    if (housedcc_pidcc_district (district) < 0) return "unknown district";
+
+    if (!apply) {
+        // Detect the conflicts that housedcc_fleet_add() would reject,
+        // taking into account the models and vehicles being imported.
+        if (model && (housedcc_fleet_find_model (model) < 0) &&
+            (! housedcc_fleet_import_has_model (model)))
+            return "unknown model";
+        int synonym = housedcc_fleet_find_address (address);
+        if ((synonym >= 0) && Vehicles[synonym].id[0] &&
+            strcmp (Vehicles[synonym].id, id))
+            return "duplicate address";
+        if (housedcc_fleet_import_has_address (id, address))
+            return "duplicate address";
+        return 0;
+    }
+    const char *error = housedcc_fleet_add (id, model, address);
+    if (error) return error;
+    return housedcc_fleet_district (id, district);
+}
+
+typedef const char *DccImporter (const ParserToken *item, int apply);
+
+static const char *housedcc_fleet_import_list (const ParserToken *tokens,
+                                               const char *path,
+                                               DccImporter *importer,
+                                               int apply) {
+
+    int i = echttp_json_search (tokens, path);
+    if (i <= 0) return 0; // Nothing to import.
+
+    const ParserToken *array = tokens + i;
+    if (array->type != PARSER_ARRAY) return "invalid list";
+    if (array->length <= 0) return 0;
+
+    int *list = calloc (array->length, sizeof(int));
+    const char *error = echttp_json_enumerate (array, list, array->length);
+    if (error) goto done;
+
+    for (i = 0; i < array->length; ++i) {
+        const char *itemerror = importer (array + list[i], apply);
+        if (itemerror && (!error)) error = itemerror;
+        if (error && (!apply)) break;
+    }
+
+done:
+    free (list);
+    return error;
+}
+
+const char *housedcc_fleet_import (const char *data, int length) {
+
+    char *text = malloc (length + 1);
+    memcpy (text, data, length);
+    text[length] = 0;
+
+    int count = echttp_json_estimate (text);
+    ParserToken *tokens = calloc (count, sizeof(ParserToken));
+
+    const char *error = echttp_json_parse (text, tokens, &count);
+    if (error) goto done;
+
+    // The whole import is validated before any change is applied, including
+    // the conflicts with the existing fleet (unknown model, duplicate
+    // address): the import is one transaction, applied entirely or not
+    // at all.
+    FleetImportTokens = tokens;
+    error = housedcc_fleet_import_list (tokens, ".trains.models",
+                                        housedcc_fleet_import_model, 0);
+    if (error) goto done;
+    error = housedcc_fleet_import_list (tokens, ".trains.vehicles",
+                                        housedcc_fleet_import_vehicle, 0);
+    if (error) goto done;
+
+    int version = echttp_json_search (tokens, ".trains.version");
+    FleetLegacy = (version <= 0) || (tokens[version].type != PARSER_INTEGER) ||
+                  (tokens[version].value.integer < FLEET_CONFIG_VERSION);
+    housedcc_fleet_import_list (tokens, ".trains.models",
+                                housedcc_fleet_import_model, 1);
+    FleetLegacy = 0;
+    error = housedcc_fleet_import_list (tokens, ".trains.vehicles",
+                                        housedcc_fleet_import_vehicle, 1);
+
+done:
+    FleetImportTokens = 0;
+    free (tokens);
+    free (text);
+    return error;
+}
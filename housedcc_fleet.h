@@ -24,19 +24,29 @@
 
 const char *housedcc_fleet_initialize (int argc, const char **argv);
 
-void housedcc_fleet_declare (const char *model, const char *scale,
+void housedcc_fleet_declare (const char *model, const char *scale, int steps,
                              int fcount, const char *functions[],
                              int scount, short speeds[]);
 const char *housedcc_fleet_add (const char *id, const char *model, int address);
+const char *housedcc_fleet_district (const char *id, const char *district);
 void housedcc_fleet_delete (const char *id);
 int  housedcc_fleet_exists (const char *id);
 int  housedcc_fleet_move (const char *id, int speed);
 int  housedcc_fleet_stop (const char *id, int emergency);
 void housedcc_fleet_stopped (int emergency);
+void housedcc_fleet_momentum (const char *model, int accel, int decel);
+int  housedcc_fleet_renew (const char *id);
+void housedcc_fleet_refresh (int period, int lease);
+void housedcc_fleet_timing (int *refresh, int *lease);
+int  housedcc_fleet_address (const char *id);
+int  housedcc_fleet_encode (const char *id, int speed, int *actual);
 int  housedcc_fleet_set (const char *id, const char *name, int state);
+void housedcc_fleet_replay (void);
 int  housedcc_fleet_background (time_t now);
 
-int  housedcc_fleet_status (char *buffer, int size);
+int  housedcc_fleet_delta (long long since);
+void housedcc_fleet_status (DccJson *json, long long since);
 
 const char *housedcc_fleet_reload (void);
-int housedcc_fleet_export (char *buffer, int size, const char *prefix);
+void housedcc_fleet_export (DccJson *json, const char *prefix);
+const char *housedcc_fleet_import (const char *data, int length);
@@ -0,0 +1,56 @@
+/* HouseDCC - A model train control service
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedcc_hash.c - The hash function used for the ID lookup tables.
+ *
+ * SYNOPSYS:
+ *
+ * The vehicles, models and accessories are found by ID using hash tables,
+ * and the event log coalesces events using a digest of their text. These
+ * all use the same hash function: FNV-1a, simple and good enough for short
+ * IDs and texts.
+ *
+ * unsigned int housedcc_hash_string (const char *text);
+ *
+ *    Return the hash of a text. A hash table whose size is a power of 2
+ *    uses the lowest bits of this value.
+ *
+ * unsigned int housedcc_hash_append (unsigned int hash, const char *text);
+ *
+ *    Add more text to a hash value: the hash of several texts is
+ *    housedcc_hash_append (housedcc_hash_string (first), second).
+ */
+
+#include "housedcc_hash.h"
+
+#define HASH_FNV_OFFSET 2166136261u
+#define HASH_FNV_PRIME  16777619u
+
+unsigned int housedcc_hash_append (unsigned int hash, const char *text) {
+    while (*text) {
+        hash ^= (unsigned char)(*text++);
+        hash *= HASH_FNV_PRIME;
+    }
+    return hash;
+}
+
+unsigned int housedcc_hash_string (const char *text) {
+    return housedcc_hash_append (HASH_FNV_OFFSET, text);
+}
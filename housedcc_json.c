@@ -0,0 +1,178 @@
+/* HouseDCC - A model train control service
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedcc_json.c - A growable buffer to build JSON text.
+ *
+ * SYNOPSYS:
+ *
+ * This module replaces the fixed size buffers and snprintf() chains
+ * previously used to generate the status and configuration. The buffer
+ * grows as needed and is kept from one use to the next, so that its size
+ * quickly settles to the largest text generated (the high-water mark).
+ *
+ * If memory allocation fails, the builder enters a failed state where
+ * all append operations are ignored. The caller checks for this state
+ * once, after the whole text was generated.
+ *
+ * void housedcc_json_start (DccJson *json);
+ *
+ *    Start a new text, reusing the existing buffer. The buffer is grown
+ *    to the high-water mark, if needed, so that it rarely needs to grow
+ *    again while the text is built.
+ *
+ * void housedcc_json_reserve (DccJson *json, int needed);
+ *
+ *    Make sure that there is room for at least that many more characters.
+ *
+ * void housedcc_json_append  (DccJson *json, const char *text, int length);
+ * void housedcc_json_raw     (DccJson *json, const char *text);
+ *
+ *    Append text as is. The text must be valid JSON syntax.
+ *
+ * void housedcc_json_string  (DccJson *json, const char *text);
+ *
+ *    Append a JSON string value: add quotes and escape special characters.
+ *
+ * void housedcc_json_integer (DccJson *json, long long value);
+ *
+ *    Append a JSON integer value.
+ *
+ * const char *housedcc_json_text (DccJson *json);
+ * int housedcc_json_length (const DccJson *json);
+ *
+ *    Return the text built (always null terminated) and its length.
+ *
+ * int housedcc_json_failed (const DccJson *json);
+ *
+ *    Return 1 if some text could not be added, 0 otherwise.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "housedcc_json.h"
+
+#define JSON_MINIMUM_SIZE 4096
+
+static const char JsonEmpty[] = "";
+
+void housedcc_json_reserve (DccJson *json, int needed) {
+
+    if (json->failed) return;
+
+    int required = json->length + needed + 1; // Include the end of string.
+    if (required <= json->size) return;
+
+    int size = json->size ? json->size * 2 : JSON_MINIMUM_SIZE;
+    while (size < required) size *= 2;
+
+    char *data = realloc (json->data, size);
+    if (!data) {
+        json->failed = 1;
+        return;
+    }
+    json->data = data;
+    json->size = size;
+}
+
+void housedcc_json_start (DccJson *json) {
+    json->length = 0;
+    json->failed = 0;
+    housedcc_json_reserve (json, json->highwater);
+    if (json->data) json->data[0] = 0;
+}
+
+void housedcc_json_append (DccJson *json, const char *text, int length) {
+
+    housedcc_json_reserve (json, length);
+    if (json->failed) return;
+
+    memcpy (json->data + json->length, text, length);
+    json->length += length;
+}
+
+void housedcc_json_raw (DccJson *json, const char *text) {
+    housedcc_json_append (json, text, strlen(text));
+}
+
+void housedcc_json_string (DccJson *json, const char *text) {
+
+    static const char hex[] = "0123456789abcdef";
+
+    // Worst case: every character needs a 6 characters escape sequence.
+    int length = strlen(text);
+    housedcc_json_reserve (json, (6 * length) + 2);
+    if (json->failed) return;
+
+    char *cursor = json->data + json->length;
+    *(cursor++) = '"';
+    for (; *text; ++text) {
+        unsigned char c = (unsigned char)(*text);
+        if ((c == '"') || (c == '\\')) {
+            *(cursor++) = '\\';
+            *(cursor++) = c;
+        } else if (c < 0x20) {
+            *(cursor++) = '\\';
+            *(cursor++) = 'u';
+            *(cursor++) = '0';
+            *(cursor++) = '0';
+            *(cursor++) = hex[c >> 4];
+            *(cursor++) = hex[c & 0xf];
+        } else {
+            *(cursor++) = c;
+        }
+    }
+    *(cursor++) = '"';
+    json->length = cursor - json->data;
+}
+
+void housedcc_json_integer (DccJson *json, long long value) {
+
+    char digits[24];
+    char *cursor = digits + sizeof(digits);
+
+    // Convert using an unsigned value, to handle the most negative value.
+    unsigned long long magnitude =
+        (value < 0) ? 0 - (unsigned long long)value : (unsigned long long)value;
+    do {
+        *(--cursor) = '0' + (magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (value < 0) *(--cursor) = '-';
+
+    housedcc_json_append (json, cursor, digits + sizeof(digits) - cursor);
+}
+
+const char *housedcc_json_text (DccJson *json) {
+
+    if (json->failed || (!json->data)) return JsonEmpty;
+
+    json->data[json->length] = 0; // There is always room for it.
+    if (json->length > json->highwater) json->highwater = json->length;
+    return json->data;
+}
+
+int housedcc_json_length (const DccJson *json) {
+    return json->failed ? 0 : json->length;
+}
+
+int housedcc_json_failed (const DccJson *json) {
+    return json->failed;
+}
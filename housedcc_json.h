@@ -0,0 +1,41 @@
+/* HouseDCC - A model train control service
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedcc_json.h - A growable buffer to build JSON text.
+ */
+typedef struct {
+    char *data;
+    int length;
+    int size;
+    int highwater;
+    int failed;
+} DccJson;
+
+void housedcc_json_start (DccJson *json);
+void housedcc_json_reserve (DccJson *json, int needed);
+
+void housedcc_json_append  (DccJson *json, const char *text, int length);
+void housedcc_json_raw     (DccJson *json, const char *text);
+void housedcc_json_string  (DccJson *json, const char *text);
+void housedcc_json_integer (DccJson *json, long long value);
+
+const char *housedcc_json_text (DccJson *json);
+int housedcc_json_length (const DccJson *json);
+int housedcc_json_failed (const DccJson *json);
@@ -0,0 +1,297 @@
+/* HouseDCC - A model train control service
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedcc_live.c - Track changes to the live state.
+ *
+ * SYNOPSYS:
+ *
+ * This module maintains a change sequence number shared by all the
+ * modules that maintain a live state (vehicles, consists, accessories).
+ * Each item of the live state records the sequence number of its latest
+ * change, which allows reporting only the items that changed after a
+ * given sequence number.
+ *
+ * The sequence starts from the current time, so that the sequence numbers
+ * from a previous run of this service are always older than any change
+ * in the current run. A client that presents a stale sequence number
+ * will then get a complete status.
+ *
+ * long long housedcc_live_changed (void);
+ *
+ *    Allocate and return a new change sequence number.
+ *
+ * long long housedcc_live_sequence (void);
+ *
+ *    Return the sequence number of the most recent change.
+ *
+ * This module also implements an optional event stream, using the
+ * Server-Sent Events format on a separate TCP port (option -dcc-stream).
+ * The modules push small messages describing each change as it happens,
+ * so that clients do not need to poll for status. A client should first
+ * get the status, then subscribe to the stream, and then get a partial
+ * status since the sequence number provided when subscribing, to fill
+ * any gap. A subscriber that does not keep up is disconnected.
+ *
+ * const char *housedcc_live_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module. Return 0 on success, an error text otherwise.
+ *
+ * int housedcc_live_port (void);
+ *
+ *    Return the TCP port of the event stream, 0 if disabled.
+ *
+ * int housedcc_live_subscribed (void);
+ *
+ *    Return 1 if there is at least one subscriber. This is used to avoid
+ *    formatting events when nobody listens.
+ *
+ * void housedcc_live_publish (const char *event, const char *data);
+ *
+ *    Push one event to all subscribers. The data is a one line JSON text.
+ *
+ * The live state that must survive a restart (consist membership, vehicle
+ * functions) is saved through the depositor state channel. The modules
+ * only mark that state as dirty: the save is delayed until no change
+ * happened for a few seconds, so that a burst of changes (for example
+ * while making up a train) results in a single save. A save still happens
+ * within a bounded delay if changes keep coming.
+ *
+ * void housedcc_live_persist (void);
+ *
+ *    Mark the persistent state as dirty.
+ *
+ * void housedcc_live_background (time_t now);
+ *
+ *    The periodic function that keeps the subscriber connections alive
+ *    and schedules the debounced saves of the persistent state.
+ */
+
+#define _GNU_SOURCE // For accept4().
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+#include "housedepositorstate.h"
+
+#include "housedcc_live.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define LIVE_SUBSCRIBERS_MAX 16
+
+#define LIVE_PERSIST_QUIET   3 // Seconds without change before saving.
+#define LIVE_PERSIST_LATEST 15 // Maximum delay before saving.
+
+static int LiveStreamPort = 0;
+static int LiveStreamSocket = -1;
+
+static int LiveSubscribers[LIVE_SUBSCRIBERS_MAX]; // Socket + 1, 0 if free.
+static char LiveSubscribed[LIVE_SUBSCRIBERS_MAX]; // Headers sent.
+static int LiveSubscribersCount = 0;
+
+static time_t LiveKeepAlive = 0;
+
+static long long LiveSequence = 0;
+
+static time_t LivePersistFirst = 0; // 0 if the persistent state is clean.
+static time_t LivePersistLast = 0;
+
+static void housedcc_live_start (void) {
+    if (!LiveSequence) LiveSequence = (long long)time(0) * 1000000;
+}
+
+long long housedcc_live_changed (void) {
+    housedcc_live_start ();
+    return ++LiveSequence;
+}
+
+long long housedcc_live_sequence (void) {
+    housedcc_live_start ();
+    return LiveSequence;
+}
+
+static void housedcc_live_drop (int i) {
+    int fd = LiveSubscribers[i] - 1;
+    echttp_forget (fd);
+    close (fd);
+    LiveSubscribers[i] = 0;
+    if (LiveSubscribed[i]) LiveSubscribersCount -= 1;
+    LiveSubscribed[i] = 0;
+}
+
+static int housedcc_live_send (int i, const char *text, int length) {
+    if (write (LiveSubscribers[i] - 1, text, length) != length) {
+        DEBUG ("Dropping live stream subscriber %d\n", LiveSubscribers[i]-1);
+        housedcc_live_drop (i);
+        return 0;
+    }
+    return 1;
+}
+
+static void housedcc_live_request (int fd, int mode) {
+
+    int i;
+    for (i = 0; i < LIVE_SUBSCRIBERS_MAX; ++i) {
+        if (LiveSubscribers[i] == fd + 1) break;
+    }
+    if (i >= LIVE_SUBSCRIBERS_MAX) return; // Should never happen.
+
+    // The content of the request does not matter: this port only
+    // serves the event stream. Data is still flushed, to keep the
+    // connection readable for EOF detection.
+    char buffer[1024];
+    int length = read (fd, buffer, sizeof(buffer));
+    if (length <= 0) {
+        if ((length < 0) && (errno == EAGAIN)) return;
+        housedcc_live_drop (i);
+        return;
+    }
+    if (LiveSubscribed[i]) return;
+
+    static const char header[] = "HTTP/1.1 200 OK\r\n"
+                                 "Content-Type: text/event-stream\r\n"
+                                 "Cache-Control: no-cache\r\n"
+                                 "Access-Control-Allow-Origin: *\r\n"
+                                 "\r\n";
+    if (! housedcc_live_send (i, header, sizeof(header)-1)) return;
+
+    char text[128];
+    length = snprintf (text, sizeof(text),
+                       "event: hello\ndata: {\"sequence\":%lld}\n\n",
+                       housedcc_live_sequence());
+    if (! housedcc_live_send (i, text, length)) return;
+
+    LiveSubscribed[i] = 1;
+    LiveSubscribersCount += 1;
+}
+
+static void housedcc_live_accept (int fd, int mode) {
+
+    int client = accept4 (fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client < 0) return;
+
+    int i;
+    for (i = 0; i < LIVE_SUBSCRIBERS_MAX; ++i) {
+        if (!LiveSubscribers[i]) break;
+    }
+    if (i >= LIVE_SUBSCRIBERS_MAX) {
+        close (client); // Too many subscribers.
+        return;
+    }
+    LiveSubscribers[i] = client + 1;
+    LiveSubscribed[i] = 0;
+    echttp_listen (client, 1, housedcc_live_request, 0);
+}
+
+const char *housedcc_live_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *value;
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-dcc-stream=", argv[i], &value))
+            LiveStreamPort = atoi(value);
+    }
+    if (LiveStreamPort <= 0) return 0; // No event stream.
+
+    LiveStreamSocket = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (LiveStreamSocket < 0) return "cannot create event stream socket";
+
+    int on = 1;
+    setsockopt (LiveStreamSocket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in address;
+    memset (&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(LiveStreamPort);
+    if (bind (LiveStreamSocket,
+              (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close (LiveStreamSocket);
+        LiveStreamSocket = -1;
+        return "cannot bind event stream socket";
+    }
+    if (listen (LiveStreamSocket, 4) < 0) {
+        close (LiveStreamSocket);
+        LiveStreamSocket = -1;
+        return "cannot listen to event stream socket";
+    }
+    echttp_listen (LiveStreamSocket, 1, housedcc_live_accept, 0);
+    houselog_event ("SERVICE", "dcc", "STREAM", "ON PORT %d", LiveStreamPort);
+    return 0;
+}
+
+int housedcc_live_port (void) {
+    return (LiveStreamSocket >= 0) ? LiveStreamPort : 0;
+}
+
+int housedcc_live_subscribed (void) {
+    return LiveSubscribersCount > 0;
+}
+
+void housedcc_live_publish (const char *event, const char *data) {
+
+    if (LiveSubscribersCount <= 0) return;
+
+    char text[4096];
+    int length = snprintf (text, sizeof(text),
+                           "event: %s\ndata: %s\n\n", event, data);
+    if (length >= sizeof(text)) return; // Too large, never happens.
+
+    int i;
+    for (i = 0; i < LIVE_SUBSCRIBERS_MAX; ++i) {
+        if (LiveSubscribed[i]) housedcc_live_send (i, text, length);
+    }
+}
+
+void housedcc_live_persist (void) {
+    time_t now = time(0);
+    if (!LivePersistFirst) LivePersistFirst = now;
+    LivePersistLast = now;
+}
+
+void housedcc_live_background (time_t now) {
+
+    if (LivePersistFirst) {
+        if ((now >= LivePersistLast + LIVE_PERSIST_QUIET) ||
+            (now >= LivePersistFirst + LIVE_PERSIST_LATEST)) {
+            LivePersistFirst = 0;
+            housedepositor_state_changed ();
+        }
+    }
+
+    if (LiveSubscribersCount <= 0) return;
+    if (now < LiveKeepAlive) return;
+    LiveKeepAlive = now + 15;
+
+    // An SSE comment, ignored by clients: keeps proxies from timing out.
+    int i;
+    for (i = 0; i < LIVE_SUBSCRIBERS_MAX; ++i) {
+        if (LiveSubscribed[i]) housedcc_live_send (i, ":\n\n", 3);
+    }
+}
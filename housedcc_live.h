@@ -0,0 +1,34 @@
+/* HouseDCC - A model train control service
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedcc_live.h - Track changes to the live state.
+ */
+const char *housedcc_live_initialize (int argc, const char **argv);
+
+long long housedcc_live_changed (void);
+long long housedcc_live_sequence (void);
+
+int  housedcc_live_port (void);
+int  housedcc_live_subscribed (void);
+void housedcc_live_publish (const char *event, const char *data);
+
+void housedcc_live_persist (void);
+
+void housedcc_live_background (time_t now);
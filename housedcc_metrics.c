@@ -0,0 +1,311 @@
+/* HouseDCC - A model train control service
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedcc_metrics.c - Low overhead counters and latency histograms.
+ *
+ * SYNOPSYS:
+ *
+ * This module maintains the metrics that describe how this service
+ * performs: event counters, accumulated durations and latency histograms.
+ * The metrics are exported using the Prometheus text format, so that
+ * they can be scraped by the usual monitoring tools.
+ *
+ * Each metric is declared once, typically when a module is initialized,
+ * and is then referenced using the index returned. Updating a metric is
+ * only a few arithmetic operations: no allocation, no formatting.
+ *
+ * Metrics that share the same name but have different labels (e.g. one
+ * latency histogram per HTTP endpoint) are exported as one family. The
+ * labels are provided as Prometheus text, for example: endpoint="/dcc".
+ *
+ * int housedcc_metrics_counter (const char *name, const char *labels,
+ *                               const char *help);
+ * int housedcc_metrics_timer (const char *name, const char *labels,
+ *                             const char *help);
+ * int housedcc_metrics_histogram (const char *name, const char *labels,
+ *                                 const char *help);
+ * int housedcc_metrics_gauge (const char *name, const char *labels,
+ *                             const char *help);
+ *
+ *    Declare a new metric and return its index. A counter counts events.
+ *    A timer accumulates durations, in microseconds, and is exported in
+ *    seconds. A histogram counts durations (in microseconds) per range,
+ *    and is exported in seconds. A gauge is a value that can go up and
+ *    down, set by its owner. The name and labels strings must remain
+ *    valid: they are not copied. Return -1 if there is no room left.
+ *
+ * long long housedcc_metrics_clock (void);
+ *
+ *    Return a monotonic time in microseconds, suitable for measuring
+ *    durations.
+ *
+ * void housedcc_metrics_count (int metric, long long increment);
+ *
+ *    Add to a counter or timer (the increment is in microseconds for
+ *    a timer).
+ *
+ * void housedcc_metrics_set (int metric, long long value);
+ *
+ *    Set the current value of a gauge.
+ *
+ * void housedcc_metrics_record (int metric, long long microseconds);
+ *
+ *    Add one duration to a histogram.
+ *
+ * void housedcc_metrics_since (int metric, long long start);
+ *
+ *    Add the time elapsed since start (see housedcc_metrics_clock())
+ *    to a histogram or timer.
+ *
+ * void housedcc_metrics_export (DccJson *text);
+ *
+ *    Append all the metrics to the (non JSON) text.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "housedcc_json.h"
+#include "housedcc_metrics.h"
+
+#define METRICS_MAX 64
+
+#define METRICS_COUNTER   'c'
+#define METRICS_TIMER     't'
+#define METRICS_HISTOGRAM 'h'
+#define METRICS_GAUGE     'g'
+
+// The histogram buckets, in microseconds, from 10 microseconds to 1 second.
+// The last bucket (+Inf) is implicit.
+//
+static const long long MetricsBuckets[] = {
+    10, 50, 100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000
+};
+#define METRICS_BUCKETS (sizeof(MetricsBuckets)/sizeof(MetricsBuckets[0]))
+
+typedef struct {
+    const char *name;
+    const char *labels;
+    const char *help;
+    char type;
+    long long value; // The count, or the sum of durations.
+    long long count; // Histograms only.
+    long long buckets[METRICS_BUCKETS];
+} DccMetric;
+
+static DccMetric Metrics[METRICS_MAX];
+static int MetricsCount = 0;
+
+static int housedcc_metrics_declare (const char *name, const char *labels,
+                                     const char *help, char type) {
+
+    if (MetricsCount >= METRICS_MAX) return -1;
+
+    DccMetric *metric = Metrics + MetricsCount;
+    memset (metric, 0, sizeof(DccMetric));
+    metric->name = name;
+    metric->labels = labels;
+    metric->help = help;
+    metric->type = type;
+    return MetricsCount++;
+}
+
+int housedcc_metrics_counter (const char *name, const char *labels,
+                              const char *help) {
+    return housedcc_metrics_declare (name, labels, help, METRICS_COUNTER);
+}
+
+int housedcc_metrics_timer (const char *name, const char *labels,
+                            const char *help) {
+    return housedcc_metrics_declare (name, labels, help, METRICS_TIMER);
+}
+
+int housedcc_metrics_histogram (const char *name, const char *labels,
+                                const char *help) {
+    return housedcc_metrics_declare (name, labels, help, METRICS_HISTOGRAM);
+}
+
+int housedcc_metrics_gauge (const char *name, const char *labels,
+                            const char *help) {
+    return housedcc_metrics_declare (name, labels, help, METRICS_GAUGE);
+}
+
+long long housedcc_metrics_clock (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return ((long long)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+void housedcc_metrics_count (int metric, long long increment) {
+    if ((metric < 0) || (metric >= MetricsCount)) return;
+    Metrics[metric].value += increment;
+}
+
+void housedcc_metrics_set (int metric, long long value) {
+    if ((metric < 0) || (metric >= MetricsCount)) return;
+    Metrics[metric].value = value;
+}
+
+void housedcc_metrics_record (int metric, long long microseconds) {
+
+    if ((metric < 0) || (metric >= MetricsCount)) return;
+
+    DccMetric *histogram = Metrics + metric;
+    histogram->value += microseconds;
+    histogram->count += 1;
+
+    // Buckets are not cumulative here: this is done when exporting.
+    int i;
+    for (i = 0; i < METRICS_BUCKETS; ++i) {
+        if (microseconds <= MetricsBuckets[i]) {
+            histogram->buckets[i] += 1;
+            break;
+        }
+    }
+}
+
+void housedcc_metrics_since (int metric, long long start) {
+
+    if ((metric < 0) || (metric >= MetricsCount)) return;
+
+    long long elapsed = housedcc_metrics_clock () - start;
+    if (Metrics[metric].type == METRICS_HISTOGRAM)
+        housedcc_metrics_record (metric, elapsed);
+    else
+        housedcc_metrics_count (metric, elapsed);
+}
+
+static void housedcc_metrics_seconds (DccJson *text, long long microseconds) {
+    char buffer[32];
+    snprintf (buffer, sizeof(buffer), "%lld.%06lld",
+              microseconds / 1000000, microseconds % 1000000);
+    housedcc_json_raw (text, buffer);
+}
+
+// Append the series name, with the metric's labels and an optional
+// additional label.
+//
+static void housedcc_metrics_series (DccJson *text, const DccMetric *metric,
+                                     const char *suffix, const char *extra) {
+
+    housedcc_json_raw (text, metric->name);
+    housedcc_json_raw (text, suffix);
+    int labeled = (metric->labels && metric->labels[0]);
+    if (labeled || extra) {
+        housedcc_json_raw (text, "{");
+        if (labeled) housedcc_json_raw (text, metric->labels);
+        if (extra) {
+            if (labeled) housedcc_json_raw (text, ",");
+            housedcc_json_raw (text, extra);
+        }
+        housedcc_json_raw (text, "}");
+    }
+    housedcc_json_raw (text, " ");
+}
+
+static void housedcc_metrics_header (DccJson *text, const DccMetric *metric) {
+
+    if (metric->help) {
+        housedcc_json_raw (text, "# HELP ");
+        housedcc_json_raw (text, metric->name);
+        housedcc_json_raw (text, " ");
+        housedcc_json_raw (text, metric->help);
+        housedcc_json_raw (text, "\n");
+    }
+    housedcc_json_raw (text, "# TYPE ");
+    housedcc_json_raw (text, metric->name);
+    switch (metric->type) {
+    case METRICS_HISTOGRAM:
+        housedcc_json_raw (text, " histogram\n");
+        break;
+    case METRICS_GAUGE:
+        housedcc_json_raw (text, " gauge\n");
+        break;
+    default:
+        housedcc_json_raw (text, " counter\n");
+    }
+}
+
+static void housedcc_metrics_value (DccJson *text, const DccMetric *metric) {
+
+    switch (metric->type) {
+    case METRICS_COUNTER:
+    case METRICS_GAUGE:
+        housedcc_metrics_series (text, metric, "", 0);
+        housedcc_json_integer (text, metric->value);
+        housedcc_json_raw (text, "\n");
+        break;
+
+    case METRICS_TIMER:
+        housedcc_metrics_series (text, metric, "", 0);
+        housedcc_metrics_seconds (text, metric->value);
+        housedcc_json_raw (text, "\n");
+        break;
+
+    case METRICS_HISTOGRAM:
+        {
+            int j;
+            long long cumulative = 0;
+            char le[32];
+            for (j = 0; j < METRICS_BUCKETS; ++j) {
+                cumulative += metric->buckets[j];
+                snprintf (le, sizeof(le), "le=\"%lld.%06lld\"",
+                          MetricsBuckets[j] / 1000000,
+                          MetricsBuckets[j] % 1000000);
+                housedcc_metrics_series (text, metric, "_bucket", le);
+                housedcc_json_integer (text, cumulative);
+                housedcc_json_raw (text, "\n");
+            }
+            housedcc_metrics_series (text, metric, "_bucket", "le=\"+Inf\"");
+            housedcc_json_integer (text, metric->count);
+            housedcc_json_raw (text, "\n");
+            housedcc_metrics_series (text, metric, "_sum", 0);
+            housedcc_metrics_seconds (text, metric->value);
+            housedcc_json_raw (text, "\n");
+            housedcc_metrics_series (text, metric, "_count", 0);
+            housedcc_json_integer (text, metric->count);
+            housedcc_json_raw (text, "\n");
+        }
+        break;
+    }
+}
+
+void housedcc_metrics_export (DccJson *text) {
+
+    // The series of the same family must be listed together, whatever
+    // the order in which they were declared.
+    int i;
+    for (i = 0; i < MetricsCount; ++i) {
+
+        int j;
+        for (j = 0; j < i; ++j) {
+            if (!strcmp (Metrics[j].name, Metrics[i].name)) break;
+        }
+        if (j < i) continue; // Already listed as part of its family.
+
+        housedcc_metrics_header (text, Metrics + i);
+        for (j = i; j < MetricsCount; ++j) {
+            if (strcmp (Metrics[j].name, Metrics[i].name)) continue;
+            housedcc_metrics_value (text, Metrics + j);
+        }
+    }
+}
@@ -0,0 +1,39 @@
+/* HouseDCC - A model train control service
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedcc_metrics.h - Low overhead counters and latency histograms.
+ */
+int housedcc_metrics_counter (const char *name, const char *labels,
+                              const char *help);
+int housedcc_metrics_timer (const char *name, const char *labels,
+                            const char *help);
+int housedcc_metrics_histogram (const char *name, const char *labels,
+                                const char *help);
+int housedcc_metrics_gauge (const char *name, const char *labels,
+                            const char *help);
+
+long long housedcc_metrics_clock (void);
+
+void housedcc_metrics_count (int metric, long long increment);
+void housedcc_metrics_set (int metric, long long value);
+void housedcc_metrics_record (int metric, long long microseconds);
+void housedcc_metrics_since (int metric, long long start);
+
+void housedcc_metrics_export (DccJson *text);
@@ -30,14 +30,15 @@
  *
  * void housedcc_pidcc_config (int pina, int pinb);
  *
- *    Update the PiDCC configuration, typically on a user action.
+ *    Update the PiDCC configuration of the main district, typically on
+ *    a user action.
  *
  * const char *housedcc_pidcc_reload (void);
  *
  *    Reload the program's configuration, typically on restart or when
  *    detecting a configuration change.
  *
- * int housedcc_pidcc_export (char *buffer, int size, const char *prefix);
+ * void housedcc_pidcc_export (DccJson *json, const char *prefix);
  *
  *    Export this module's current configuration to JSON format.
  *
@@ -50,6 +51,30 @@
  *
  *    Return <= 0 on error, >= 1 otherwise.
  *
+ * int housedcc_pidcc_encode_step (int step, int forward);
+ * int housedcc_pidcc_encode_step128 (int step, int forward);
+ *
+ *    Return the DCC speed and direction instruction for the specified
+ *    step (0 to 28, or 0 to 126 in 128 steps mode) and direction. This is
+ *    typically used to precompute the instructions for each model, so that
+ *    a speed change does not require any conversion.
+ *
+ *    The 128 steps mode uses the two bytes Advanced Operations instruction,
+ *    returned as a single value: the first byte in bits 8 to 15 and the
+ *    second byte in bits 0 to 7.
+ *
+ * int housedcc_pidcc_speed (int address, int instruction);
+ *
+ *    Send a speed and direction instruction, typically as returned by
+ *    housedcc_pidcc_encode_step() or housedcc_pidcc_encode_step128().
+ *
+ *    Return <= 0 on error, >= 1 otherwise.
+ *
+ * int housedcc_pidcc_refresh (int address, int instruction);
+ *
+ *    Repeat a speed and direction instruction. This is similar to
+ *    housedcc_pidcc_speed(), except that this is at the lowest priority.
+ *
  * int housedcc_pidcc_stop (int address, int emergency, int direction);
  *
  *    Order one or all locomotives to stop. And emergency stop is immediate
@@ -66,19 +91,165 @@
  *
  * int housedcc_pidcc_function (int address, int instruction);
  *
- *    Control one vehicle's function devices (F0 to F4).
+ *    Control one group of a vehicle's function devices. The instruction is
+ *    a function group instruction (FL and F1 to F4, F5 to F8, F9 to F12)
+ *    or a two bytes feature expansion instruction (F13 to F20, F21 to F28).
+ *
+ *    Return <= 0 on error, >= 1 otherwise.
+ *
+ * int housedcc_pidcc_encode_speed (DccPacket *packet,
+ *                                  int address, int instruction);
+ * int housedcc_pidcc_encode_function (DccPacket *packet,
+ *                                     int address, int instruction);
+ *
+ *    Build the PiDCC command for a speed instruction, or for a function
+ *    group instruction, and store it in the packet. A vehicle's commands
+ *    change only when its speed step, direction or functions change: the
+ *    caller can keep the packets built and send them again as is, without
+ *    any conversion or formatting. Return 0 if the address or instruction
+ *    is not valid (the packet is then marked as empty), 1 otherwise.
+ *
+ * int housedcc_pidcc_send (const DccPacket *packet);
+ * int housedcc_pidcc_repeat (const DccPacket *packet);
+ *
+ *    Send a packet built by one of the functions above, either at the
+ *    priority of its kind (see housedcc_pidcc_speed() and
+ *    housedcc_pidcc_function()), or at the lowest priority, as for
+ *    housedcc_pidcc_refresh().
+ *
+ *    Return <= 0 on error, >= 1 otherwise.
+ *
+ * int housedcc_pidcc_consist (int address, int consist, int reverse);
+ *
+ *    Set (or clear, if consist is 0) the advanced consist address of one
+ *    locomotive, i.e. its CV19, using the Consist Control instruction. The
+ *    reverse flag indicates that this locomotive runs in the opposite
+ *    direction of the consist. A consist address is in the range 1 to 127.
  *
  *    Return <= 0 on error, >= 1 otherwise.
  *
  * int housedcc_pidcc_accessory (int address, int device, int value);
  *
  *    Control one accessory's devices. Typically signals and switches.
+ *    The address is the basic accessory decoder address (0 to 511) and
+ *    the device is the decoder output (0 to 7, two outputs per pair).
+ *    The 3 most significant bits of the address are transmitted
+ *    complemented, as required by the DCC standard.
  *
  *    Return <= 0 on error, >= 1 otherwise.
  *
+ * void housedcc_pidcc_bandwidth (int rate);
+ *
+ *    Set the number of DCC packets per second that the track can carry
+ *    (0 restores the default). This applies to every district that does
+ *    not have its own bandwidth configured. See below.
+ *
+ * int housedcc_pidcc_refresh_capacity (int district);
+ *
+ *    Return how many speed refresh packets per second can be transmitted,
+ *    at least, when the district's track is saturated. District 0 means
+ *    all districts, i.e. the lowest capacity. This is used to slow down
+ *    the speed refresh when there are many moving vehicles.
+ *
+ * int housedcc_pidcc_district (const char *name);
+ * const char *housedcc_pidcc_district_name (int district);
+ * int housedcc_pidcc_districts (void);
+ *
+ *    Return the district number for a name (0 if the name is empty, -1 if
+ *    no such district exists), the name for a district number (0 if no
+ *    such district), and the count of districts. Districts are numbered
+ *    from 1: district 1 is the main district.
+ *
+ * void housedcc_pidcc_assign (int address, int district);
+ *
+ *    Route the commands for this vehicle address to one district only.
+ *    District 0 (the default) sends these commands to every district.
+ *    The assignments are cleared when the configuration is reloaded.
+ *
+ * int housedcc_pidcc_room (void);
+ *
+ *    Return how many more commands can be queued without delaying the
+ *    commands already pending, 0 if PiDCC is not ready (not running,
+ *    its queue is full, or the track bandwidth is used up). This is used
+ *    to pace bursts of commands.
+ *
+ * int housedcc_pidcc_accessory_room (void);
+ *
+ *    Return how many accessory commands can be queued right now, i.e. the
+ *    free space in the control queue of the fullest district, 0 if PiDCC
+ *    is not configured. This allows checking that a whole route can be
+ *    queued before queueing any of its commands.
+ *
+ * int housedcc_pidcc_restarted (void);
+ *
+ *    Return 1 once after PiDCC was restarted, 0 otherwise. The new PiDCC
+ *    process knows nothing about the current speeds or functions, so the
+ *    caller should send them again, pacing these commands using
+ *    housedcc_pidcc_room(). The GPIO pins configuration is sent again by
+ *    this module, before any other command.
+ *
  * void housedcc_pidcc_periodic (time_t now);
  *
  *    The periodic function that maintain information about PiDCC.
+ *
+ * Vehicle addresses 1 to 127 are sent as short (7 bits) addresses,
+ * addresses 128 to 10239 are sent as long (14 bits) addresses.
+ *
+ * All the commands submitted to PiDCC are queued, and the queue is flushed
+ * in a single writev() call as soon as the echttp loop regains control:
+ * all the DCC packets generated by one HTTP request or one background
+ * tick are transmitted together.
+ *
+ * There is one queue per priority: stop commands first, then speed
+ * commands, then function and accessory commands, and finally the
+ * periodic repeat of speed commands. A new command replaces
+ * any pending command of the same or lower priority that controls the
+ * same thing (e.g. the speed of the same locomotive), since the old
+ * command is now obsolete. The pipe is non-blocking, and the queues are
+ * not drained while PiDCC reports that its own queue is full: the commands
+ * accumulate (and supersede each other) until PiDCC is ready again.
+ * A command is rejected only if its queue is full.
+ *
+ * Each command written to PiDCC is given a sequence number, in the order
+ * of transmission. PiDCC processes its input in order, so it can report
+ * its progress using a single count: the extension line "@ COUNT" tells
+ * how many commands PiDCC has fully processed since it started. When
+ * PiDCC sends these reports, this module knows how many commands are in
+ * flight, measures the delay from queuing each command to its actual
+ * transmission, and paces its writes so that no more than a few commands
+ * are in flight at any time; PiDCC's own queue then never becomes full.
+ * Stop commands are never delayed by this pacing. If PiDCC does not send
+ * these reports (older versions), or stops sending them, the pacing is
+ * disabled and this module relies on the PiDCC state reports only.
+ *
+ * The track can only carry a limited number of DCC packets per second
+ * (about 120 by default). This module keeps a budget of packets, which is
+ * replenished at that rate, and no command is written to PiDCC when
+ * this budget is used up, except for stop commands. The budget is split
+ * between the traffic classes: each of the speed, control and refresh
+ * queues is guaranteed a share of the bandwidth, and can use whatever the
+ * other classes leave unused. A burst of function or accessory commands
+ * then cannot delay the speed refresh indefinitely. The bandwidth left
+ * unused is filled with idle packets by PiDCC. The utilization of the
+ * track is reported as a metric.
+ *
+ * The layout may be split into power districts, each with its own booster
+ * and its own PiDCC process (with its own GPIO pins). The main district
+ * is configured using the trains.gpio item, additional districts are
+ * listed in trains.districts. Each district has its own queues and its
+ * own bandwidth budget. The commands for a vehicle are sent only to the
+ * district the vehicle was assigned to, or to all districts if none was,
+ * so the track throughput grows with the number of districts. Stop all
+ * and accessory commands are always sent to all districts.
+ *
+ * With the -dcc-realtime option, the PiDCC pipes are relayed by a separate
+ * thread (see housedcc_pipe.c): the commands reach PiDCC, and its reports
+ * are read, even while the echttp loop is busy. Nothing else changes: the
+ * queues and the budget are still managed here, from the echttp loop.
+ *
+ * The death of PiDCC is detected immediately, when its output pipe is
+ * closed, and PiDCC is restarted right away. A PiDCC that keeps dying
+ * is restarted no more often than every 5 seconds.
  */
 
 #include <string.h>
@@ -87,171 +258,979 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
 
 #include <echttp.h>
 #include <echttp_encoding.h>
+#include "echttp_libc.h"
 
 #include "houselog.h"
 #include "housecapture.h"
 #include "houseconfig.h"
 
+#include "housedcc_json.h"
+#include "housedcc_metrics.h"
+#include "housedcc_timer.h"
+#include "housedcc_pipe.h"
 #include "housedcc_pidcc.h"
 
 #define DEBUG if (echttp_isdebug()) printf
 
-static pid_t PiDccProcess;
-static int PiDccTransmit;
-static int PiDccListen;
+#define PIDCC_RESTART_DELAY 5
+
+// The timeouts, in milliseconds (see housedcc_timer.c). The timer context
+// combines the district index and the timeout.
+//
+#define PIDCC_TIMER_STATE  1
+#define PIDCC_TIMER_REPORT 2
+#define PIDCC_TIMER_TOKENS 3
+#define PIDCC_TIMER(district, which) (((district) << 4) + (which))
 
-static char PiDccState = 0;
-static time_t PiDccStateDeadline = 0;
+#define PIDCC_STATE_TIMEOUT  3000
+#define PIDCC_REPORT_TIMEOUT 3000
+
+// PiDCC completion reports (see above). The sequence numbers stay
+// increasing for as long as the PiDCC process lives.
+//
+#define PIDCC_INFLIGHT_MAX   8
+#define PIDCC_INFLIGHT_RING  256 // Must be a power of 2, > PIDCC_VECTOR_MAX.
 
 static const char *PiDccExecutable = "/usr/local/bin/pidcc";
 
 static int PiDccCapture = -1;
 
-static int GpioPinA = 0;
-static int GpioPinB = 0;
+// PiDCC debug output can be verbose: only a sample is captured, and the
+// count of lines that were skipped is recorded with the next sample.
+//
+#define PIDCC_DEBUG_SAMPLES 10 // Lines captured per second, at most.
+
+// PiDCC command transmit queues.
+//
+#define PIDCC_PRIORITY_STOP    0
+#define PIDCC_PRIORITY_SPEED   1
+#define PIDCC_PRIORITY_CONTROL 2
+#define PIDCC_PRIORITY_REFRESH 3
+#define PIDCC_PRIORITIES       4
+
+// The key identifies what a command controls. Key 0 is never superseded.
+#define PIDCC_KIND_CONFIG    1
+#define PIDCC_KIND_SPEED     2
+#define PIDCC_KIND_FUNCTION  3 // 5 function groups: 3 to 7.
+#define PIDCC_KIND_ACCESSORY 8
+#define PIDCC_KIND_CONSIST   9
+#define PIDCC_KEY(kind, id) (((kind) << 16) + (id))
+
+#define PIDCC_ADDRESS_SHORT 128
+#define PIDCC_ADDRESS_MAX   10239
+
+#define PIDCC_QUEUE_DEPTH 32 // Must be a power of 2.
+#define PIDCC_VECTOR_MAX  64
+
+typedef struct {
+    int key;
+    short length; // 0 if superseded.
+    char text[30];
+    long long queued; // When the command was queued (metrics clock).
+} PiDccCommand;
+
+typedef struct {
+    unsigned int consumer;
+    unsigned int producer;
+    PiDccCommand commands[PIDCC_QUEUE_DEPTH];
+} PiDccQueue;
+
+typedef struct {
+    struct iovec vector[PIDCC_VECTOR_MAX];
+    PiDccCommand *sent[PIDCC_VECTOR_MAX];
+    char kind[PIDCC_VECTOR_MAX];
+    int shared[PIDCC_PRIORITIES]; // Commands charged to the class share.
+    int count;
+    int total;
+} PiDccBatch;
+
+// The track bandwidth budget (see above). The tokens are counted in 1/1000
+// of a packet. The budget of the whole track may go negative because of
+// stop commands, which are never held back.
+//
+#define PIDCC_BANDWIDTH_DEFAULT 120 // Packets per second.
+#define PIDCC_BANDWIDTH_BURST   16  // Packets that can be sent at once.
+
+static const int PiDccShares[PIDCC_PRIORITIES] = {0, 40, 30, 30}; // Percent.
+
+static int PiDccBandwidth = PIDCC_BANDWIDTH_DEFAULT;
+
+// Everything about one power district: its PiDCC process, pipes and
+// queues. The PiDCC output is decoded in place: the buffer is scanned only
+// once, each read resuming where the previous one stopped, and lines are
+// passed as is to the decoder. Only the last, incomplete, line is ever
+// moved, when the end of the buffer is reached.
+//
+typedef struct {
+    char name[16];
+    int pina;
+    int pinb;
+    int bandwidth; // 0 means the default bandwidth.
+
+    pid_t process;
+    int transmit;
+    int listen;
+    int relay; // See housedcc_pipe.c, -1 if the pipes are used directly.
+    time_t launched;
+    int restarted;
+
+    char state;
+    long long statesince; // When the busy or full state started.
+    int statetimer;
+    int reporttimer;
+    int tokentimer;
+
+    int reporting; // PiDCC sends completion reports.
+    long long submitted; // Sequence of the latest written.
+    long long completed; // Sequence of the latest completed.
+    long long inflight[PIDCC_INFLIGHT_RING]; // When queued.
+
+    char buffer[1024];
+    int bufferconsumer; // Start of the current line.
+    int bufferscanned;  // End of the data already scanned.
+    int bufferproducer; // End of the data received.
+
+    time_t debugperiod;
+    int debugsampled;
+    int debugskipped;
+
+    PiDccQueue queues[PIDCC_PRIORITIES];
+    int queued;
+    int draining;
+
+    long long tokens;
+    long long classtokens[PIDCC_PRIORITIES];
+    long long tokensupdated;
+
+    long long windowstart; // For the utilization metric.
+    int windowpackets;
+    char label[32];
+    int metricutilization;
+} PiDccDistrict;
+
+#define PIDCC_DISTRICTS_MAX 8
+
+static PiDccDistrict PiDccDistricts[PIDCC_DISTRICTS_MAX];
+static int PiDccDistrictsCount = 1; // The main district always exists.
+
+// Which district each vehicle address is routed to: 0 means all districts,
+// otherwise this is the district index plus one.
+//
+static unsigned char PiDccRoutes[PIDCC_ADDRESS_MAX+1];
+
+// Metrics. The packets are counted per kind when written to PiDCC.
+//
+#define PIDCC_METRIC_OTHER     0
+#define PIDCC_METRIC_CONFIG    1
+#define PIDCC_METRIC_SPEED     2
+#define PIDCC_METRIC_REFRESH   3
+#define PIDCC_METRIC_FUNCTION  4
+#define PIDCC_METRIC_ACCESSORY 5
+#define PIDCC_METRIC_CONSIST   6
+#define PIDCC_METRIC_KINDS     7
+
+static const char *PiDccMetricKinds[PIDCC_METRIC_KINDS] = {
+    "kind=\"other\"", "kind=\"config\"", "kind=\"speed\"",
+    "kind=\"refresh\"", "kind=\"function\"", "kind=\"accessory\"",
+    "kind=\"consist\""
+};
+static int PiDccMetricPackets[PIDCC_METRIC_KINDS];
+static int PiDccMetricWriteErrors = -1;
+static int PiDccMetricQueueFull = -1;
+static int PiDccMetricRestarts = -1;
+static int PiDccMetricBusy = -1;
+static int PiDccMetricFull = -1;
+static int PiDccMetricWrite = -1;
+static int PiDccMetricLatency = -1;
+static int PiDccMetricCompleted = -1;
+static int PiDccMetricTransmit = -1;
+static int PiDccMetricSaturated = -1;
+
+static int housedcc_pidcc_enabled (const PiDccDistrict *district) {
+    return (district->pina > 0) || (district->pinb > 0);
+}
 
-// PiDCC status receive mechanism.
-static char PiDccBuffer[1024];
-static int PiDccBufferConsumer = 0;
-static int PiDccBufferProducer = 0;
+static int housedcc_pidcc_rate (const PiDccDistrict *district) {
+    return (district->bandwidth > 0) ? district->bandwidth : PiDccBandwidth;
+}
+
+static PiDccDistrict *housedcc_pidcc_find_fd (int fd) {
+    int i;
+    for (i = 0; i < PiDccDistrictsCount; ++i) {
+        PiDccDistrict *district = PiDccDistricts + i;
+        if ((district->transmit == fd) || (district->listen == fd))
+            return district;
+    }
+    return 0;
+}
 
-static int housedcc_pidcc_enabled (void) {
-    return (GpioPinA > 0) || (GpioPinB > 0);
+static void housedcc_pidcc_clear (PiDccDistrict *district) {
+    memset (district->queues, 0, sizeof(district->queues));
+    district->queued = 0;
+    district->reporting = 0;
+    district->submitted = district->completed = 0;
+    if (district->draining) {
+        echttp_forget (district->transmit);
+        district->draining = 0;
+    }
 }
 
-static int housedcc_pidcc_write (const char *text, int length) {
+static void housedcc_pidcc_drain (int fd, int mode);
 
-    int submit = housedcc_pidcc_enabled();
-    housecapture_record (PiDccCapture, "PIDCC", submit?"WRITE":"BUILT", text);
-    if (!submit) return 0; // No configuration.
+static int housedcc_pidcc_writev (PiDccDistrict *district,
+                                  const struct iovec *vector, int count) {
+    if (district->relay >= 0)
+        return housedcc_pipe_writev (district->relay, vector, count);
+    return writev (district->transmit, vector, count);
+}
 
-    char line[256];
-    int total = snprintf (line, sizeof(line), "%s\n", text);
-    if (write (PiDccTransmit, line, total) <= 0) {
-       return 0;
+static int housedcc_pidcc_read (PiDccDistrict *district,
+                                char *buffer, int size) {
+    if (district->relay >= 0)
+        return housedcc_pipe_read (district->relay, buffer, size);
+    return read (district->listen, buffer, size);
+}
+
+static int housedcc_pidcc_metric_kind (int priority, int key) {
+
+    if (priority == PIDCC_PRIORITY_REFRESH) return PIDCC_METRIC_REFRESH;
+
+    int kind = key >> 16;
+    if ((kind >= PIDCC_KIND_FUNCTION) && (kind < PIDCC_KIND_ACCESSORY))
+        return PIDCC_METRIC_FUNCTION;
+    switch (kind) {
+    case PIDCC_KIND_CONFIG:    return PIDCC_METRIC_CONFIG;
+    case PIDCC_KIND_SPEED:     return PIDCC_METRIC_SPEED;
+    case PIDCC_KIND_ACCESSORY: return PIDCC_METRIC_ACCESSORY;
+    case PIDCC_KIND_CONSIST:   return PIDCC_METRIC_CONSIST;
+    }
+    return PIDCC_METRIC_OTHER;
+}
+
+// Track how long PiDCC stays busy or full.
+//
+static void housedcc_pidcc_state (PiDccDistrict *district, char state) {
+
+    if (state == district->state) return;
+
+    if (district->statesince) {
+        if (district->state == '%')
+            housedcc_metrics_since (PiDccMetricBusy, district->statesince);
+        else if (district->state == '*')
+            housedcc_metrics_since (PiDccMetricFull, district->statesince);
+    }
+    district->state = state;
+    district->statesince =
+        ((state == '%') || (state == '*')) ? housedcc_metrics_clock () : 0;
+}
+
+// How many more commands can be written without exceeding the in-flight
+// limit. There is no limit if PiDCC does not report its progress.
+//
+static int housedcc_pidcc_budget (const PiDccDistrict *district) {
+    if (!district->reporting) return PIDCC_VECTOR_MAX;
+    int budget = PIDCC_INFLIGHT_MAX -
+                     (int)(district->submitted - district->completed);
+    return (budget > 0) ? budget : 0;
+}
+
+// Replenish the track bandwidth budget, and return how many packets can
+// be transmitted now.
+//
+static int housedcc_pidcc_tokens (PiDccDistrict *district) {
+
+    long long now = housedcc_timer_now ();
+    long long elapsed = now - district->tokensupdated;
+
+    if (elapsed > 0) {
+        district->tokensupdated = now;
+        if (elapsed > 1000) elapsed = 1000; // Enough to fill everything.
+
+        int rate = housedcc_pidcc_rate (district);
+        long long limit = PIDCC_BANDWIDTH_BURST * 1000;
+        district->tokens += elapsed * rate;
+        if (district->tokens > limit) district->tokens = limit;
+
+        int priority;
+        for (priority = PIDCC_PRIORITY_STOP + 1;
+             priority < PIDCC_PRIORITIES; ++priority) {
+            long long *tokens = district->classtokens + priority;
+            long long classlimit = (limit * PiDccShares[priority]) / 100;
+            if (classlimit < 1000) classlimit = 1000;
+            *tokens += (elapsed * rate * PiDccShares[priority]) / 100;
+            if (*tokens > classlimit) *tokens = classlimit;
+        }
+    }
+    return (district->tokens > 0) ? (int)(district->tokens / 1000) : 0;
+}
+
+// Only stop commands are transmitted when the PiDCC queue is full, when
+// too many commands are in flight, or when the track bandwidth is used up,
+// since these are safety commands.
+//
+static int housedcc_pidcc_priorities (PiDccDistrict *district) {
+    if ((district->state == '*') || (housedcc_pidcc_budget (district) <= 0) ||
+        (housedcc_pidcc_tokens (district) <= 0))
+        return PIDCC_PRIORITY_STOP + 1;
+    return PIDCC_PRIORITIES;
+}
+
+// Wake up when the next packet can be transmitted.
+//
+static void housedcc_pidcc_throttle (PiDccDistrict *district) {
+
+    if (housedcc_timer_armed (district->tokentimer)) return;
+    if (housedcc_pidcc_tokens (district) > 0) return;
+
+    housedcc_metrics_count (PiDccMetricSaturated, 1);
+    int rate = housedcc_pidcc_rate (district);
+    long long delay = (1000 - district->tokens + rate - 1) / rate;
+    housedcc_timer_start (district->tokentimer, delay);
+}
+
+static void housedcc_pidcc_schedule (PiDccDistrict *district) {
+
+    int ready = 0;
+    int priority;
+    int limit = housedcc_pidcc_priorities (district);
+    for (priority = 0; priority < limit; ++priority) {
+        PiDccQueue *queue = district->queues + priority;
+        if (queue->producer != queue->consumer) {
+            ready = 1;
+            break;
+        }
+    }
+    if ((!ready) && (district->queued > 0)) housedcc_pidcc_throttle (district);
+
+    if (ready && (!district->draining)) {
+        // Wait for the current callback to complete before transmitting.
+        echttp_listen (district->transmit, 2, housedcc_pidcc_drain, 1);
+        district->draining = 1;
+    } else if (district->draining && (!ready)) {
+        echttp_forget (district->transmit);
+        district->draining = 0;
+    }
+}
+
+// Add the pending commands of one queue to the batch, starting at the
+// cursor, up to the quota. Return 0 when the batch is full.
+//
+static int housedcc_pidcc_collect (PiDccDistrict *district,
+                                   PiDccBatch *batch, int priority,
+                                   unsigned int *cursor, int *quota) {
+
+    PiDccQueue *queue = district->queues + priority;
+    for (; *cursor != queue->producer; *cursor += 1) {
+        PiDccCommand *command =
+            queue->commands + (*cursor & (PIDCC_QUEUE_DEPTH - 1));
+        if (command->length <= 0) continue; // Superseded.
+        if (*quota <= 0) return 1;
+        if ((batch->count >= PIDCC_VECTOR_MAX) ||
+            (batch->total + command->length > PIPE_BUF)) return 0;
+
+        batch->vector[batch->count].iov_base = command->text;
+        batch->vector[batch->count].iov_len = command->length;
+        batch->kind[batch->count] =
+            housedcc_pidcc_metric_kind (priority, command->key);
+        batch->sent[batch->count++] = command;
+        batch->total += command->length;
+        *quota -= 1;
     }
     return 1;
 }
 
-void housedcc_pidcc_config (int pina, int pinb) {
+static void housedcc_pidcc_drain (int fd, int mode) {
+
+    PiDccDistrict *district = housedcc_pidcc_find_fd (fd);
+    if (!district) {
+        echttp_forget (fd); // Should never happen.
+        return;
+    }
+
+    PiDccBatch batch;
+    batch.count = batch.total = 0;
+    memset (batch.shared, 0, sizeof(batch.shared));
+
+    // Collect the pending commands. The total is kept within PIPE_BUF so
+    // that the write is atomic: either all of it goes through, or nothing
+    // (EAGAIN).
+    //
+    // The stop commands go first, without limit. Then each class gets
+    // the part of the budget that it has accumulated from its own share,
+    // and finally the rest of the budget goes in priority order.
+    int priority;
+    unsigned int cursor[PIDCC_PRIORITIES];
+    for (priority = 0; priority < PIDCC_PRIORITIES; ++priority)
+        cursor[priority] = district->queues[priority].consumer;
+
+    int quota = PIDCC_VECTOR_MAX;
+    if (!housedcc_pidcc_collect (district, &batch, PIDCC_PRIORITY_STOP,
+                                 cursor + PIDCC_PRIORITY_STOP, &quota))
+        goto collected;
+
+    int limit = housedcc_pidcc_priorities (district);
+    int allowed = housedcc_pidcc_budget (district);
+    int tokens = housedcc_pidcc_tokens (district);
+    if (tokens < allowed) allowed = tokens;
+
+    for (priority = PIDCC_PRIORITY_STOP + 1; priority < limit; ++priority) {
+        int share = (int)(district->classtokens[priority] / 1000);
+        quota = (share < allowed) ? share : allowed;
+        if (quota <= 0) continue;
+        int initial = quota;
+        int more = housedcc_pidcc_collect (district, &batch, priority,
+                                           cursor + priority, &quota);
+        batch.shared[priority] = initial - quota;
+        allowed -= initial - quota;
+        if (!more) goto collected;
+    }
+    for (priority = PIDCC_PRIORITY_STOP + 1; priority < limit; ++priority) {
+        if (allowed <= 0) break;
+        quota = allowed;
+        if (!housedcc_pidcc_collect (district, &batch, priority,
+                                     cursor + priority, &quota))
+            goto collected;
+        allowed = quota;
+    }
+
+collected:
+    if (batch.count > 0) {
+        long long start = housedcc_metrics_clock ();
+        if (housedcc_pidcc_writev (district, batch.vector, batch.count) <= 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                if (district->relay >= 0) {
+                    // The relay is always ready: wait until it signals
+                    // that it made room (see housedcc_pidcc_receive()).
+                    echttp_forget (district->transmit);
+                    district->draining = 0;
+                }
+                return;
+            }
+            housedcc_metrics_count (PiDccMetricWriteErrors, 1);
+            const char *error = strerror(errno);
+            DEBUG ("Pipe write error: %s\n", error);
+            housecapture_record (PiDccCapture,
+                                 district->name, "ERROR", "writev(): %s", error);
+            housedcc_pidcc_clear (district); // The pipe is broken.
+            return;
+        }
+        long long end = housedcc_metrics_clock ();
+        housedcc_metrics_record (PiDccMetricWrite, end - start);
+        int i;
+        for (i = 0; i < batch.count; ++i) {
+            PiDccCommand *command = batch.sent[i];
+            housedcc_metrics_count (PiDccMetricPackets[(int)batch.kind[i]], 1);
+            housedcc_metrics_record (PiDccMetricLatency, end - command->queued);
+            district->submitted += 1;
+            district->inflight[district->submitted & (PIDCC_INFLIGHT_RING - 1)] =
+                command->queued;
+            command->length = 0;
+        }
+        if (district->reporting &&
+            (district->submitted - district->completed == batch.count))
+            housedcc_timer_start (district->reporttimer, PIDCC_REPORT_TIMEOUT);
+
+        // Charge the track bandwidth budget.
+        district->tokens -= batch.count * 1000;
+        if (district->tokens < -PIDCC_BANDWIDTH_BURST * 1000)
+            district->tokens = -PIDCC_BANDWIDTH_BURST * 1000;
+        for (priority = PIDCC_PRIORITY_STOP + 1;
+             priority < PIDCC_PRIORITIES; ++priority) {
+            district->classtokens[priority] -= batch.shared[priority] * 1000;
+        }
+        district->windowpackets += batch.count;
+    }
+
+    // Skip over everything that was sent or superseded.
+    district->queued = 0;
+    for (priority = 0; priority < PIDCC_PRIORITIES; ++priority) {
+        PiDccQueue *queue = district->queues + priority;
+        while (queue->consumer != queue->producer) {
+            PiDccCommand *command =
+                queue->commands + (queue->consumer & (PIDCC_QUEUE_DEPTH - 1));
+            if (command->length > 0) break;
+            queue->consumer += 1;
+        }
+        district->queued += queue->producer - queue->consumer;
+    }
+    housedcc_pidcc_schedule (district);
+}
+
+static void housedcc_pidcc_supersede (PiDccDistrict *district,
+                                      int priority, int key) {
+
+    if (key <= 0) return;
+    int stopall = (key == PIDCC_KEY(PIDCC_KIND_SPEED, 0));
+
+    for (; priority < PIDCC_PRIORITIES; ++priority) {
+        PiDccQueue *queue = district->queues + priority;
+        unsigned int i;
+        for (i = queue->consumer; i != queue->producer; ++i) {
+            PiDccCommand *command =
+                queue->commands + (i & (PIDCC_QUEUE_DEPTH - 1));
+            if (command->length <= 0) continue;
+            if ((command->key == key) ||
+                (stopall && ((command->key >> 16) == PIDCC_KIND_SPEED))) {
+                command->length = 0;
+            }
+        }
+    }
+}
+
+static int housedcc_pidcc_queue (PiDccDistrict *district, int priority,
+                                 int key, const char *text, int length) {
 
-    GpioPinA = pina;
-    GpioPinB = pinb;
+    if ((!housedcc_pidcc_enabled(district)) || (district->transmit <= 0))
+        return 0;
 
-    if (!housedcc_pidcc_enabled()) return; // No configuration.
+    housedcc_pidcc_supersede (district, priority, key);
+
+    PiDccQueue *queue = district->queues + priority;
+    if (queue->producer - queue->consumer >= PIDCC_QUEUE_DEPTH) {
+        housecapture_record (PiDccCapture, district->name,
+                             "OVERFLOW", "%.*s", length - 1, text);
+        housedcc_metrics_count (PiDccMetricQueueFull, 1);
+        return 0;
+    }
+    PiDccCommand *command =
+        queue->commands + (queue->producer & (PIDCC_QUEUE_DEPTH - 1));
+    if (length >= sizeof(command->text)) return 0; // Should never happen.
+    memcpy (command->text, text, length);
+
+    command->key = key;
+    command->length = length;
+    command->queued = housedcc_metrics_clock ();
+    queue->producer += 1;
+    district->queued += 1;
+
+    housedcc_pidcc_schedule (district);
+    return 1;
+}
+
+// Queue a command to the district the address is routed to, or to all
+// districts. The text is a complete line, i.e. it ends with a newline.
+// This fails only if no district accepted the command.
+//
+static int housedcc_pidcc_write (int address, int priority, int key,
+                                 const char *text, int length) {
+
+    int route = ((address > 0) && (address <= PIDCC_ADDRESS_MAX)) ?
+                    PiDccRoutes[address] : 0;
+    if (route > PiDccDistrictsCount) route = 0; // District was removed.
+
+    int i;
+    int submit = 0;
+    for (i = 0; i < PiDccDistrictsCount; ++i) {
+        PiDccDistrict *district = PiDccDistricts + i;
+        if (route && (i != route - 1)) continue;
+        if (housedcc_pidcc_enabled(district) && (district->transmit > 0))
+            submit = 1;
+    }
+    housecapture_record (PiDccCapture, "PIDCC",
+                         submit?"WRITE":"BUILT", "%.*s", length - 1, text);
+    if (!submit) return 0; // No configuration.
+
+    int queued = 0;
+    for (i = 0; i < PiDccDistrictsCount; ++i) {
+        if (route && (i != route - 1)) continue;
+        queued += housedcc_pidcc_queue
+                      (PiDccDistricts + i, priority, key, text, length);
+    }
+    return queued > 0;
+}
+
+// Send the GPIO pins configuration of one district.
+//
+static void housedcc_pidcc_setup (PiDccDistrict *district) {
+
+    if (!housedcc_pidcc_enabled(district)) return; // No configuration.
 
-    // Update the PiDCC configuration.
     char text[256];
-    int l = snprintf (text, sizeof(text), "pin %d %d", GpioPinA, GpioPinB);
-    housedcc_pidcc_write (text, l);
+    int length = snprintf (text, sizeof(text),
+                           "pin %d %d\n", district->pina, district->pinb);
+    housedcc_pidcc_queue (district, PIDCC_PRIORITY_STOP,
+                          PIDCC_KEY(PIDCC_KIND_CONFIG, 0), text, length);
+}
+
+void housedcc_pidcc_config (int pina, int pinb) {
+
+    PiDccDistricts[0].pina = pina;
+    PiDccDistricts[0].pinb = pinb;
+    housedcc_pidcc_setup (PiDccDistricts);
 }
 
+static void housedcc_pidcc_launch (PiDccDistrict *district);
+static void housedcc_pidcc_terminate (PiDccDistrict *district);
+static void housedcc_pidcc_declare (int index);
+
 const char *housedcc_pidcc_reload (void) {
 
     if (! houseconfig_active()) return 0;
 
     // Retrieve the new configuration from the JSON data structure.
+    housedcc_pidcc_bandwidth (houseconfig_integer (0, ".trains.bandwidth"));
     housedcc_pidcc_config (houseconfig_integer (0, ".trains.gpio[0]"),
                            houseconfig_integer (0, ".trains.gpio[1]"));
+
+    // The additional districts. A district keeps its PiDCC process if it
+    // remains at the same position in the list.
+    int count = 1;
+    int districts = houseconfig_array (0, ".trains.districts");
+    int length = (districts > 0) ? houseconfig_array_length (districts) : 0;
+    if (length > 0) {
+        int *list = calloc (length, sizeof(int));
+        length = houseconfig_enumerate (districts, list, length);
+        int i;
+        for (i = 0; i < length; ++i) {
+            int item = list[i];
+            if (item <= 0) continue;
+            const char *name = houseconfig_string (item, ".name");
+            if ((!name) || (!name[0])) continue;
+            if (count >= PIDCC_DISTRICTS_MAX) {
+                houselog_event ("PIDCC", name, "IGNORED", "TOO MANY DISTRICTS");
+                break;
+            }
+            if (count >= PiDccDistrictsCount) housedcc_pidcc_declare (count);
+            PiDccDistrict *district = PiDccDistricts + count;
+            int pina = houseconfig_integer (item, ".gpio[0]");
+            int pinb = houseconfig_integer (item, ".gpio[1]");
+            int changed = (pina != district->pina) || (pinb != district->pinb);
+            strtcpy (district->name, name, sizeof(district->name));
+            district->bandwidth = houseconfig_integer (item, ".bandwidth");
+            district->pina = pina;
+            district->pinb = pinb;
+            count += 1;
+            if (district->process > 0) {
+                if (changed) housedcc_pidcc_setup (district);
+            } else if (housedcc_pidcc_enabled (district)) {
+                housedcc_pidcc_launch (district);
+            }
+        }
+        free (list);
+    }
+    while (PiDccDistrictsCount > count) {
+        housedcc_pidcc_terminate (PiDccDistricts + (--PiDccDistrictsCount));
+    }
+    PiDccDistrictsCount = count;
+
+    // The vehicles are assigned again when the fleet is reloaded.
+    memset (PiDccRoutes, 0, sizeof(PiDccRoutes));
+    return 0;
+}
+
+void housedcc_pidcc_export (DccJson *json, const char *prefix) {
+
+    const PiDccDistrict *main = PiDccDistricts;
+
+    housedcc_json_raw (json, prefix);
+    housedcc_json_raw (json, "\"gpio\":[");
+    housedcc_json_integer (json, main->pina);
+    housedcc_json_raw (json, ",");
+    housedcc_json_integer (json, main->pinb);
+    housedcc_json_raw (json, "]");
+    if (PiDccBandwidth != PIDCC_BANDWIDTH_DEFAULT) {
+        housedcc_json_raw (json, ",\"bandwidth\":");
+        housedcc_json_integer (json, PiDccBandwidth);
+    }
+    if (PiDccDistrictsCount <= 1) return;
+
+    housedcc_json_raw (json, ",\"districts\":[");
+    int i;
+    for (i = 1; i < PiDccDistrictsCount; ++i) {
+        const PiDccDistrict *district = PiDccDistricts + i;
+        if (i > 1) housedcc_json_raw (json, ",");
+        housedcc_json_raw (json, "{\"name\":");
+        housedcc_json_string (json, district->name);
+        housedcc_json_raw (json, ",\"gpio\":[");
+        housedcc_json_integer (json, district->pina);
+        housedcc_json_raw (json, ",");
+        housedcc_json_integer (json, district->pinb);
+        housedcc_json_raw (json, "]");
+        if (district->bandwidth > 0) {
+            housedcc_json_raw (json, ",\"bandwidth\":");
+            housedcc_json_integer (json, district->bandwidth);
+        }
+        housedcc_json_raw (json, "}");
+    }
+    housedcc_json_raw (json, "]");
+}
+
+static void housedcc_pidcc_closed (PiDccDistrict *district) {
+
+    if (district->transmit > 0) {
+        housedcc_pidcc_clear (district);
+        if (district->relay < 0) close (district->transmit);
+        district->transmit = 0;
+    }
+    if (district->listen > 0) {
+        echttp_forget (district->listen);
+        if (district->relay < 0) close (district->listen);
+        district->listen = 0;
+    }
+    if (district->relay >= 0) {
+        housedcc_pipe_close (district->relay); // Closes the pipes too.
+        district->relay = -1;
+    }
+}
+
+static int housedcc_pidcc_deceased (PiDccDistrict *district) {
+
+    if (district->process <= 0) return 1;
+
+    pid_t pid = waitpid (district->process, 0, WNOHANG);
+    if (pid == district->process) {
+        houselog_event ("PIDCC", district->name, "DIED", "");
+        housedcc_metrics_count (PiDccMetricRestarts, 1);
+        district->process = 0;
+        housedcc_pidcc_closed (district);
+        return 1;
+    }
     return 0;
 }
 
-int housedcc_pidcc_export (char *buffer, int size, const char *prefix) {
-    return snprintf (buffer, size,
-                     "%s\"gpio\":[%d,%d]", prefix, GpioPinA, GpioPinB);
+// Stop PiDCC, for good or before restarting it.
+//
+static void housedcc_pidcc_kill (PiDccDistrict *district) {
+    if (district->process <= 0) return;
+    kill (district->process, SIGKILL);
+    waitpid (district->process, 0, 0);
+    district->process = 0;
+}
+
+// A district was removed from the configuration.
+//
+static void housedcc_pidcc_terminate (PiDccDistrict *district) {
+
+    if (district->process > 0) {
+        houselog_event ("PIDCC", district->name, "STOP", "");
+        housedcc_pidcc_kill (district);
+    }
+    housedcc_pidcc_closed (district);
+    housedcc_timer_cancel (district->statetimer);
+    housedcc_timer_cancel (district->reporttimer);
+    housedcc_timer_cancel (district->tokentimer);
+    district->pina = district->pinb = 0;
+    district->launched = 0;
+    district->restarted = 0;
 }
 
-static void housedcc_pidcc_decode (char *line) {
+// PiDCC closed its output: it died, or is about to. Do not wait for the
+// next periodic check to restart it, since the track is now dead.
+//
+static void housedcc_pidcc_lost (PiDccDistrict *district) {
+
+    housecapture_record (PiDccCapture,
+                         district->name, "ERROR", "PiDCC closed its output");
+    if (district->process > 0) {
+        housedcc_pidcc_kill (district);
+        houselog_event ("PIDCC", district->name, "DIED", "");
+        housedcc_metrics_count (PiDccMetricRestarts, 1);
+    }
+    housedcc_pidcc_closed (district);
+    if (time(0) >= district->launched + PIDCC_RESTART_DELAY)
+        housedcc_pidcc_launch (district);
+}
+
+// PiDCC reported how many commands it has processed so far.
+//
+static void housedcc_pidcc_completed (PiDccDistrict *district,
+                                      long long count) {
+
+    if (count > district->submitted) return; // Not for this PiDCC instance?
+
+    if (!district->reporting) {
+        // First report: the commands before it cannot be measured.
+        housecapture_record (PiDccCapture, district->name, "REPORTING", "");
+        district->reporting = 1;
+        district->completed = count;
+    }
+    if (count <= district->completed) return; // Nothing new.
+
+    // The queuing time of old commands may have been overwritten on
+    // a burst: these are not measured.
+    long long now = housedcc_metrics_clock ();
+    long long oldest = district->submitted - PIDCC_INFLIGHT_RING + 1;
+    long long i;
+    for (i = district->completed + 1; i <= count; ++i) {
+        if (i < oldest) continue;
+        housedcc_metrics_record (PiDccMetricTransmit,
+            now - district->inflight[i & (PIDCC_INFLIGHT_RING - 1)]);
+    }
+    housedcc_metrics_count (PiDccMetricCompleted, count - district->completed);
+    district->completed = count;
+    housedcc_timer_start (district->reporttimer, PIDCC_REPORT_TIMEOUT);
+    housedcc_pidcc_schedule (district);
+}
+
+static void housedcc_pidcc_decode (PiDccDistrict *district, char *line) {
+
+    const char *name = district->name;
 
     switch (line[0]) {
     case 0:   return; // Empty line.
     case '#': // PiDCC is idle.
-        housecapture_record (PiDccCapture, "PIDCC", "IDLE", line + 2);
-        PiDccState = line[0];
+        housecapture_record (PiDccCapture, name, "IDLE", line + 2);
+        housedcc_pidcc_state (district, line[0]);
+        housedcc_pidcc_schedule (district);
         break;
     case '%': // PiDCC is busy.
-        housecapture_record (PiDccCapture, "PIDCC", "BUSY", line + 2);
-        PiDccState = line[0];
-        PiDccStateDeadline = time(0) + 3;
+        housecapture_record (PiDccCapture, name, "BUSY", line + 2);
+        housedcc_pidcc_state (district, line[0]);
+        housedcc_timer_start (district->statetimer, PIDCC_STATE_TIMEOUT);
+        housedcc_pidcc_schedule (district);
         break;
     case '*': // The PiDCC queue is full.
-        housecapture_record (PiDccCapture, "PIDCC", "FULL", line + 2);
-        PiDccState = line[0];
-        PiDccStateDeadline = time(0) + 3;
+        housecapture_record (PiDccCapture, name, "FULL", line + 2);
+        housedcc_pidcc_state (district, line[0]);
+        housedcc_timer_start (district->statetimer, PIDCC_STATE_TIMEOUT);
+        housedcc_pidcc_schedule (district);
         break;
     case '!':
-        housecapture_record (PiDccCapture, "PIDCC", "ERROR", line + 2);
+        housecapture_record (PiDccCapture, name, "ERROR", line + 2);
         break;
     case '$':
-        housecapture_record (PiDccCapture, "PIDCC", "DEBUG", line + 2);
+        {
+            time_t now = time(0);
+            if (now != district->debugperiod) {
+                district->debugperiod = now;
+                district->debugsampled = 0;
+            }
+            if (district->debugsampled >= PIDCC_DEBUG_SAMPLES) {
+                district->debugskipped += 1;
+                break;
+            }
+            district->debugsampled += 1;
+            if (district->debugskipped > 0) {
+                housecapture_record (PiDccCapture, name, "DEBUG",
+                                     "%s (%d lines skipped)",
+                                     line + 2, district->debugskipped);
+                district->debugskipped = 0;
+            } else {
+                housecapture_record (PiDccCapture, name, "DEBUG", line + 2);
+            }
+        }
+        break;
+    case '@': // Progress report (extension).
+        housedcc_pidcc_completed (district, atoll (line + 2));
         break;
     }
 }
 
 static void housedcc_pidcc_receive (int fd, int mode) {
 
-    int received = read (PiDccListen,
-                         PiDccBuffer+PiDccBufferProducer,
-                         sizeof(PiDccBuffer)-PiDccBufferProducer-1);
+    PiDccDistrict *district = housedcc_pidcc_find_fd (fd);
+    if (!district) {
+        echttp_forget (fd); // Should never happen.
+        return;
+    }
+    char *buffer = district->buffer;
+
+    // The relay also signals when there is room for more commands.
+    if (district->relay >= 0) housedcc_pidcc_schedule (district);
 
-    if (received <= 0) {
+    int room = sizeof(district->buffer) - district->bufferproducer - 1;
+    if (room <= 0) {
+        // This line is too long to be valid: discard it.
+        district->bufferconsumer = 0;
+        district->bufferscanned = district->bufferproducer = 0;
+        room = sizeof(district->buffer) - 1;
+    }
+    int received =
+        housedcc_pidcc_read (district, buffer + district->bufferproducer, room);
+
+    if (received == 0) {
+        housedcc_pidcc_lost (district);
+        return;
+    }
+    if (received < 0) {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
         const char *error = strerror(errno);
         DEBUG ("Pipe read error: %s\n", error);
-        housecapture_record (PiDccCapture, "PIDCC", "ERROR", "read(): %s", error);
+        housecapture_record (PiDccCapture,
+                             district->name, "ERROR", "read(): %s", error);
         return;
     }
-    PiDccBuffer[PiDccBufferProducer+received] = 0;
-    int i = PiDccBufferProducer;
-    PiDccBufferProducer += received;
-
-    for (i = PiDccBufferConsumer; i < PiDccBufferProducer; ++i) {
-        char c = PiDccBuffer[i];
-        if (c == '\n' || c == '\r') {
-            if (i <= PiDccBufferConsumer) continue; // Ignore empty line.
-            PiDccBuffer[i] = 0;
-            housedcc_pidcc_decode (PiDccBuffer+PiDccBufferConsumer);
-            PiDccBufferConsumer = i + 1;
-            continue;
+    district->bufferproducer += received;
+
+    // Lines end with '\n', any '\r' before it is removed. Empty lines
+    // are ignored by the decoder.
+    //
+    while (district->bufferscanned < district->bufferproducer) {
+        char *start = buffer + district->bufferscanned;
+        char *eol = memchr (start, '\n',
+                            district->bufferproducer - district->bufferscanned);
+        if (!eol) {
+            district->bufferscanned = district->bufferproducer;
+            break;
         }
+        *eol = 0;
+        if ((eol > buffer + district->bufferconsumer) && (eol[-1] == '\r'))
+            eol[-1] = 0;
+        housedcc_pidcc_decode (district, buffer + district->bufferconsumer);
+        district->bufferconsumer = district->bufferscanned =
+            (eol - buffer) + 1;
     }
 
-    if (PiDccBufferConsumer >= PiDccBufferProducer) {
+    if (district->bufferconsumer >= district->bufferproducer) {
 
         // Empty buffer.
-        PiDccBufferConsumer = PiDccBufferProducer = 0;
+        district->bufferconsumer = 0;
+        district->bufferscanned = district->bufferproducer = 0;
 
-    } else if (PiDccBufferProducer >= sizeof(PiDccBuffer) - 128) {
+    } else if (district->bufferproducer >= sizeof(district->buffer) - 128) {
 
-        // Shift all text left to make room for the next data..
+        // Move the incomplete line left to make room for the next data.
         //
-        int length = PiDccBufferProducer - PiDccBufferConsumer;
-        memmove (PiDccBuffer, PiDccBuffer+PiDccBufferConsumer, length);
-        PiDccBufferConsumer = 0;
-        PiDccBufferProducer = length;
+        int length = district->bufferproducer - district->bufferconsumer;
+        memmove (buffer, buffer + district->bufferconsumer, length);
+        district->bufferconsumer = 0;
+        district->bufferscanned = district->bufferproducer = length;
     }
 }
 
-static void housedcc_pidcc_launch (void) {
+static void housedcc_pidcc_launch (PiDccDistrict *district) {
 
     int listen_pipe[2];
     int transmit_pipe[2];
 
+    if (district->launched > 0) district->restarted = 1;
+    district->launched = time(0);
+
     if (pipe (listen_pipe) < 0) return;
-    if (pipe (transmit_pipe) < 0) return;
+    if (pipe (transmit_pipe) < 0) {
+        close (listen_pipe[0]);
+        close (listen_pipe[1]);
+        return;
+    }
 
-    PiDccProcess = fork();
-    if (PiDccProcess < 0) {
+    // This process' ends of the pipes must not be inherited by the PiDCC
+    // processes of the other districts: each PiDCC must see EOF on its
+    // input when this process exits, or closes that pipe.
+    fcntl (transmit_pipe[1], F_SETFD, FD_CLOEXEC);
+    fcntl (listen_pipe[0], F_SETFD, FD_CLOEXEC);
+
+    district->process = fork();
+    if (district->process < 0) {
         DEBUG ("fork() error: %s\n", strerror (errno));
-        houselog_event ("PIDCC", PiDccExecutable, "FAILED",
+        houselog_event ("PIDCC", district->name, "FAILED",
                         "FORK ERROR %s", strerror(errno));
+        district->process = 0;
+        close (listen_pipe[0]);
+        close (listen_pipe[1]);
+        close (transmit_pipe[0]);
+        close (transmit_pipe[1]);
         return;
     }
 
-    if (PiDccProcess == 0) {
+    if (district->process == 0) {
         // This is the child process.
         dup2 (transmit_pipe[0], 0);
         dup2 (listen_pipe[1], 1);
@@ -261,20 +1240,238 @@ static void housedcc_pidcc_launch (void) {
     }
 
     // This is the parent process.
-    houselog_event ("PIDCC", PiDccExecutable, "START", "PID %d", PiDccProcess);
-    PiDccTransmit = transmit_pipe[1];
-    PiDccListen = listen_pipe[0];
-    echttp_listen (PiDccListen, 1, housedcc_pidcc_receive, 1);
+    houselog_event ("PIDCC", district->name, "START",
+                    "PID %d (%s)", district->process, PiDccExecutable);
+    district->transmit = transmit_pipe[1];
+    district->listen = listen_pipe[0];
+    district->bufferconsumer = 0;
+    district->bufferscanned = district->bufferproducer = 0;
+    fcntl (district->transmit, F_SETFL,
+           fcntl (district->transmit, F_GETFL) | O_NONBLOCK);
+
+    // The child's ends of the pipes are not used by this process.
+    close (transmit_pipe[0]);
+    close (listen_pipe[1]);
+
+    district->relay = housedcc_pipe_open (district->transmit, district->listen);
+    if (district->relay >= 0) {
+        district->transmit = housedcc_pipe_output (district->relay);
+        district->listen = housedcc_pipe_input (district->relay);
+    }
+    echttp_listen (district->listen, 1, housedcc_pidcc_receive, 1);
+
+    // The GPIO pins must be configured before anything else: this is
+    // first in the stop queue. (On startup, the configuration is not
+    // loaded yet and will be sent later.)
+    housedcc_pidcc_setup (district);
+}
+
+void housedcc_pidcc_bandwidth (int rate) {
+    if (rate <= 0) rate = PIDCC_BANDWIDTH_DEFAULT;
+    PiDccBandwidth = rate;
+}
+
+int housedcc_pidcc_district (const char *name) {
+
+    if ((!name) || (!name[0])) return 0;
+
+    int i;
+    for (i = 0; i < PiDccDistrictsCount; ++i) {
+        if (!strcmp (PiDccDistricts[i].name, name)) return i + 1;
+    }
+    return -1;
+}
+
+const char *housedcc_pidcc_district_name (int district) {
+    if ((district <= 0) || (district > PiDccDistrictsCount)) return 0;
+    return PiDccDistricts[district-1].name;
+}
+
+int housedcc_pidcc_districts (void) {
+    return PiDccDistrictsCount;
+}
+
+void housedcc_pidcc_assign (int address, int district) {
+    if ((address <= 0) || (address > PIDCC_ADDRESS_MAX)) return;
+    if ((district < 0) || (district > PiDccDistrictsCount)) district = 0;
+    PiDccRoutes[address] = (unsigned char)district;
+}
+
+int housedcc_pidcc_refresh_capacity (int district) {
+
+    int i;
+    int capacity = 0;
+    for (i = 0; i < PiDccDistrictsCount; ++i) {
+        if (district && (i != district - 1)) continue;
+        int rate = housedcc_pidcc_rate (PiDccDistricts + i);
+        int share = (rate * PiDccShares[PIDCC_PRIORITY_REFRESH]) / 100;
+        if ((capacity <= 0) || (share < capacity)) capacity = share;
+    }
+    return (capacity > 0) ? capacity : 1;
+}
+
+int housedcc_pidcc_room (void) {
+
+    // The commands sent to all districts are limited by the busiest one.
+    int i;
+    int room = -1;
+    for (i = 0; i < PiDccDistrictsCount; ++i) {
+        PiDccDistrict *district = PiDccDistricts + i;
+        if ((!housedcc_pidcc_enabled(district)) || (district->transmit <= 0))
+            continue;
+        if (district->state == '*') return 0;
+
+        int available = (PIDCC_QUEUE_DEPTH / 2) - district->queued;
+        if (district->reporting)
+            available -= (int)(district->submitted - district->completed);
+        int tokens = housedcc_pidcc_tokens (district);
+        if (tokens < available) available = tokens;
+        if ((room < 0) || (available < room)) room = available;
+    }
+    return (room > 0) ? room : 0;
+}
+
+int housedcc_pidcc_accessory_room (void) {
+
+    // Accessories are sent to all districts: limited by the fullest one.
+    int i;
+    int room = -1;
+    for (i = 0; i < PiDccDistrictsCount; ++i) {
+        PiDccDistrict *district = PiDccDistricts + i;
+        if ((!housedcc_pidcc_enabled(district)) || (district->transmit <= 0))
+            continue;
+        PiDccQueue *queue = district->queues + PIDCC_PRIORITY_CONTROL;
+        int available =
+            PIDCC_QUEUE_DEPTH - (int)(queue->producer - queue->consumer);
+        if ((room < 0) || (available < room)) room = available;
+    }
+    return (room > 0) ? room : 0;
+}
+
+int housedcc_pidcc_restarted (void) {
+
+    int i;
+    int restarted = 0;
+    for (i = 0; i < PiDccDistrictsCount; ++i) {
+        if (!PiDccDistricts[i].restarted) continue;
+        PiDccDistricts[i].restarted = 0;
+        restarted = 1;
+    }
+    return restarted;
+}
+
+static void housedcc_pidcc_timeout (int context) {
+
+    int index = context >> 4;
+    if (index >= PiDccDistrictsCount) return; // Removed.
+    PiDccDistrict *district = PiDccDistricts + index;
+
+    switch (context & 15) {
+    case PIDCC_TIMER_REPORT:
+        if (district->reporting && (district->submitted > district->completed)) {
+            // Stop pacing: it would block everything but stop commands.
+            district->reporting = 0;
+            housecapture_record (PiDccCapture,
+                                 district->name, "REPORT TIMEOUT", "");
+            housedcc_pidcc_schedule (district);
+        }
+        break;
+    case PIDCC_TIMER_TOKENS:
+        housedcc_pidcc_schedule (district);
+        break;
+    case PIDCC_TIMER_STATE:
+        if (district->state == '*') {
+            housedcc_pidcc_state (district, '#'); // Did we miss something?
+            housecapture_record (PiDccCapture, district->name, "TIMEOUT", "");
+            housedcc_pidcc_schedule (district);
+        }
+        break;
+    }
+}
+
+// Prepare a district entry for use. The timers and metrics are created
+// only once, and kept when the district is removed.
+//
+static void housedcc_pidcc_declare (int index) {
+
+    PiDccDistrict *district = PiDccDistricts + index;
+
+    if (!district->label[0]) {
+        district->relay = -1;
+        district->statetimer = housedcc_timer_declare
+            (housedcc_pidcc_timeout, PIDCC_TIMER(index, PIDCC_TIMER_STATE));
+        district->reporttimer = housedcc_timer_declare
+            (housedcc_pidcc_timeout, PIDCC_TIMER(index, PIDCC_TIMER_REPORT));
+        district->tokentimer = housedcc_timer_declare
+            (housedcc_pidcc_timeout, PIDCC_TIMER(index, PIDCC_TIMER_TOKENS));
+        snprintf (district->label, sizeof(district->label),
+                  "district=\"%d\"", index + 1);
+        district->metricutilization =
+            housedcc_metrics_gauge ("housedcc_pidcc_track_utilization_percent",
+                                    district->label,
+                                    "Share of the track bandwidth used, over the last second.");
+    }
+    district->state = 0;
+    district->statesince = 0;
+    district->tokens = PIDCC_BANDWIDTH_BURST * 1000;
+    district->tokensupdated = 0; // Fill the class budgets on first use.
+    district->windowstart = housedcc_timer_now ();
+    district->windowpackets = 0;
 }
 
 const char *housedcc_pidcc_initialize (int argc, const char **argv) {
 
     PiDccCapture = housecapture_register ("PIDCC");
-    housedcc_pidcc_launch ();
+
+    int i;
+    for (i = 0; i < PIDCC_METRIC_KINDS; ++i) {
+        PiDccMetricPackets[i] =
+            housedcc_metrics_counter ("housedcc_pidcc_packets_total",
+                                      PiDccMetricKinds[i],
+                                      "DCC commands written to PiDCC.");
+    }
+    PiDccMetricWriteErrors =
+        housedcc_metrics_counter ("housedcc_pidcc_write_errors_total", 0,
+                                  "Failed writes to the PiDCC pipe.");
+    PiDccMetricQueueFull =
+        housedcc_metrics_counter ("housedcc_pidcc_queue_full_total", 0,
+                                  "Commands rejected because a queue was full.");
+    PiDccMetricRestarts =
+        housedcc_metrics_counter ("housedcc_pidcc_restarts_total", 0,
+                                  "Number of times PiDCC died.");
+    PiDccMetricBusy =
+        housedcc_metrics_timer ("housedcc_pidcc_state_seconds_total",
+                                "state=\"busy\"",
+                                "Time spent with PiDCC busy or full.");
+    PiDccMetricFull =
+        housedcc_metrics_timer ("housedcc_pidcc_state_seconds_total",
+                                "state=\"full\"",
+                                "Time spent with PiDCC busy or full.");
+    PiDccMetricWrite =
+        housedcc_metrics_histogram ("housedcc_pidcc_write_seconds", 0,
+                                    "Duration of the writes to PiDCC.");
+    PiDccMetricLatency =
+        housedcc_metrics_histogram ("housedcc_pidcc_queue_seconds", 0,
+                                    "Delay from queuing a command to writing it.");
+    PiDccMetricCompleted =
+        housedcc_metrics_counter ("housedcc_pidcc_completed_total", 0,
+                                  "Commands reported as processed by PiDCC.");
+    PiDccMetricTransmit =
+        housedcc_metrics_histogram ("housedcc_pidcc_transmit_seconds", 0,
+                                    "Delay from queuing a command to its transmission.");
+    PiDccMetricSaturated =
+        housedcc_metrics_counter ("housedcc_pidcc_track_saturated_total", 0,
+                                  "Times commands were held back by the track bandwidth.");
+
+    // The main district is launched right away, even if its GPIO pins
+    // are not known yet (see housedcc_pidcc_launch()).
+    housedcc_pidcc_declare (0);
+    strtcpy (PiDccDistricts[0].name, "main", sizeof(PiDccDistricts[0].name));
+    housedcc_pidcc_launch (PiDccDistricts);
     return 0; // No error.
 }
 
-int housedcc_pidcc_move (int address, int speed) {
+int housedcc_pidcc_encode_step (int step, int forward) {
 
     static int speed2cssss[29] = {0,   0x2, 0x12, 0x3, 0x13,  //  0  1  2  3  4
                                   0x4, 0x14, 0x5, 0x15, 0x6,  //  5  6  7  8  9
@@ -283,96 +1480,208 @@ int housedcc_pidcc_move (int address, int speed) {
                                   0x1b, 0xc, 0x1c, 0xd, 0x1d, // 20 21 22 23 24
                                   0xe, 0x1e, 0xf, 0x1f};      // 25 26 27 28
 
-    if ((address <= 0) || (address >= 128)) return 0; // Not supported yet.
-    if (PiDccState == '*') return 0; // Failed.
+    if ((step < 0) || (step > 28)) step = 28; // Over the limit speed.
+    return 0x40 + (forward ? 0x20 : 0) + (speed2cssss[step] & 0x1f);
+}
+
+int housedcc_pidcc_encode_step128 (int step, int forward) {
 
-    char command[32];
-    int dir = (speed >= 0) ? 0x20 : 0;
-    speed = abs(speed);
-    if (speed > 28) return 0; // Over the limit speed.
+    // Step values 0 and 1 mean stop and emergency stop: skip over the latter.
+    if (step < 0) step = 0;
+    if (step > 126) step = 126; // Over the limit speed.
+    if (step > 0) step += 1;
+    return 0x3f00 + (forward ? 0x80 : 0) + step;
+}
+
+// Format the send command for one vehicle (i.e. multi-function decoder).
+// The instruction is one byte, or two bytes when the value does not fit
+// in one (the first byte is in bits 8 to 15). The command ends with a
+// newline, ready to be written to PiDCC.
+//
+static int housedcc_pidcc_format (char *text, int size,
+                                  int address, int instruction) {
+
+    int l;
+    if (address < PIDCC_ADDRESS_SHORT)
+        l = snprintf (text, size, "send %d", address & 0x7f);
+    else
+        l = snprintf (text, size, "send %d %d",
+                      0xc0 + ((address >> 8) & 0x3f), address & 0xff);
+    if (instruction > 0xff)
+        l += snprintf (text+l, size-l, " %d", (instruction >> 8) & 0xff);
+    l += snprintf (text+l, size-l, " %d\n", instruction & 0xff);
+    return l;
+}
+
+static int housedcc_pidcc_valid (int address) {
+    return (address > 0) && (address <= PIDCC_ADDRESS_MAX);
+}
+
+int housedcc_pidcc_encode_speed (DccPacket *packet,
+                                 int address, int instruction) {
+
+    packet->length = 0;
+    if (! housedcc_pidcc_valid (address)) return 0;
+
+    packet->key = PIDCC_KEY(PIDCC_KIND_SPEED, address);
+    packet->length = housedcc_pidcc_format (packet->text, sizeof(packet->text),
+                                            address, instruction);
+    return 1;
+}
+
+int housedcc_pidcc_encode_function (DccPacket *packet,
+                                    int address, int instruction) {
+
+    packet->length = 0;
+    if (! housedcc_pidcc_valid (address)) return 0;
+
+    // Each function group instruction sets the state of the whole group.
+    int group;
+    if (instruction > 0xff) {
+        switch (instruction >> 8) {
+        case 0xde: group = 3; break; // F13 to F20.
+        case 0xdf: group = 4; break; // F21 to F28.
+        default: return 0; // Not a feature expansion instruction.
+        }
+    } else {
+        switch (instruction & 0xf0) {
+        case 0x80: case 0x90: group = 0; break; // FL, F1 to F4.
+        case 0xb0: group = 1; break; // F5 to F8.
+        case 0xa0: group = 2; break; // F9 to F12.
+        default: return 0; // Not a function group instruction.
+        }
+    }
+
+    packet->key = PIDCC_KEY(PIDCC_KIND_FUNCTION+group, address);
+    packet->length = housedcc_pidcc_format (packet->text, sizeof(packet->text),
+                                            address, instruction & 0xffff);
+    return 1;
+}
+
+int housedcc_pidcc_send (const DccPacket *packet) {
+
+    if (packet->length <= 0) return 0;
+
+    int priority = ((packet->key >> 16) == PIDCC_KIND_SPEED) ?
+                       PIDCC_PRIORITY_SPEED : PIDCC_PRIORITY_CONTROL;
+    return housedcc_pidcc_write (packet->key & 0xffff, priority,
+                                 packet->key, packet->text, packet->length);
+}
+
+int housedcc_pidcc_repeat (const DccPacket *packet) {
+
+    if (packet->length <= 0) return 0;
+    return housedcc_pidcc_write (packet->key & 0xffff, PIDCC_PRIORITY_REFRESH,
+                                 packet->key, packet->text, packet->length);
+}
+
+int housedcc_pidcc_speed (int address, int instruction) {
+
+    DccPacket packet;
+    if (! housedcc_pidcc_encode_speed (&packet, address, instruction)) return 0;
+    return housedcc_pidcc_send (&packet);
+}
+
+int housedcc_pidcc_refresh (int address, int instruction) {
+
+    DccPacket packet;
+    if (! housedcc_pidcc_encode_speed (&packet, address, instruction)) return 0;
+    return housedcc_pidcc_repeat (&packet);
+}
 
-    int l = snprintf (command, sizeof(command), "send %d %d",
-                      address & 0x7f,
-                      0x40 + dir + (speed2cssss[speed] & 0x1f));
+int housedcc_pidcc_move (int address, int speed) {
 
-    return housedcc_pidcc_write (command, l);
+    if (abs(speed) > 28) return 0; // Over the limit speed.
+    return housedcc_pidcc_speed
+               (address, housedcc_pidcc_encode_step (abs(speed), speed >= 0));
 }
 
 int housedcc_pidcc_stop (int address, int emergency, int direction) {
 
-    if ((address < 0) || (address >= 128)) return 0; // Not supported yet.
+    // Address 0 is the broadcast address, i.e. all locomotives.
+    if ((address != 0) && (! housedcc_pidcc_valid (address))) return 0;
     // No state check: a stop is a safety command.
 
     // The direction determine which light is on (forward or reverse).
+    // The 28 steps instruction is used for all decoders: they all support
+    // it, whatever speed steps mode they are configured for.
     char command[32];
-    int l = snprintf (command, sizeof(command), "send %d %d",
-                      address & 0x7f,
-                      0x40 + (direction?0x20:0) + (emergency?1:0));
+    int l = housedcc_pidcc_format (command, sizeof(command), address,
+                                   0x40 + (direction?0x20:0) + (emergency?1:0));
 
-    return housedcc_pidcc_write (command, l);
+    return housedcc_pidcc_write (address, PIDCC_PRIORITY_STOP,
+                                 PIDCC_KEY(PIDCC_KIND_SPEED, address),
+                                 command, l);
 }
 
 int housedcc_pidcc_function (int address, int instruction) {
 
-    if (address >= 128) return 0; // Not supported yet.
-    if (PiDccState == '*') return 0; // Failed.
+    DccPacket packet;
+    if (! housedcc_pidcc_encode_function (&packet, address, instruction))
+        return 0;
+    return housedcc_pidcc_send (&packet);
+}
+
+int housedcc_pidcc_consist (int address, int consist, int reverse) {
+
+    if (! housedcc_pidcc_valid (address)) return 0;
+    if ((consist < 0) || (consist >= PIDCC_ADDRESS_SHORT)) return 0;
 
     char command[32];
-    int l = snprintf (command, sizeof(command), "send %d %d",
-                      address & 0x7f, instruction);
-    return housedcc_pidcc_write (command, l);
+    int l = housedcc_pidcc_format (command, sizeof(command), address,
+                                   ((0x12 + (reverse?1:0)) << 8) + consist);
+
+    // This is queued with the highest priority, so that the locomotive
+    // listens to the consist address before the consist's speed commands
+    // are transmitted.
+    return housedcc_pidcc_write (address, PIDCC_PRIORITY_STOP,
+                                 PIDCC_KEY(PIDCC_KIND_CONSIST, address),
+                                 command, l);
 }
 
 int housedcc_pidcc_accessory (int address, int device, int value) {
 
-    if (address >= 512) return 0;
-    if (PiDccState == '*') return 0; // Failed.
+    if ((address < 0) || (address >= 512)) return 0;
 
     value = value ? 0x08 : 0;
-    device &= 0x0f;
+    device &= 0x07;
+
+    // A new command for the same output pair obsoletes the pending one.
+    int key = PIDCC_KEY(PIDCC_KIND_ACCESSORY,
+                        (address << 2) + ((device >> 1) & 3));
 
     char command[32];
-    int l = snprintf (command, sizeof(command), "send %d %d",
+    int l = snprintf (command, sizeof(command), "send %d %d\n",
                       0x80 + (address & 0x3f),
-                      0x80 + (0 ^ ((address & 0x1c0) >> 2)) + value + device);
-    return housedcc_pidcc_write (command, l);
+                      0x80 + (((~address) & 0x1c0) >> 2) + value + device);
+    // Accessories are not assigned to a district: send to all.
+    return housedcc_pidcc_write (0, PIDCC_PRIORITY_CONTROL, key, command, l);
 }
 
-static int housedcc_pidcc_deceased (void) {
+void housedcc_pidcc_periodic (time_t now) {
 
-    if (PiDccProcess <= 0) return 1;
+    long long timestamp = housedcc_timer_now ();
 
-    pid_t pid = waitpid (PiDccProcess, 0, WNOHANG);
-    if (pid == PiDccProcess) {
-        houselog_event ("PIDCC", PiDccExecutable, "DIED", "");
-        PiDccProcess = 0;
-        if (PiDccTransmit > 0) {
-            close (PiDccTransmit);
-            PiDccTransmit = 0;
-        }
-        if (PiDccListen > 0) {
-            echttp_forget (PiDccListen);
-            close (PiDccListen);
-            PiDccListen = 0;
-        }
-        return 1;
-    }
-    return 0;
-}
-
-void housedcc_pidcc_periodic (time_t now) {
+    int i;
+    for (i = 0; i < PiDccDistrictsCount; ++i) {
+        PiDccDistrict *district = PiDccDistricts + i;
 
-    if (PiDccState == '*') {
-        if (PiDccStateDeadline < now) {
-            PiDccState = '#'; // Did we miss something?
-            housecapture_record (PiDccCapture, "PIDCC", "TIMEOUT", "");
+        long long window = timestamp - district->windowstart;
+        if (window >= 1000) {
+            housedcc_metrics_set (district->metricutilization,
+                (district->windowpackets * 100000LL) /
+                    (housedcc_pidcc_rate (district) * window));
+            district->windowstart = timestamp;
+            district->windowpackets = 0;
         }
-    }
-    if (now % 5 == 0) {
-        if (housedcc_pidcc_deceased()) {
-            housecapture_record (PiDccCapture, "PIDCC", "ERROR", "PiDCC died");
-            housedcc_pidcc_launch();
+
+        if ((i > 0) && (!housedcc_pidcc_enabled (district))) continue;
+        if (housedcc_pidcc_deceased (district)) {
+            if (now >= district->launched + PIDCC_RESTART_DELAY) {
+                housecapture_record (PiDccCapture,
+                                     district->name, "ERROR", "PiDCC died");
+                housedcc_pidcc_launch (district);
+            }
         }
     }
 }
-
@@ -20,16 +20,48 @@
  *
  * housedcc_pidcc.h - Interact with a PiDCC subprocess.
  */
+
+// A DCC command, encoded and ready to be sent to PiDCC.
+typedef struct {
+    int key;
+    short length; // 0 if not encoded.
+    char text[26];
+} DccPacket;
+
 const char *housedcc_pidcc_initialize (int argc, const char **argv);
 void housedcc_pidcc_config (int pina, int pinb);
 const char *housedcc_pidcc_reload (void);
-int housedcc_pidcc_export (char *buffer, int size, const char *prefix);
+void housedcc_pidcc_export (DccJson *json, const char *prefix);
 
 int housedcc_pidcc_move (int address, int speed);
+int housedcc_pidcc_encode_step (int step, int forward);
+int housedcc_pidcc_encode_step128 (int step, int forward);
+int housedcc_pidcc_speed (int address, int instruction);
+int housedcc_pidcc_refresh (int address, int instruction);
 int housedcc_pidcc_stop (int address, int emergency, int direction);
 int housedcc_pidcc_function (int address, int instruction);
 
+int housedcc_pidcc_encode_speed (DccPacket *packet,
+                                 int address, int instruction);
+int housedcc_pidcc_encode_function (DccPacket *packet,
+                                    int address, int instruction);
+int housedcc_pidcc_send (const DccPacket *packet);
+int housedcc_pidcc_repeat (const DccPacket *packet);
+
+int housedcc_pidcc_consist (int address, int consist, int reverse);
 int housedcc_pidcc_accessory (int address, int device, int value);
 
+void housedcc_pidcc_bandwidth (int rate);
+int housedcc_pidcc_refresh_capacity (int district);
+
+int housedcc_pidcc_district (const char *name);
+const char *housedcc_pidcc_district_name (int district);
+int housedcc_pidcc_districts (void);
+void housedcc_pidcc_assign (int address, int district);
+
+int housedcc_pidcc_room (void);
+int housedcc_pidcc_accessory_room (void);
+int housedcc_pidcc_restarted (void);
+
 void housedcc_pidcc_periodic (time_t now);
 
@@ -0,0 +1,464 @@
+/* HouseDCC - A model train control service
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedcc_pipe.c - Relay the PiDCC pipes from a real-time thread.
+ *
+ * SYNOPSYS:
+ *
+ * Everything in HouseDCC runs from the echttp loop, including the I/O
+ * with PiDCC: a long HTTP request, a large export or a depot update
+ * delays the writes to PiDCC, and the reading of its reports, by as much.
+ *
+ * When the -dcc-realtime option is present, this module starts a thread,
+ * at a real-time priority if the system allows it, that does all the I/O
+ * on the PiDCC pipes. The echttp loop exchanges data with that thread
+ * through two lock-free rings per PiDCC process (one producer and one
+ * consumer each): the commands to write, and the PiDCC output. A command
+ * handed to this thread reaches PiDCC without waiting for the echttp loop,
+ * and PiDCC's reports are read as they come, even if the echttp loop is
+ * busy. Each ring side signals the other using an eventfd.
+ *
+ * The command queues, the track bandwidth budget, the decoding of the
+ * PiDCC reports and all the state of the fleet remain in the echttp loop:
+ * this thread only moves bytes, and never calls any other module.
+ *
+ * const char *housedcc_pipe_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module, and start the relay thread if the option
+ *    is present. Return 0 on success, an error text otherwise.
+ *
+ * int housedcc_pipe_enabled (void);
+ *
+ *    Return 1 if the relay thread is running, 0 otherwise.
+ *
+ * int housedcc_pipe_open (int transmit, int listen);
+ *
+ *    Hand over the PiDCC pipes to the relay thread. Return a channel
+ *    number, or -1 if the pipes must be used directly. The pipes belong to
+ *    this module until the channel is closed.
+ *
+ * int housedcc_pipe_output (int channel);
+ * int housedcc_pipe_input (int channel);
+ *
+ *    Return the file descriptors to listen to, in place of the pipes. The
+ *    output descriptor is always ready for writing, so that listening for
+ *    write readiness means: as soon as the echttp loop regains control. The
+ *    input descriptor becomes readable when PiDCC output was received, when
+ *    PiDCC closed its output, or when room was made after a write failed.
+ *
+ * int housedcc_pipe_writev (int channel, const struct iovec *vector, int count);
+ *
+ *    Queue data to write to PiDCC. This is all or nothing: return the
+ *    total length, or -1 with errno set to EAGAIN if there is no room for
+ *    all of it.
+ *
+ * int housedcc_pipe_read (int channel, char *buffer, int size);
+ *
+ *    Retrieve the data received from PiDCC, with the same return value
+ *    as read(): 0 means that PiDCC closed its output, -1 with errno set
+ *    to EAGAIN means that there is no data available right now.
+ *
+ * void housedcc_pipe_close (int channel);
+ *
+ *    Stop using a channel, and close the PiDCC pipes.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+
+#include "housedcc_pipe.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define PIPE_CHANNELS_MAX 8
+#define PIPE_RING_SIZE    4096 // Must be a power of 2.
+
+#define PIPE_PRIORITY 10 // SCHED_FIFO priority of the relay thread.
+
+// The producer and consumer are free running counters. Only the producer
+// side writes the producer, only the consumer side writes the consumer.
+//
+typedef struct {
+    atomic_uint producer;
+    atomic_uint consumer;
+    char data[PIPE_RING_SIZE];
+} DccPipeRing;
+
+typedef struct {
+    int used;     // Changed only while holding PipeLock.
+    int transmit; // PiDCC input, written by the relay thread.
+    int listen;   // PiDCC output, read by the relay thread.
+    int output;   // eventfd: new data for the relay thread.
+    int input;    // eventfd: new data (or room) for the echttp loop.
+    atomic_int closed;  // PiDCC closed its output.
+    atomic_int waiting; // The echttp loop is waiting for room.
+    DccPipeRing outbound;
+    DccPipeRing inbound;
+} DccPipeChannel;
+
+static DccPipeChannel PipeChannels[PIPE_CHANNELS_MAX];
+
+// The lock protects the channels list only: the relay thread holds it
+// while it accesses the pipes, so that a channel is never closed under
+// its feet. The data itself goes through the rings, without locking.
+//
+static pthread_mutex_t PipeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t PipeThread;
+static int PipeRunning = 0;
+static int PipeWakeup = -1; // eventfd: the list of channels changed.
+
+static void housedcc_pipe_signal (int fd) {
+    uint64_t one = 1;
+    if (write (fd, &one, sizeof(one)) < 0) return; // Already signaled.
+}
+
+static void housedcc_pipe_clear (int fd) {
+    uint64_t count;
+    if (read (fd, &count, sizeof(count)) < 0) return; // Not signaled.
+}
+
+static unsigned int housedcc_pipe_used (DccPipeRing *ring) {
+    return atomic_load_explicit (&ring->producer, memory_order_acquire) -
+           atomic_load_explicit (&ring->consumer, memory_order_acquire);
+}
+
+// Write as much of the outbound data as the pipe accepts.
+//
+static void housedcc_pipe_transmit (DccPipeChannel *channel) {
+
+    DccPipeRing *ring = &channel->outbound;
+    unsigned int consumer =
+        atomic_load_explicit (&ring->consumer, memory_order_relaxed);
+    unsigned int producer =
+        atomic_load_explicit (&ring->producer, memory_order_acquire);
+    if (consumer == producer) return; // Nothing to write.
+
+    while (consumer != producer) {
+        unsigned int offset = consumer & (PIPE_RING_SIZE - 1);
+        unsigned int length = producer - consumer;
+        if (length > PIPE_RING_SIZE - offset) length = PIPE_RING_SIZE - offset;
+        int written = write (channel->transmit, ring->data + offset, length);
+        if (written <= 0) {
+            if ((written < 0) && (errno == EAGAIN)) break; // Pipe is full.
+            consumer = producer; // Broken pipe: PiDCC is gone.
+            break;
+        }
+        consumer += written;
+    }
+    // Sequentially consistent, to pair with housedcc_pipe_writev().
+    atomic_store (&ring->consumer, consumer);
+
+    if (atomic_exchange (&channel->waiting, 0))
+        housedcc_pipe_signal (channel->input);
+}
+
+// Read whatever PiDCC has sent, as much as the inbound ring can take.
+//
+static void housedcc_pipe_receive (DccPipeChannel *channel) {
+
+    if (atomic_load (&channel->closed)) return;
+
+    DccPipeRing *ring = &channel->inbound;
+    unsigned int producer =
+        atomic_load_explicit (&ring->producer, memory_order_relaxed);
+    unsigned int consumer =
+        atomic_load_explicit (&ring->consumer, memory_order_acquire);
+
+    unsigned int room = PIPE_RING_SIZE - (producer - consumer);
+    if (room == 0) return; // Wait for the echttp loop to catch up.
+
+    unsigned int offset = producer & (PIPE_RING_SIZE - 1);
+    if (room > PIPE_RING_SIZE - offset) room = PIPE_RING_SIZE - offset;
+
+    int received = read (channel->listen, ring->data + offset, room);
+    if (received < 0) return; // Nothing yet (EAGAIN), or retry later.
+    if (received == 0) {
+        atomic_store (&channel->closed, 1);
+    } else {
+        atomic_store_explicit
+            (&ring->producer, producer + received, memory_order_release);
+    }
+    housedcc_pipe_signal (channel->input);
+}
+
+static void *housedcc_pipe_relay (void *context) {
+
+    struct pollfd fds[1 + (3 * PIPE_CHANNELS_MAX)];
+
+    for (;;) {
+        int count = 0;
+        fds[count].fd = PipeWakeup;
+        fds[count++].events = POLLIN;
+
+        pthread_mutex_lock (&PipeLock);
+        int i;
+        for (i = 0; i < PIPE_CHANNELS_MAX; ++i) {
+            DccPipeChannel *channel = PipeChannels + i;
+            if (!channel->used) continue;
+            fds[count].fd = channel->output;
+            fds[count++].events = POLLIN;
+            if ((!atomic_load (&channel->closed)) &&
+                (housedcc_pipe_used (&channel->inbound) < PIPE_RING_SIZE)) {
+                fds[count].fd = channel->listen;
+                fds[count++].events = POLLIN;
+            }
+            if (housedcc_pipe_used (&channel->outbound) > 0) {
+                fds[count].fd = channel->transmit;
+                fds[count++].events = POLLOUT;
+            }
+        }
+        pthread_mutex_unlock (&PipeLock);
+
+        // While the inbound ring is full, the echttp loop signals this
+        // thread (through the wakeup) when it has made room.
+        if (poll (fds, count, -1) < 0) {
+            if (errno == EINTR) continue;
+            break; // Should never happen.
+        }
+
+        pthread_mutex_lock (&PipeLock);
+        housedcc_pipe_clear (PipeWakeup);
+        for (i = 0; i < PIPE_CHANNELS_MAX; ++i) {
+            DccPipeChannel *channel = PipeChannels + i;
+            if (!channel->used) continue;
+            housedcc_pipe_clear (channel->output);
+            housedcc_pipe_transmit (channel);
+            housedcc_pipe_receive (channel);
+        }
+        pthread_mutex_unlock (&PipeLock);
+    }
+    return 0;
+}
+
+int housedcc_pipe_enabled (void) {
+    return PipeRunning;
+}
+
+int housedcc_pipe_open (int transmit, int listen) {
+
+    if (!PipeRunning) return -1;
+
+    int i;
+    for (i = 0; i < PIPE_CHANNELS_MAX; ++i) {
+        if (!PipeChannels[i].used) break;
+    }
+    if (i >= PIPE_CHANNELS_MAX) return -1;
+
+    DccPipeChannel *channel = PipeChannels + i;
+    channel->output = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    channel->input = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ((channel->output < 0) || (channel->input < 0)) {
+        if (channel->output >= 0) close (channel->output);
+        if (channel->input >= 0) close (channel->input);
+        return -1;
+    }
+    fcntl (transmit, F_SETFL, fcntl (transmit, F_GETFL) | O_NONBLOCK);
+    fcntl (listen, F_SETFL, fcntl (listen, F_GETFL) | O_NONBLOCK);
+
+    channel->transmit = transmit;
+    channel->listen = listen;
+    atomic_store (&channel->outbound.producer, 0);
+    atomic_store (&channel->outbound.consumer, 0);
+    atomic_store (&channel->inbound.producer, 0);
+    atomic_store (&channel->inbound.consumer, 0);
+    atomic_store (&channel->closed, 0);
+    atomic_store (&channel->waiting, 0);
+
+    pthread_mutex_lock (&PipeLock);
+    channel->used = 1;
+    pthread_mutex_unlock (&PipeLock);
+    housedcc_pipe_signal (PipeWakeup);
+    return i;
+}
+
+static DccPipeChannel *housedcc_pipe_channel (int channel) {
+    if ((channel < 0) || (channel >= PIPE_CHANNELS_MAX)) return 0;
+    if (!PipeChannels[channel].used) return 0;
+    return PipeChannels + channel;
+}
+
+int housedcc_pipe_output (int channel) {
+    DccPipeChannel *c = housedcc_pipe_channel (channel);
+    return c ? c->output : -1;
+}
+
+int housedcc_pipe_input (int channel) {
+    DccPipeChannel *c = housedcc_pipe_channel (channel);
+    return c ? c->input : -1;
+}
+
+int housedcc_pipe_writev (int channel, const struct iovec *vector, int count) {
+
+    DccPipeChannel *c = housedcc_pipe_channel (channel);
+    if (!c) {
+        errno = EPIPE;
+        return -1;
+    }
+    DccPipeRing *ring = &c->outbound;
+
+    int i;
+    unsigned int total = 0;
+    for (i = 0; i < count; ++i) total += vector[i].iov_len;
+
+    unsigned int producer =
+        atomic_load_explicit (&ring->producer, memory_order_relaxed);
+    unsigned int consumer =
+        atomic_load_explicit (&ring->consumer, memory_order_acquire);
+    if (total > PIPE_RING_SIZE - (producer - consumer)) {
+        atomic_store (&c->waiting, 1);
+        // The relay thread may have made room in the meantime.
+        consumer = atomic_load (&ring->consumer);
+        if (total > PIPE_RING_SIZE - (producer - consumer)) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+
+    for (i = 0; i < count; ++i) {
+        const char *data = vector[i].iov_base;
+        unsigned int length = vector[i].iov_len;
+        while (length > 0) {
+            unsigned int offset = producer & (PIPE_RING_SIZE - 1);
+            unsigned int chunk = PIPE_RING_SIZE - offset;
+            if (chunk > length) chunk = length;
+            memcpy (ring->data + offset, data, chunk);
+            data += chunk;
+            length -= chunk;
+            producer += chunk;
+        }
+    }
+    atomic_store_explicit (&ring->producer, producer, memory_order_release);
+    housedcc_pipe_signal (c->output);
+    return (int)total;
+}
+
+int housedcc_pipe_read (int channel, char *buffer, int size) {
+
+    DccPipeChannel *c = housedcc_pipe_channel (channel);
+    if (!c) return 0;
+    DccPipeRing *ring = &c->inbound;
+
+    // Clear the signal first: any data received after this point signals
+    // again.
+    housedcc_pipe_clear (c->input);
+
+    unsigned int consumer =
+        atomic_load_explicit (&ring->consumer, memory_order_relaxed);
+    unsigned int producer =
+        atomic_load_explicit (&ring->producer, memory_order_acquire);
+    unsigned int available = producer - consumer;
+
+    if (available == 0) {
+        if (atomic_load (&c->closed)) return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+    int full = (available >= PIPE_RING_SIZE);
+
+    int length = 0;
+    while ((available > 0) && (length < size)) {
+        unsigned int offset = consumer & (PIPE_RING_SIZE - 1);
+        unsigned int chunk = PIPE_RING_SIZE - offset;
+        if (chunk > available) chunk = available;
+        if (chunk > size - length) chunk = size - length;
+        memcpy (buffer + length, ring->data + offset, chunk);
+        length += chunk;
+        consumer += chunk;
+        available -= chunk;
+    }
+    atomic_store_explicit (&ring->consumer, consumer, memory_order_release);
+
+    if (available > 0) housedcc_pipe_signal (c->input); // Come back for more.
+    if (full) housedcc_pipe_signal (PipeWakeup); // There is room again.
+    return length;
+}
+
+void housedcc_pipe_close (int channel) {
+
+    DccPipeChannel *c = housedcc_pipe_channel (channel);
+    if (!c) return;
+
+    // Once the lock is obtained, the relay thread no longer uses this
+    // channel's descriptors.
+    pthread_mutex_lock (&PipeLock);
+    c->used = 0;
+    close (c->transmit);
+    close (c->listen);
+    close (c->output);
+    close (c->input);
+    c->transmit = c->listen = c->output = c->input = -1;
+    pthread_mutex_unlock (&PipeLock);
+    housedcc_pipe_signal (PipeWakeup);
+}
+
+const char *housedcc_pipe_initialize (int argc, const char **argv) {
+
+    int i;
+    int realtime = 0;
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_present ("-dcc-realtime", argv[i])) realtime = 1;
+    }
+    if (!realtime) return 0; // The pipes are used from the echttp loop.
+
+    PipeWakeup = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (PipeWakeup < 0) return "cannot create the relay thread eventfd";
+
+    // Try a real-time priority first, since this is the point. This
+    // requires privileges that the service may not have.
+    pthread_attr_t attributes;
+    struct sched_param parameters;
+    pthread_attr_init (&attributes);
+    pthread_attr_setinheritsched (&attributes, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy (&attributes, SCHED_FIFO);
+    parameters.sched_priority = PIPE_PRIORITY;
+    pthread_attr_setschedparam (&attributes, &parameters);
+    int error = pthread_create (&PipeThread, &attributes,
+                                housedcc_pipe_relay, 0);
+    pthread_attr_destroy (&attributes);
+    if (error == EPERM) {
+        houselog_event ("SERVICE", "PIPE", "WARNING",
+                        "NO REAL-TIME PRIORITY ALLOWED");
+        error = pthread_create (&PipeThread, 0, housedcc_pipe_relay, 0);
+    }
+    if (error) {
+        DEBUG ("pthread_create() error: %s\n", strerror (error));
+        close (PipeWakeup);
+        PipeWakeup = -1;
+        return "cannot start the relay thread";
+    }
+    PipeRunning = 1;
+    houselog_event ("SERVICE", "PIPE", "STARTED", "RELAY THREAD");
+    return 0;
+}
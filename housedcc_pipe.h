@@ -0,0 +1,33 @@
+/* HouseDCC - A model train control service
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedcc_pipe.h - Relay the PiDCC pipes from a real-time thread.
+ */
+const char *housedcc_pipe_initialize (int argc, const char **argv);
+int  housedcc_pipe_enabled (void);
+
+int  housedcc_pipe_open (int transmit, int listen);
+int  housedcc_pipe_output (int channel);
+int  housedcc_pipe_input (int channel);
+
+int  housedcc_pipe_writev (int channel, const struct iovec *vector, int count);
+int  housedcc_pipe_read (int channel, char *buffer, int size);
+
+void housedcc_pipe_close (int channel);
@@ -0,0 +1,441 @@
+/* HouseDCC - A model train control service
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ *
+ * housedcc_throttle.c - A low latency command input for handheld throttles.
+ *
+ * SYNOPSYS:
+ *
+ * Handheld throttles send speed updates at a high rate (10 to 20 per
+ * second) while the operator turns the knob. Going through the HTTP
+ * server for each update costs a TCP exchange, the parsing of the URI
+ * parameters and a status response that the throttle ignores.
+ *
+ * This module listens on a UDP port (option -dcc-throttle=PORT). Each
+ * datagram contains one or more text commands, one per line, with the
+ * words separated by spaces:
+ *
+ *    M ID SPEED          Move a vehicle or consist (see housedcc_fleet_move).
+ *    S [ID]              Stop a vehicle or consist, or all if no ID.
+ *    E [ID]              Emergency stop a vehicle or consist, or all.
+ *    F ID DEVICE on|off  Set a vehicle's device (see housedcc_fleet_set).
+ *    R                   Do nothing (keep the session alive).
+ *    Q                   Stop the vehicles of this session and end it
+ *                        (the rest of the datagram is ignored).
+ *
+ * The commands are not acknowledged, unless the line starts with a tag
+ * word that begins with '#': the tag is then repeated in a response
+ * datagram, followed by "OK" or by "ERROR" and a reason.
+ *
+ * Each sender (IP address and port) is a session, which starts with the
+ * first valid command received from that sender. A session keeps the
+ * list of the vehicles and consists that it moved, and any datagram
+ * received from that session renews their leases: a throttle does not
+ * need to renew each vehicle, only to send something (an R command if
+ * nothing else) more often than the lease duration. When a throttle
+ * goes silent, its vehicles stop on lease expiry as usual.
+ *
+ * const char *housedcc_throttle_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module. Return 0 on success, an error text otherwise.
+ *
+ * int housedcc_throttle_port (void);
+ *
+ *    Return the UDP port of the throttle input, 0 if disabled.
+ *
+ * int housedcc_throttle_background (time_t now);
+ *
+ *    The periodic function that ends the inactive sessions. This returns
+ *    1 if the live state changed since the previous call, 0 otherwise.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <echttp.h>
+#include "echttp_libc.h"
+
+#include "houselog.h"
+#include "housecapture.h"
+
+#include "housedcc_json.h"
+#include "housedcc_metrics.h"
+#include "housedcc_timer.h"
+#include "housedcc_event.h"
+#include "housedcc_pidcc.h"
+#include "housedcc_fleet.h"
+#include "housedcc_consist.h"
+#include "housedcc_throttle.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define THROTTLE_SESSIONS_MAX 16
+#define THROTTLE_CONTROLLED   8    // Vehicles or consists per session.
+#define THROTTLE_RENEW        1000 // Milliseconds between two renewals.
+#define THROTTLE_DATAGRAMS    16   // Maximum datagrams read at once.
+
+typedef struct {
+    struct sockaddr_in peer;
+    char name[16];          // Printable IP address, for the event log.
+    char open;              // Listed in the session table.
+    long long seen;         // Latest datagram received (ms), 0 if free.
+    long long renewed;      // Latest lease renewal (ms).
+    char controlled[THROTTLE_CONTROLLED][16];
+} DccThrottleSession;
+
+static DccThrottleSession ThrottleSessions[THROTTLE_SESSIONS_MAX];
+
+static int ThrottlePort = 0;
+static int ThrottleSocket = -1;
+
+static int ThrottleLiveChanged = 0;
+
+static int ThrottleCapture = -1;
+
+static int ThrottleMetricOk = -1;
+static int ThrottleMetricError = -1;
+static int ThrottleMetricLatency = -1;
+
+static DccThrottleSession *housedcc_throttle_find
+                              (const struct sockaddr_in *peer) {
+    int i;
+    for (i = 0; i < THROTTLE_SESSIONS_MAX; ++i) {
+        DccThrottleSession *session = ThrottleSessions + i;
+        if ((session->seen > 0) &&
+            (session->peer.sin_addr.s_addr == peer->sin_addr.s_addr) &&
+            (session->peer.sin_port == peer->sin_port)) return session;
+    }
+    return 0;
+}
+
+// A datagram from an unknown sender is handled using a temporary session,
+// which only gets a slot in the session table if it contained at least
+// one valid command. This way random traffic does not evict the sessions
+// of the actual throttles, or fill the event log.
+//
+static void housedcc_throttle_prepare (DccThrottleSession *session,
+                                       const struct sockaddr_in *peer,
+                                       long long now) {
+    memset (session, 0, sizeof(DccThrottleSession));
+    session->peer = *peer;
+    inet_ntop (AF_INET, &(peer->sin_addr),
+               session->name, sizeof(session->name));
+    session->seen = now;
+    session->renewed = now;
+}
+
+static DccThrottleSession *housedcc_throttle_open
+                              (const DccThrottleSession *candidate) {
+    int i;
+    DccThrottleSession *oldest = ThrottleSessions;
+    for (i = 1; i < THROTTLE_SESSIONS_MAX; ++i) {
+        if (ThrottleSessions[i].seen < oldest->seen)
+            oldest = ThrottleSessions + i;
+    }
+
+    // When all slots are in use, the least recently seen session is
+    // reused: its vehicles then depend on their leases only.
+    if (oldest->seen > 0)
+        housedcc_event_record ("THROTTLE", oldest->name, "DROPPED",
+                               "PORT %d (TOO MANY SESSIONS)",
+                               ntohs(oldest->peer.sin_port));
+    *oldest = *candidate;
+    oldest->open = 1;
+    housedcc_event_record ("THROTTLE", oldest->name, "CONNECTED",
+                           "PORT %d", ntohs(oldest->peer.sin_port));
+    return oldest;
+}
+
+static void housedcc_throttle_control (DccThrottleSession *session,
+                                       const char *id) {
+    int i;
+    int free = -1;
+    for (i = 0; i < THROTTLE_CONTROLLED; ++i) {
+        if (!strcmp (session->controlled[i], id)) return;
+        if ((free < 0) && (!session->controlled[i][0])) free = i;
+    }
+    if (free < 0) return; // Lease renewed by the throttle only.
+    strtcpy (session->controlled[free], id, sizeof(session->controlled[0]));
+}
+
+static void housedcc_throttle_renew (DccThrottleSession *session) {
+
+    int i;
+    for (i = 0; i < THROTTLE_CONTROLLED; ++i) {
+        const char *id = session->controlled[i];
+        if (!id[0]) continue;
+        if (housedcc_consist_renew (id)) continue;
+        if (housedcc_fleet_renew (id)) continue;
+        session->controlled[i][0] = 0; // Stopped, or deleted.
+    }
+}
+
+static void housedcc_throttle_release (DccThrottleSession *session) {
+
+    int i;
+    for (i = 0; i < THROTTLE_CONTROLLED; ++i) {
+        const char *id = session->controlled[i];
+        if (!id[0]) continue;
+        if (! housedcc_consist_stop (id, 0)) housedcc_fleet_stop (id, 0);
+        ThrottleLiveChanged = 1;
+    }
+    if (session->open)
+        housedcc_event_record ("THROTTLE", session->name, "DISCONNECTED",
+                               "PORT %d", ntohs(session->peer.sin_port));
+    session->seen = 0;
+    session->open = 0;
+}
+
+static const char *housedcc_throttle_stop (const char *id, int emergency) {
+
+    if (!id) {
+        if (! housedcc_pidcc_stop (0, emergency, 1)) return "DCC failure";
+        housedcc_fleet_stopped (emergency);
+        housedcc_consist_stopped ();
+        return 0;
+    }
+    if (housedcc_consist_stop (id, emergency)) return 0;
+    if (housedcc_fleet_stop (id, emergency)) return 0;
+    return "invalid ID";
+}
+
+// Execute one command. Return 0 on success, an error text otherwise.
+//
+static const char *housedcc_throttle_execute (DccThrottleSession *session,
+                                              int count, char **words) {
+
+    switch (words[0][0]) {
+
+    case 'M':
+        if (count < 3) return "missing speed value";
+        if (! housedcc_consist_move (words[1], atoi(words[2]))) {
+            if (! housedcc_fleet_move (words[1], atoi(words[2])))
+                return "invalid ID";
+        }
+        housedcc_throttle_control (session, words[1]);
+        return 0;
+
+    case 'S':
+    case 'E':
+        return housedcc_throttle_stop ((count > 1) ? words[1] : 0,
+                                       words[0][0] == 'E');
+
+    case 'F':
+        if (count < 4) return "missing device or state";
+        if (!strcmp (words[3], "on")) {
+            if (housedcc_fleet_set (words[1], words[2], 1)) return 0;
+        } else if (!strcmp (words[3], "off")) {
+            if (housedcc_fleet_set (words[1], words[2], 0)) return 0;
+        } else {
+            return "invalid state";
+        }
+        return "invalid ID or device";
+
+    case 'R':
+        return 0;
+
+    case 'Q':
+        housedcc_throttle_release (session);
+        return 0;
+    }
+    return "unknown command";
+}
+
+// Execute all the commands from one datagram. The responses (if any)
+// are accumulated in the reply buffer. The count of valid commands (not
+// counting Q) is returned in accepted.
+//
+static int housedcc_throttle_datagram (DccThrottleSession *session,
+                                       char *data, char *reply, int size,
+                                       int *accepted) {
+    int length = 0;
+    *accepted = 0;
+    char *line = data;
+
+    while (line) {
+        char *next = strchr (line, '\n');
+        if (next) *(next++) = 0;
+
+        char *words[5];
+        int count = 0;
+        char *cursor = line;
+        while (count < 5) {
+            while ((*cursor == ' ') || (*cursor == '\r')) *(cursor++) = 0;
+            if (!*cursor) break;
+            words[count++] = cursor;
+            while (*cursor && (*cursor != ' ') && (*cursor != '\r')) cursor++;
+        }
+        line = next;
+
+        const char *tag = 0;
+        char **command = words;
+        if ((count > 0) && (words[0][0] == '#')) {
+            tag = words[0];
+            command += 1;
+            count -= 1;
+        }
+        if (count <= 0) continue;
+
+        housecapture_record (ThrottleCapture, session->name, command[0],
+                             "%s %s", (count > 1) ? command[1] : "",
+                             (count > 2) ? command[2] : "");
+
+        int active = (session->seen > 0);
+        const char *error = housedcc_throttle_execute (session, count, command);
+        if (error) {
+            housedcc_metrics_count (ThrottleMetricError, 1);
+            DEBUG ("Throttle %s: %s\n", session->name, error);
+        } else {
+            housedcc_metrics_count (ThrottleMetricOk, 1);
+            if (command[0][0] != 'Q') *accepted += 1;
+            if (command[0][0] != 'R') ThrottleLiveChanged = 1;
+        }
+        if (tag && (length < size)) {
+            length += snprintf (reply + length, size - length, "%s %s%s\n",
+                                tag, error ? "ERROR " : "OK",
+                                error ? error : "");
+        }
+        if (active && (session->seen <= 0)) break; // Session ended.
+    }
+    return (length < size) ? length : size - 1;
+}
+
+static void housedcc_throttle_receive (int fd, int mode) {
+
+    int i;
+    for (i = 0; i < THROTTLE_DATAGRAMS; ++i) {
+
+        char data[1500];
+        struct sockaddr_in peer;
+        socklen_t peerlength = sizeof(peer);
+        int length = recvfrom (fd, data, sizeof(data)-1, 0,
+                               (struct sockaddr *)&peer, &peerlength);
+        if (length <= 0) return; // EAGAIN, or a transient error.
+        data[length] = 0;
+
+        long long start = housedcc_metrics_clock ();
+        long long now = housedcc_timer_now ();
+        DccThrottleSession candidate;
+        DccThrottleSession *session = housedcc_throttle_find (&peer);
+        if (!session) {
+            housedcc_throttle_prepare (&candidate, &peer, now);
+            session = &candidate;
+        }
+        session->seen = now;
+
+        char reply[1500];
+        int accepted;
+        int replylength = housedcc_throttle_datagram
+                              (session, data, reply, sizeof(reply), &accepted);
+        if ((session == &candidate) && (session->seen > 0) && accepted)
+            session = housedcc_throttle_open (&candidate);
+
+        if ((session->seen > 0) && (now >= session->renewed + THROTTLE_RENEW)) {
+            housedcc_throttle_renew (session);
+            session->renewed = now;
+        }
+        if (replylength > 0)
+            sendto (fd, reply, replylength, 0,
+                    (struct sockaddr *)&peer, peerlength);
+        housedcc_metrics_since (ThrottleMetricLatency, start);
+    }
+}
+
+const char *housedcc_throttle_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *value;
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-dcc-throttle=", argv[i], &value))
+            ThrottlePort = atoi(value);
+    }
+    if (ThrottlePort <= 0) return 0; // No throttle input.
+
+    ThrottleSocket = socket (AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (ThrottleSocket < 0) return "cannot create throttle socket";
+
+    struct sockaddr_in address;
+    memset (&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(ThrottlePort);
+    if (bind (ThrottleSocket,
+              (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close (ThrottleSocket);
+        ThrottleSocket = -1;
+        return "cannot bind throttle socket";
+    }
+    fcntl (ThrottleSocket, F_SETFL, fcntl (ThrottleSocket, F_GETFL) | O_NONBLOCK);
+
+    ThrottleCapture = housecapture_register ("THROTTLE");
+
+    ThrottleMetricOk =
+        housedcc_metrics_counter ("housedcc_throttle_commands_total",
+                                  "result=\"ok\"",
+                                  "Commands received on the throttle port.");
+    ThrottleMetricError =
+        housedcc_metrics_counter ("housedcc_throttle_commands_total",
+                                  "result=\"error\"",
+                                  "Commands received on the throttle port.");
+    ThrottleMetricLatency =
+        housedcc_metrics_histogram ("housedcc_request_seconds",
+                                    "endpoint=\"throttle\"",
+                                    "Time spent handling each request.");
+
+    echttp_listen (ThrottleSocket, 1, housedcc_throttle_receive, 1);
+    houselog_event ("SERVICE", "dcc", "THROTTLE", "ON PORT %d", ThrottlePort);
+    return 0;
+}
+
+int housedcc_throttle_port (void) {
+    return (ThrottleSocket >= 0) ? ThrottlePort : 0;
+}
+
+int housedcc_throttle_background (time_t now) {
+
+    int changed = ThrottleLiveChanged;
+    ThrottleLiveChanged = 0;
+
+    if (ThrottleSocket < 0) return changed;
+
+    // A session ends when its vehicles would have stopped on lease expiry.
+    int refresh, lease;
+    housedcc_fleet_timing (&refresh, &lease);
+    long long expired = housedcc_timer_now () - (lease * 1000);
+
+    int i;
+    for (i = 0; i < THROTTLE_SESSIONS_MAX; ++i) {
+        DccThrottleSession *session = ThrottleSessions + i;
+        if ((session->seen <= 0) || (session->seen > expired)) continue;
+        housedcc_event_record ("THROTTLE", session->name, "EXPIRED",
+                               "PORT %d", ntohs(session->peer.sin_port));
+        session->seen = 0;
+        session->open = 0;
+    }
+    return changed;
+}
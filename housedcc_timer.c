@@ -0,0 +1,296 @@
+/* HouseDCC - A model train control service
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedcc_timer.c - Millisecond timers for the background activities.
+ *
+ * SYNOPSYS:
+ *
+ * This module schedules the time-driven activities: lease expirations,
+ * speed refreshes, speed ramps, PiDCC timeouts. Each activity owns a
+ * timer, which calls a handler when it expires. This replaces periodic
+ * scans of every item: only the timers that are due are ever touched.
+ *
+ * The timers are kept in a hashed timing wheel with a 1 millisecond tick:
+ * arming or cancelling a timer is O(1), whatever the number of timers.
+ * A timer that expires after more than one revolution of the wheel stays
+ * in its slot, and is only visited once per revolution until it is due.
+ * The wheel is driven by a timerfd registered with echttp, armed for the
+ * next occupied slot only: there is no wakeup when nothing is due.
+ *
+ * const char *housedcc_timer_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module. Return 0 on success, an error text otherwise.
+ *    This must be called before any other module declares a timer.
+ *
+ * int housedcc_timer_declare (DccTimerHandler *handler, int context);
+ *
+ *    Create a new timer. The handler is called with the context value
+ *    when the timer expires. The timer is not armed. Return the timer's
+ *    identifier, which is always > 0.
+ *
+ * void housedcc_timer_release (int timer);
+ *
+ *    Delete a timer that is no longer used. The timer is cancelled first.
+ *
+ * long long housedcc_timer_now (void);
+ *
+ *    Return the current time, in milliseconds. This is a monotonic time,
+ *    not related to the time of day.
+ *
+ * void housedcc_timer_start (int timer, long long delay);
+ * void housedcc_timer_at (int timer, long long deadline);
+ *
+ *    Arm a timer, replacing any previous deadline. The delay is in
+ *    milliseconds, the deadline is a time as returned by
+ *    housedcc_timer_now(). A timer always expires from the echttp loop,
+ *    never from within these calls, even if the deadline is in the past.
+ *
+ * void housedcc_timer_cancel (int timer);
+ *
+ *    Disarm a timer. This has no effect if the timer is not armed.
+ *
+ * int housedcc_timer_armed (int timer);
+ *
+ *    Return 1 if the timer is armed, 0 otherwise.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#include <echttp.h>
+
+#include "housedcc_timer.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define TIMER_SLOTS 1024 // One tick per slot. Must be a power of 2.
+#define TIMER_WORDS (TIMER_SLOTS / 64)
+
+// The wheel lists and the free list store the timer index plus one, so
+// that 0 means "no entry". A timer that is not armed has a deadline of 0
+// and is not part of any list.
+//
+typedef struct {
+    DccTimerHandler *handler;
+    int context;
+    long long deadline;
+    int next; // Slot list or free list.
+    int prev;
+} DccTimer;
+
+static DccTimer *Timers = 0;
+static int TimersCount = 0;
+static int TimersAllocated = 0;
+static int TimersFree = 0;
+
+static int TimerWheel[TIMER_SLOTS];
+static uint64_t TimerOccupied[TIMER_WORDS]; // One bit per non-empty slot.
+static int TimerArmed = 0; // Count of armed timers.
+
+static long long TimerCurrent = 0; // The latest tick processed.
+static long long TimerWakeup = 0;  // When the timerfd expires, 0 if not.
+static int TimerFd = -1;
+
+long long housedcc_timer_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return ((long long)now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
+
+static DccTimer *housedcc_timer_get (int timer) {
+    if ((timer <= 0) || (timer > TimersCount)) return 0;
+    DccTimer *entry = Timers + timer - 1;
+    if (!entry->handler) return 0; // Released.
+    return entry;
+}
+
+static void housedcc_timer_wakeup (long long deadline) {
+
+    if (TimerFd < 0) return;
+
+    struct itimerspec spec;
+    memset (&spec, 0, sizeof(spec));
+    if (deadline > 0) {
+        spec.it_value.tv_sec = deadline / 1000;
+        spec.it_value.tv_nsec = (deadline % 1000) * 1000000;
+    }
+    timerfd_settime (TimerFd, TFD_TIMER_ABSTIME, &spec, 0);
+    TimerWakeup = deadline;
+}
+
+// Return the time of the next occupied slot after the current tick, or 0
+// if the wheel is empty. This only looks at the occupied bitmap.
+//
+static long long housedcc_timer_next (void) {
+
+    if (TimerArmed <= 0) return 0;
+
+    int start = (int)((TimerCurrent + 1) & (TIMER_SLOTS - 1));
+    int i;
+    for (i = 0; i <= TIMER_WORDS; ++i) {
+        int word = ((start / 64) + i) % TIMER_WORDS;
+        uint64_t bits = TimerOccupied[word];
+        if (i == 0) bits &= ~((1ull << (start % 64)) - 1); // Skip past slots.
+        if (!bits) continue;
+        int slot = (word * 64) + __builtin_ctzll (bits);
+        int distance = (slot - start) & (TIMER_SLOTS - 1);
+        return TimerCurrent + 1 + distance;
+    }
+    return 0;
+}
+
+static void housedcc_timer_unlink (int timer) {
+
+    DccTimer *entry = Timers + timer - 1;
+    int slot = (int)(entry->deadline & (TIMER_SLOTS - 1));
+
+    if (entry->prev) Timers[entry->prev - 1].next = entry->next;
+    else TimerWheel[slot] = entry->next;
+    if (entry->next) Timers[entry->next - 1].prev = entry->prev;
+
+    if (!TimerWheel[slot]) TimerOccupied[slot / 64] &= ~(1ull << (slot % 64));
+
+    entry->next = entry->prev = 0;
+    entry->deadline = 0;
+    TimerArmed -= 1;
+}
+
+static void housedcc_timer_expire (int fd, int mode) {
+
+    uint64_t expirations;
+    if (read (TimerFd, &expirations, sizeof(expirations)) < 0) {
+        // Spurious wakeup: check anyway.
+    }
+    TimerWakeup = 0;
+
+    long long now = housedcc_timer_now ();
+
+    // Visit each slot since the last pass, but no more than one full
+    // revolution: past that, all slots have been visited already.
+    long long tick = TimerCurrent + 1;
+    if (now - TimerCurrent > TIMER_SLOTS) tick = now - TIMER_SLOTS + 1;
+
+    for (; tick <= now; ++tick) {
+        TimerCurrent = tick;
+        if (TimerArmed <= 0) break;
+        int slot = (int)(tick & (TIMER_SLOTS - 1));
+        int i = TimerWheel[slot];
+        while (i > 0) {
+            DccTimer *entry = Timers + i - 1;
+            if (entry->deadline > now) {
+                i = entry->next; // Due in a later revolution.
+                continue;
+            }
+            housedcc_timer_unlink (i);
+            entry->handler (entry->context);
+            i = TimerWheel[slot]; // The handler may have changed the list.
+        }
+    }
+    TimerCurrent = now;
+    housedcc_timer_wakeup (housedcc_timer_next ());
+}
+
+int housedcc_timer_declare (DccTimerHandler *handler, int context) {
+
+    int cursor;
+    if (TimersFree > 0) {
+        cursor = TimersFree - 1;
+        TimersFree = Timers[cursor].next;
+    } else {
+        if (TimersCount >= TimersAllocated) {
+            TimersAllocated += 64;
+            Timers = realloc (Timers, TimersAllocated * sizeof(DccTimer));
+        }
+        cursor = TimersCount++;
+    }
+    memset (Timers + cursor, 0, sizeof(DccTimer));
+    Timers[cursor].handler = handler;
+    Timers[cursor].context = context;
+    return cursor + 1;
+}
+
+void housedcc_timer_release (int timer) {
+
+    if (!housedcc_timer_get (timer)) return;
+    housedcc_timer_cancel (timer);
+    Timers[timer - 1].handler = 0;
+    Timers[timer - 1].next = TimersFree;
+    TimersFree = timer;
+}
+
+void housedcc_timer_at (int timer, long long deadline) {
+
+    DccTimer *entry = housedcc_timer_get (timer);
+    if (!entry) return;
+
+    if (entry->deadline) housedcc_timer_unlink (timer);
+
+    // Nothing to process while the wheel is empty: just catch up.
+    if (TimerArmed <= 0) TimerCurrent = housedcc_timer_now ();
+
+    // A deadline in the past expires on the next tick.
+    if (deadline <= TimerCurrent) deadline = TimerCurrent + 1;
+
+    int slot = (int)(deadline & (TIMER_SLOTS - 1));
+    entry->deadline = deadline;
+    entry->prev = 0;
+    entry->next = TimerWheel[slot];
+    if (entry->next) Timers[entry->next - 1].prev = timer;
+    TimerWheel[slot] = timer;
+    TimerOccupied[slot / 64] |= (1ull << (slot % 64));
+    TimerArmed += 1;
+
+    // Within one revolution, the slot is the exact deadline: wake up then.
+    // Further away, the slot is visited earlier, which is harmless.
+    long long wakeup = deadline;
+    if (deadline - TimerCurrent > TIMER_SLOTS)
+        wakeup = TimerCurrent + 1 +
+                 ((slot - (TimerCurrent + 1)) & (TIMER_SLOTS - 1));
+    if ((TimerWakeup <= 0) || (wakeup < TimerWakeup))
+        housedcc_timer_wakeup (wakeup);
+}
+
+void housedcc_timer_start (int timer, long long delay) {
+    housedcc_timer_at (timer, housedcc_timer_now () + delay);
+}
+
+void housedcc_timer_cancel (int timer) {
+    DccTimer *entry = housedcc_timer_get (timer);
+    if (entry && entry->deadline) housedcc_timer_unlink (timer);
+}
+
+int housedcc_timer_armed (int timer) {
+    DccTimer *entry = housedcc_timer_get (timer);
+    return entry && (entry->deadline > 0);
+}
+
+const char *housedcc_timer_initialize (int argc, const char **argv) {
+
+    TimerFd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (TimerFd < 0) return "cannot create timerfd";
+    TimerCurrent = housedcc_timer_now ();
+    echttp_listen (TimerFd, 1, housedcc_timer_expire, 1);
+    return 0;
+}
@@ -0,0 +1,35 @@
+/* HouseDCC - A model train control service
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedcc_timer.h - Millisecond timers for the background activities.
+ */
+typedef void DccTimerHandler (int context);
+
+const char *housedcc_timer_initialize (int argc, const char **argv);
+
+int  housedcc_timer_declare (DccTimerHandler *handler, int context);
+void housedcc_timer_release (int timer);
+
+long long housedcc_timer_now (void);
+
+void housedcc_timer_start (int timer, long long delay);
+void housedcc_timer_at (int timer, long long deadline);
+void housedcc_timer_cancel (int timer);
+int  housedcc_timer_armed (int timer);